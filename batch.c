@@ -0,0 +1,1022 @@
+#define _GNU_SOURCE     // for getline
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <fcntl.h>
+#include <fnmatch.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <linux/fs.h>
+
+#include "batch.h"
+#include "output.h"
+#include "stats.h"
+#include "simd.h"
+
+#define INITIAL_PLAN_ENTRIES    1024
+#define INITIAL_PLAN_GROUPS     256
+#define DEDUPE_CHUNK_SIZE       ( 16 * 1024 * 1024 )    // per ioctl call
+#define COMPARE_CHUNK_SIZE      ( 1024 * 1024 )
+
+typedef struct {
+    char            *path;
+    uint64_t        size, dev, ino;
+    int64_t         mtime_ns, ctime_ns;
+    size_t          group;      // index of its group
+    bool            keep;
+    bool            changed;    // since planned, when the plan is executed
+} plan_entry_t;
+
+typedef struct {
+    size_t          first, n;   // entries of the group
+    uint64_t        size;
+    bool            valid;      // some file to keep is still there
+    size_t          source;     // that file, to link, clone or dedupe from
+    atomic_size_t   done;       // files removed or replaced
+    atomic_uint_fast64_t reclaimed;
+} plan_group_t;
+
+struct _plan {
+    keep_policy_t   policy;
+    bool            has_policy;
+
+    pthread_mutex_t lock;       // protects the following members
+    plan_entry_t    *entries;
+    size_t          n_entries, max_entries;
+    plan_group_t    *groups;
+    size_t          n_groups, max_groups;
+};
+
+static void *malloc_or_exit( size_t size )
+{
+    void *d = malloc( size );
+    if ( NULL == d ) {
+        exit( NO_MEMORY_ERROR );
+    }
+    return d;
+}
+
+static void *realloc_or_exit( void *p, size_t size )
+{
+    void *d = realloc( p, size );
+    if ( NULL == d ) {
+        exit( NO_MEMORY_ERROR );
+    }
+    return d;
+}
+
+extern bool parse_keep_policy( const char *name, keep_policy_t *policy )
+{
+    policy->name = name;
+    policy->pattern = NULL;
+    policy->roots = NULL;
+    if ( 0 == strcmp( name, "oldest" ) ) {
+        policy->rule = KEEP_OLDEST;
+    } else if ( 0 == strcmp( name, "newest" ) ) {
+        policy->rule = KEEP_NEWEST;
+    } else if ( 0 == strcmp( name, "shortest" ) ) {
+        policy->rule = KEEP_SHORTEST;
+    } else if ( 0 == strcmp( name, "root" ) ) {
+        policy->rule = KEEP_ROOT;
+    } else if ( 0 == strncmp( name, "match=", 6 ) && '\0' != name[6] ) {
+        policy->rule = KEEP_MATCHING;
+        policy->pattern = &name[6];
+    } else {
+        return false;
+    }
+    return true;
+}
+
+extern plan_t *new_plan( const keep_policy_t *policy )
+{
+    plan_t *plan = malloc_or_exit( sizeof(plan_t) );
+    memset( plan, 0, sizeof(plan_t) );
+    if ( NULL != policy ) {
+        plan->policy = *policy;
+        plan->has_policy = true;
+    }
+    pthread_mutex_init( &plan->lock, NULL );
+    plan->max_entries = INITIAL_PLAN_ENTRIES;
+    plan->entries = malloc_or_exit( sizeof(plan_entry_t) * plan->max_entries );
+    plan->max_groups = INITIAL_PLAN_GROUPS;
+    plan->groups = malloc_or_exit( sizeof(plan_group_t) * plan->max_groups );
+    return plan;
+}
+
+extern void free_plan( plan_t *plan )
+{
+    for ( size_t i = 0; i < plan->n_entries; ++i ) {
+        free( plan->entries[i].path );
+    }
+    free( plan->entries );
+    free( plan->groups );
+    pthread_mutex_destroy( &plan->lock );
+    free( plan );
+}
+
+// the index of the first root containing path, or the number of roots
+static size_t root_index( const search_t *roots, const char *path )
+{
+    size_t i = 0;
+    for ( ; NULL != roots[i].path; ++i ) {
+        size_t len = strlen( roots[i].path );
+        if ( 0 == strncmp( path, roots[i].path, len ) &&
+             ( '/' == path[len] || ( len > 0 && '/' == path[len-1] ) ) ) {
+            break;
+        }
+    }
+    return i;
+}
+
+// set keep for the files to keep and return their number
+static size_t select_files( const keep_policy_t *policy,
+                            const plan_file_t *files, size_t n, bool *keep )
+{
+    if ( KEEP_MATCHING == policy->rule ) {
+        size_t kept = 0;
+        for ( size_t i = 0; i < n; ++i ) {
+            keep[i] = 0 == fnmatch( policy->pattern, files[i].path, 0 );
+            kept += keep[i];
+        }
+        return kept;
+    }
+    size_t best = 0;
+    for ( size_t i = 1; i < n; ++i ) {
+        int64_t cmp = 0;        // < 0 if file i is a better choice
+        switch ( policy->rule ) {
+        case KEEP_OLDEST:
+            cmp = ( files[i].info->mtime_ns < files[best].info->mtime_ns ) ? -1 :
+                  ( files[i].info->mtime_ns > files[best].info->mtime_ns );
+            break;
+        case KEEP_NEWEST:
+            cmp = ( files[i].info->mtime_ns > files[best].info->mtime_ns ) ? -1 :
+                  ( files[i].info->mtime_ns < files[best].info->mtime_ns );
+            break;
+        case KEEP_SHORTEST:
+            cmp = (int64_t)strlen( files[i].path ) -
+                  (int64_t)strlen( files[best].path );
+            break;
+        case KEEP_ROOT:
+            cmp = (int64_t)root_index( policy->roots, files[i].path ) -
+                  (int64_t)root_index( policy->roots, files[best].path );
+            break;
+        default:
+            break;
+        }
+        if ( cmp < 0 || ( 0 == cmp &&
+                          strcmp( files[i].path, files[best].path ) < 0 ) ) {
+            best = i;
+        }
+    }
+    for ( size_t i = 0; i < n; ++i ) {
+        keep[i] = ( i == best );
+    }
+    return 1;
+}
+
+// the following functions are called with the plan lock held, or before
+// the plan is shared
+
+static void start_group( plan_t *plan, uint64_t size )
+{
+    if ( plan->n_groups == plan->max_groups ) {
+        plan->max_groups *= 2;
+        plan->groups = realloc_or_exit( plan->groups,
+                                    sizeof(plan_group_t) * plan->max_groups );
+    }
+    plan_group_t *group = &plan->groups[plan->n_groups++];
+    group->first = plan->n_entries;
+    group->n = 0;
+    group->size = size;
+    group->valid = false;
+    group->source = 0;
+    atomic_init( &group->done, 0 );
+    atomic_init( &group->reclaimed, 0 );
+}
+
+// add a copy of entry, with path, to the last group
+static void add_entry( plan_t *plan, char *path, const plan_entry_t *entry )
+{
+    if ( plan->n_entries == plan->max_entries ) {
+        plan->max_entries *= 2;
+        plan->entries = realloc_or_exit( plan->entries,
+                                    sizeof(plan_entry_t) * plan->max_entries );
+    }
+    plan_entry_t *added = &plan->entries[plan->n_entries++];
+    *added = *entry;
+    added->path = path;
+    added->group = plan->n_groups - 1;
+    added->changed = false;
+    ++plan->groups[plan->n_groups - 1].n;
+}
+
+extern void plan_group( plan_t *plan, uint64_t size,
+                        const plan_file_t *files, size_t n )
+{
+    bool *keep = malloc_or_exit( sizeof(bool) * n );
+    size_t kept = select_files( &plan->policy, files, n, keep );
+    if ( 0 != kept && n != kept ) {     // something to keep and to remove
+        pthread_mutex_lock( &plan->lock );
+        start_group( plan, size );
+        for ( size_t i = 0; i < n; ++i ) {
+            char *path = strdup( files[i].path );
+            if ( NULL == path ) {
+                exit( NO_MEMORY_ERROR );
+            }
+            plan_entry_t entry = {
+                .size = size, .dev = files[i].info->dev,
+                .ino = files[i].info->ino,
+                .mtime_ns = files[i].info->mtime_ns,
+                .ctime_ns = files[i].info->ctime_ns, .keep = keep[i]
+            };
+            add_entry( plan, path, &entry );
+        }
+        pthread_mutex_unlock( &plan->lock );
+    }
+    free( keep );
+}
+
+static const plan_t *sorted_plan;   // only while sorting groups
+
+static int compare_groups( const void *g1, const void *g2 )
+{
+    const plan_group_t *group1 = *(const plan_group_t **)g1;
+    const plan_group_t *group2 = *(const plan_group_t **)g2;
+    if ( group1->size != group2->size ) {
+        return ( group1->size < group2->size ) ? -1 : 1;
+    }
+    return strcmp( sorted_plan->entries[group1->first].path,
+                   sorted_plan->entries[group2->first].path );
+}
+
+static void write_path( FILE *f, const char *path )
+{
+    for ( ; '\0' != *path; ++path ) {
+        if ( '\\' == *path ) {
+            fputs( "\\\\", f );
+        } else if ( '\n' == *path ) {
+            fputs( "\\n", f );
+        } else {
+            fputc( *path, f );
+        }
+    }
+}
+
+// count the files to remove and their total size
+static size_t count_removals( const plan_t *plan, uint64_t *bytes )
+{
+    size_t n = 0;
+    *bytes = 0;
+    for ( size_t i = 0; i < plan->n_entries; ++i ) {
+        if ( ! plan->entries[i].keep ) {
+            ++n;
+            *bytes += plan->entries[i].size;
+        }
+    }
+    return n;
+}
+
+extern void write_plan( plan_t *plan, const char *path )
+{
+    FILE *f = fopen( path, "w" );
+    if ( NULL == f ) {
+        fprintf( info_output(),
+                 "Unable to create plan file %s (errno %d) - exiting\n",
+                 path, errno );
+        exit( FILE_IO_ERROR );
+    }
+    plan_group_t **groups = malloc_or_exit( sizeof(plan_group_t *) *
+                                            ( plan->n_groups + 1 ) );
+    for ( size_t i = 0; i < plan->n_groups; ++i ) {
+        groups[i] = &plan->groups[i];
+    }
+    sorted_plan = plan;
+    qsort( groups, plan->n_groups, sizeof(plan_group_t *), compare_groups );
+
+    uint64_t bytes;
+    size_t n_removals = count_removals( plan, &bytes );
+    fprintf( f, "# fdup removal plan, keep %s\n",
+             ( plan->has_policy ) ? plan->policy.name : "as planned" );
+    fprintf( f, "# %zu files to remove in %zu groups, %lu bytes\n\n",
+             n_removals, plan->n_groups, bytes );
+    for ( size_t i = 0; i < plan->n_groups; ++i ) {
+        const plan_entry_t *entries = &plan->entries[groups[i]->first];
+        for ( size_t j = 0; j < groups[i]->n; ++j ) {
+            fprintf( f, "%s %lu %lu:%lu %ld:%ld ",
+                     ( entries[j].keep ) ? "keep" : "remove", entries[j].size,
+                     entries[j].dev, entries[j].ino,
+                     (long)entries[j].mtime_ns, (long)entries[j].ctime_ns );
+            write_path( f, entries[j].path );
+            fputc( '\n', f );
+        }
+        fputc( '\n', f );
+    }
+    free( groups );
+    if ( 0 != fclose( f ) ) {
+        fprintf( info_output(),
+                 "Unable to write plan file %s (errno %d) - exiting\n",
+                 path, errno );
+        exit( FILE_IO_ERROR );
+    }
+    fprintf( info_output(), "Planned removing %zu files in %zu groups, "
+             "%lu bytes, in %s\n", n_removals, plan->n_groups, bytes, path );
+}
+
+// unescape path in place, return false if it is invalid
+static bool read_path( char *path )
+{
+    char *to = path;
+    for ( const char *from = path; '\0' != *from; ++from ) {
+        if ( '\\' == *from ) {
+            ++from;
+            if ( 'n' == *from ) {
+                *to++ = '\n';
+            } else if ( '\\' == *from ) {
+                *to++ = '\\';
+            } else {
+                return false;
+            }
+        } else {
+            *to++ = *from;
+        }
+    }
+    *to = '\0';
+    return to != path;
+}
+
+// parse "<size> <dev>:<ino> <mtime_ns>:<ctime_ns> <path>"
+static bool read_entry( char *line, plan_entry_t *entry )
+{
+    char *end;
+    entry->size = strtoull( line, &end, 10 );
+    if ( end == line || ' ' != *end ) {
+        return false;
+    }
+    line = end + 1;
+    entry->dev = strtoull( line, &end, 10 );
+    if ( end == line || ':' != *end ) {
+        return false;
+    }
+    line = end + 1;
+    entry->ino = strtoull( line, &end, 10 );
+    if ( end == line || ' ' != *end ) {
+        return false;
+    }
+    line = end + 1;
+    entry->mtime_ns = strtoll( line, &end, 10 );
+    if ( end == line || ':' != *end ) {
+        return false;
+    }
+    line = end + 1;
+    entry->ctime_ns = strtoll( line, &end, 10 );
+    if ( end == line || ' ' != *end ) {
+        return false;
+    }
+    entry->path = end + 1;
+    return read_path( entry->path );
+}
+
+extern plan_t *read_plan( const char *path )
+{
+    FILE *f = fopen( path, "r" );
+    if ( NULL == f ) {
+        fprintf( info_output(),
+                 "Unable to open plan file %s (errno %d) - exiting\n",
+                 path, errno );
+        exit( FILE_IO_ERROR );
+    }
+    plan_t *plan = new_plan( NULL );
+    bool in_group = false;
+    char *line = NULL;
+    size_t len = 0;
+    ssize_t n;
+    for ( size_t line_number = 1;
+          -1 != ( n = getline( &line, &len, f ) ); ++line_number ) {
+        if ( n > 0 && '\n' == line[n-1] ) {
+            line[--n] = '\0';
+        }
+        if ( 0 == n ) {             // end of group
+            in_group = false;
+            continue;
+        }
+        if ( '#' == line[0] ) {
+            continue;
+        }
+        plan_entry_t entry;
+        size_t skip = 0;
+        if ( 0 == strncmp( line, "keep ", 5 ) ) {
+            entry.keep = true;
+            skip = 5;
+        } else if ( 0 == strncmp( line, "remove ", 7 ) ) {
+            entry.keep = false;
+            skip = 7;
+        }
+        if ( 0 == skip || ! read_entry( line + skip, &entry ) ) {
+            fprintf( info_output(), "Invalid plan file %s line %zu - exiting\n",
+                     path, line_number );
+            exit( ARGUMENT_ERROR );
+        }
+        if ( ! in_group ) {
+            start_group( plan, entry.size );
+            in_group = true;
+        }
+        char *entry_path = strdup( entry.path );
+        if ( NULL == entry_path ) {
+            exit( NO_MEMORY_ERROR );
+        }
+        add_entry( plan, entry_path, &entry );
+    }
+    free( line );
+    fclose( f );
+    return plan;
+}
+
+static const char *action_names[] = { "remove", "link", "clone", "dedupe" };
+static const char *action_done[] = { "removed", "linked", "cloned",
+                                     "deduplicated" };
+
+extern bool parse_action( const char *name, action_t *action )
+{
+    for ( int i = REMOVE_ACTION; i <= DEDUPE_ACTION; ++i ) {
+        if ( 0 == strcmp( name, action_names[i] ) ) {
+            *action = (action_t)i;
+            return true;
+        }
+    }
+    return false;
+}
+
+static atomic_uint temp_count;     // for unique temporary names
+
+static void temp_name( char *name, size_t len )
+{
+    snprintf( name, len, ".fdup-%d-%u.tmp", (int)getpid( ),
+              atomic_fetch_add( &temp_count, 1 ) );
+}
+
+// rename the temporary file over name, or remove it in case of failure
+static bool rename_temp( int dirfd, const char *temp, const char *name )
+{
+    if ( 0 == renameat( dirfd, temp, dirfd, name ) ) {
+        return true;
+    }
+    int err = errno;
+    unlinkat( dirfd, temp, 0 );
+    errno = err;
+    return false;
+}
+
+static bool link_file( const char *source, int dirfd, const char *name )
+{
+    char temp[64];
+    temp_name( temp, sizeof(temp) );
+    if ( 0 != linkat( AT_FDCWD, source, dirfd, temp, 0 ) ) {
+        return false;
+    }
+    return rename_temp( dirfd, temp, name );
+}
+
+// the clone gets the owner, mode and times of the file it replaces
+static bool clone_file( const char *source, int dirfd, const char *name,
+                        const struct stat *st )
+{
+    int src = open( source, O_RDONLY | O_CLOEXEC );
+    if ( -1 == src ) {
+        return false;
+    }
+    char temp[64];
+    temp_name( temp, sizeof(temp) );
+    int fd = openat( dirfd, temp, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC,
+                     st->st_mode & 07777 );
+    if ( -1 == fd ) {
+        int err = errno;
+        close( src );
+        errno = err;
+        return false;
+    }
+    bool cloned = 0 == ioctl( fd, FICLONE, src );
+    int err = errno;
+    close( src );
+    if ( cloned ) {     // as far as permissions allow
+        bool owned = 0 == fchown( fd, st->st_uid, st->st_gid );
+        fchmod( fd, st->st_mode & ( ( owned ) ? 07777 : 0777 ) );
+        struct timespec times[2] = { st->st_atim, st->st_mtim };
+        futimens( fd, times );
+    }
+    close( fd );
+    if ( ! cloned ) {
+        unlinkat( dirfd, temp, 0 );
+        errno = err;
+        return false;
+    }
+    return rename_temp( dirfd, temp, name );
+}
+
+// share the data of source in place. The kernel compares both files and
+// refuses to share data that differ.
+static bool dedupe_file( const char *source, int dirfd, const char *name,
+                         uint64_t size, uint64_t *deduped )
+{
+    int src = open( source, O_RDONLY | O_CLOEXEC );
+    if ( -1 == src ) {
+        return false;
+    }
+    int fd = openat( dirfd, name, O_RDONLY | O_CLOEXEC );
+    if ( -1 == fd ) {
+        int err = errno;
+        close( src );
+        errno = err;
+        return false;
+    }
+    // room for the request and the only destination
+    uint64_t buffer[( sizeof(struct file_dedupe_range) +
+                      sizeof(struct file_dedupe_range_info) ) / sizeof(uint64_t)];
+    struct file_dedupe_range *range = (struct file_dedupe_range *)buffer;
+    struct file_dedupe_range_info *dest = &range->info[0];
+    bool done = true;
+    for ( uint64_t offset = 0; offset < size && done; ) {
+        memset( buffer, 0, sizeof(buffer) );
+        range->src_offset = offset;
+        range->src_length = ( size - offset < DEDUPE_CHUNK_SIZE ) ?
+                                size - offset : DEDUPE_CHUNK_SIZE;
+        range->dest_count = 1;
+        dest->dest_fd = fd;
+        dest->dest_offset = offset;
+        if ( 0 != ioctl( src, FIDEDUPERANGE, range ) ) {
+            done = false;
+        } else if ( dest->status < 0 ) {
+            errno = -dest->status;
+            done = false;
+        } else if ( FILE_DEDUPE_RANGE_DIFFERS == dest->status ||
+                    0 == dest->bytes_deduped ) {
+            errno = EILSEQ;     // contents differ
+            done = false;
+        } else {
+            offset += dest->bytes_deduped;
+            *deduped += dest->bytes_deduped;
+        }
+    }
+    int err = errno;
+    close( fd );
+    close( src );
+    errno = err;
+    return done;
+}
+
+// apply action to name in dirfd, whose status is st. On success, add the
+// number of bytes reclaimed.
+static bool act_at( action_t action, const char *source, int dirfd,
+                    const char *name, const struct stat *st,
+                    uint64_t *reclaimed )
+{
+    bool done = false;
+    switch ( action ) {
+    case REMOVE_ACTION:
+        done = 0 == unlinkat( dirfd, name, 0 );
+        break;
+    case LINK_ACTION:
+        done = link_file( source, dirfd, name );
+        break;
+    case CLONE_ACTION:
+        done = clone_file( source, dirfd, name, st );
+        break;
+    case DEDUPE_ACTION:     // bytes now shared, some may have been already
+        return dedupe_file( source, dirfd, name, st->st_size, reclaimed );
+    }
+    if ( done && 1 == st->st_nlink ) {  // otherwise no space is reclaimed
+        *reclaimed += st->st_size;
+    }
+    return done;
+}
+
+/*
+    The plan is carried out in two parallel passes: groups are checked
+    first, to make sure that some file to keep is still there, then the
+    other files of valid groups are removed or replaced, one directory at
+    a time.
+*/
+typedef struct {
+    plan_t          *plan;
+    action_t        action;
+    atomic_size_t   next;       // next group or directory to process
+    plan_entry_t    **removals; // sorted by directory
+    size_t          n_removals;
+    size_t          *dirs;      // first removal of each directory
+    size_t          n_dirs;
+    atomic_size_t   done, skipped;
+    atomic_uint_fast64_t bytes; // space actually reclaimed
+} execution_t;
+
+static int64_t time_ns( const struct timespec *t )
+{
+    return (int64_t)t->tv_sec * 1000000000 + t->tv_nsec;
+}
+
+// still the same file with the same contents, as far as its status tells.
+// The change time is only checked before anything is done, as removing
+// another name of a file changes it.
+static bool same_file( const struct stat *st, const plan_entry_t *entry )
+{
+    return S_ISREG( st->st_mode ) && (uint64_t)st->st_size == entry->size &&
+           (uint64_t)st->st_dev == entry->dev &&
+           (uint64_t)st->st_ino == entry->ino &&
+           time_ns( &st->st_mtim ) == entry->mtime_ns;
+}
+
+static bool unchanged( const struct stat *st, const plan_entry_t *entry )
+{
+    return same_file( st, entry ) && time_ns( &st->st_ctim ) == entry->ctime_ns;
+}
+
+static void *check_groups( void *arg )
+{
+    execution_t *exec = arg;
+    plan_t *plan = exec->plan;
+    while ( true ) {
+        size_t i = atomic_fetch_add( &exec->next, 1 );
+        if ( i >= plan->n_groups ) {
+            break;
+        }
+        plan_group_t *group = &plan->groups[i];
+        plan_entry_t *entries = &plan->entries[group->first];
+        for ( size_t j = 0; j < group->n; ++j ) {
+            struct stat st;
+            entries[j].changed = 0 != fstatat( AT_FDCWD, entries[j].path, &st,
+                                               AT_SYMLINK_NOFOLLOW ) ||
+                                 ! unchanged( &st, &entries[j] );
+            if ( entries[j].keep && ! entries[j].changed && ! group->valid ) {
+                group->valid = true;
+                group->source = group->first + j;
+            }
+        }
+        add_count( STAT_COUNT, group->n );
+    }
+    return NULL;
+}
+
+// length of the directory part of path, without the last '/'
+static size_t dir_length( const char *path )
+{
+    const char *slash = strrchr( path, '/' );
+    return ( NULL == slash ) ? 0 : (size_t)( slash - path );
+}
+
+static const char *base_name( const char *path )
+{
+    const char *slash = strrchr( path, '/' );
+    return ( NULL == slash ) ? path : slash + 1;
+}
+
+static int compare_removals( const void *e1, const void *e2 )
+{
+    const char *p1 = (*(const plan_entry_t **)e1)->path;
+    const char *p2 = (*(const plan_entry_t **)e2)->path;
+    size_t l1 = dir_length( p1 ), l2 = dir_length( p2 );
+    int cmp = memcmp( p1, p2, ( l1 < l2 ) ? l1 : l2 );
+    if ( 0 != cmp ) {
+        return cmp;
+    }
+    if ( l1 != l2 ) {
+        return ( l1 < l2 ) ? -1 : 1;
+    }
+    return strcmp( base_name( p1 ), base_name( p2 ) );
+}
+
+typedef struct {
+    uint64_t        dev, ino;
+} inode_t;
+
+static int compare_inodes( const void *i1, const void *i2 )
+{
+    const inode_t *inode1 = i1, *inode2 = i2;
+    if ( inode1->dev != inode2->dev ) {
+        return ( inode1->dev < inode2->dev ) ? -1 : 1;
+    }
+    if ( inode1->ino != inode2->ino ) {
+        return ( inode1->ino < inode2->ino ) ? -1 : 1;
+    }
+    return 0;
+}
+
+// inodes of all files to keep, sorted
+static inode_t *kept_inodes( const plan_t *plan, size_t *n )
+{
+    inode_t *kept = malloc_or_exit( sizeof(inode_t) * ( plan->n_entries + 1 ) );
+    *n = 0;
+    for ( size_t i = 0; i < plan->n_entries; ++i ) {
+        if ( plan->entries[i].keep ) {
+            kept[*n].dev = plan->entries[i].dev;
+            kept[*n].ino = plan->entries[i].ino;
+            ++*n;
+        }
+    }
+    qsort( kept, *n, sizeof(inode_t), compare_inodes );
+    return kept;
+}
+
+static int open_dir( const char *path )
+{
+    size_t len = dir_length( path );
+    if ( NULL == strchr( path, '/' ) ) {
+        return open( ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC );
+    }
+    if ( 0 == len ) {
+        return open( "/", O_RDONLY | O_DIRECTORY | O_CLOEXEC );
+    }
+    char *dir = strndup( path, len );
+    if ( NULL == dir ) {
+        exit( NO_MEMORY_ERROR );
+    }
+    int fd = open( dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC );
+    free( dir );
+    return fd;
+}
+
+extern bool apply_action( action_t action, const char *source,
+                          const char *path, uint64_t *reclaimed )
+{
+    struct stat st, source_st;
+    if ( REMOVE_ACTION != action ) {
+        add_count( STAT_COUNT, 2 );
+        if ( 0 != stat( source, &source_st ) || 0 != stat( path, &st ) ) {
+            return false;
+        }
+        if ( source_st.st_dev != st.st_dev ) {
+            errno = EXDEV;
+            return false;
+        }
+    }
+    int dirfd = open_dir( path );
+    if ( -1 == dirfd ) {
+        return false;
+    }
+    const char *name = base_name( path );
+    add_count( STAT_COUNT, 1 );
+    bool done = 0 == fstatat( dirfd, name, &st, AT_SYMLINK_NOFOLLOW ) &&
+                act_at( action, source, dirfd, name, &st, reclaimed );
+    int err = errno;
+    close( dirfd );
+    errno = err;
+    return done;
+}
+
+// read up to len bytes at offset, fewer only at the end of the file
+static ssize_t read_full( int fd, unsigned char *buffer, size_t len,
+                          off_t offset )
+{
+    size_t total = 0;
+    while ( total < len ) {
+        ssize_t n = pread( fd, buffer + total, len - total, offset + total );
+        if ( n < 0 && EINTR == errno ) {
+            continue;
+        }
+        if ( n < 0 ) {
+            return -1;
+        }
+        if ( 0 == n ) {
+            break;
+        }
+        total += (size_t)n;
+    }
+    return (ssize_t)total;
+}
+
+// compare the contents of source and of name in dirfd, whose status is st,
+// right before acting on it. Any error counts as a difference.
+static bool same_content( const char *source, int dirfd, const char *name,
+                          const struct stat *st )
+{
+    int src = open( source, O_RDONLY | O_CLOEXEC );
+    int fd = openat( dirfd, name, O_RDONLY | O_NOFOLLOW | O_CLOEXEC );
+    struct stat fd_st;
+    bool same = -1 != src && -1 != fd && 0 == fstat( fd, &fd_st ) &&
+                fd_st.st_dev == st->st_dev && fd_st.st_ino == st->st_ino;
+    unsigned char *b1 = NULL, *b2 = NULL;
+    if ( same ) {
+        add_count( OPEN_COUNT, 2 );
+        b1 = malloc_or_exit( COMPARE_CHUNK_SIZE );
+        b2 = malloc_or_exit( COMPARE_CHUNK_SIZE );
+    }
+    for ( off_t offset = 0; same; offset += COMPARE_CHUNK_SIZE ) {
+        ssize_t n1 = read_full( src, b1, COMPARE_CHUNK_SIZE, offset );
+        ssize_t n2 = read_full( fd, b2, COMPARE_CHUNK_SIZE, offset );
+        same = n1 >= 0 && n1 == n2 && same_bytes( b1, b2, (size_t)n1 );
+        if ( n1 < COMPARE_CHUNK_SIZE ) {
+            break;
+        }
+    }
+    free( b1 );
+    free( b2 );
+    if ( -1 != src ) {
+        close( src );
+    }
+    if ( -1 != fd ) {
+        close( fd );
+    }
+    return same;
+}
+
+static void act_on_entry( execution_t *exec, int dirfd,
+                          const plan_entry_t *entry )
+{
+    FILE *info = info_output( );
+    const char *verb = action_names[exec->action];
+    plan_group_t *group = &exec->plan->groups[entry->group];
+    const plan_entry_t *source = &exec->plan->entries[group->source];
+    struct stat st;
+    const char *name = base_name( entry->path );
+    uint64_t reclaimed = 0;
+    add_count( STAT_COUNT, -1 != dirfd );
+    if ( -1 == dirfd ||
+         0 != fstatat( dirfd, name, &st, AT_SYMLINK_NOFOLLOW ) ) {
+        fprintf( info, "Failed to %s %s (errno %d)\n", verb, entry->path, errno );
+    } else if ( entry->changed || ! same_file( &st, entry ) ) {
+        fprintf( info, "Not %s %s: changed since planned\n",
+                 action_done[exec->action], entry->path );
+    } else if ( REMOVE_ACTION != exec->action && source->dev != entry->dev ) {
+        fprintf( info, "Unable to %s %s: not on the file system of %s\n",
+                 verb, entry->path, source->path );
+    } else if ( DEDUPE_ACTION != exec->action &&    // the kernel compares
+                ! same_content( source->path, dirfd, name, &st ) ) {
+        fprintf( info, "Not %s %s: contents differ from %s\n",
+                 action_done[exec->action], entry->path, source->path );
+    } else if ( ! act_at( exec->action, source->path, dirfd, name, &st,
+                          &reclaimed ) ) {
+        fprintf( info, "Failed to %s %s (errno %d)\n", verb, entry->path, errno );
+    } else {
+        atomic_fetch_add( &exec->done, 1 );
+        atomic_fetch_add( &exec->bytes, reclaimed );
+        atomic_fetch_add( &group->done, 1 );
+        atomic_fetch_add( &group->reclaimed, reclaimed );
+        return;
+    }
+    atomic_fetch_add( &exec->skipped, 1 );
+}
+
+static void *remove_files( void *arg )
+{
+    execution_t *exec = arg;
+    while ( true ) {
+        size_t i = atomic_fetch_add( &exec->next, 1 );
+        if ( i >= exec->n_dirs ) {
+            break;
+        }
+        size_t first = exec->dirs[i];
+        size_t last = ( i + 1 < exec->n_dirs ) ? exec->dirs[i+1] : exec->n_removals;
+        int dirfd = open_dir( exec->removals[first]->path );
+        for ( size_t j = first; j < last; ++j ) {
+            act_on_entry( exec, dirfd, exec->removals[j] );
+        }
+        if ( -1 != dirfd ) {
+            close( dirfd );
+        }
+    }
+    return NULL;
+}
+
+static void run_workers( int n_threads, size_t n_tasks,
+                         void *(*worker)( void * ), execution_t *exec )
+{
+    atomic_store( &exec->next, 0 );
+    if ( (size_t)n_threads > n_tasks ) {
+        n_threads = (int)n_tasks;
+    }
+    if ( n_threads <= 1 ) {
+        worker( exec );
+        return;
+    }
+    pthread_t *threads = malloc_or_exit( sizeof(pthread_t) * n_threads );
+    for ( int i = 0; i < n_threads; ++i ) {
+        if ( 0 != pthread_create( &threads[i], NULL, worker, exec ) ) {
+            fprintf( info_output(),
+                     "Unable to create removal thread - exiting\n" );
+            exit( INTERNAL_ERROR );
+        }
+    }
+    for ( int i = 0; i < n_threads; ++i ) {
+        pthread_join( threads[i], NULL );
+    }
+    free( threads );
+}
+
+static bool confirm_plan( const plan_t *plan, action_t action )
+{
+    uint64_t bytes;
+    size_t n = count_removals( plan, &bytes );
+    FILE *info = info_output( );
+    fprintf( info, " Confirm %s %zu files in %zu groups, %lu bytes\n",
+             ( REMOVE_ACTION == action ) ? "removing" : "replacing",
+             n, plan->n_groups, bytes );
+    fprintf( info, "> Enter Y or N: " );
+    fflush( info );
+    char buffer[10];
+    int len = read( fileno(stdin), buffer, sizeof(buffer) );
+    return 2 == len && 'Y' == ( buffer[0] & 0x5f );
+}
+
+// space reclaimed per group, in size and path order
+static void report_groups( plan_t *plan, action_t action )
+{
+    plan_group_t **groups = malloc_or_exit( sizeof(plan_group_t *) *
+                                            ( plan->n_groups + 1 ) );
+    for ( size_t i = 0; i < plan->n_groups; ++i ) {
+        groups[i] = &plan->groups[i];
+    }
+    sorted_plan = plan;
+    qsort( groups, plan->n_groups, sizeof(plan_group_t *), compare_groups );
+    FILE *info = info_output( );
+    for ( size_t i = 0; i < plan->n_groups; ++i ) {
+        size_t done = atomic_load( &groups[i]->done );
+        if ( 0 != done ) {
+            fprintf( info, "size %lu: %zu files %s, %lu bytes reclaimed, "
+                     "keeping %s\n", groups[i]->size, done,
+                     action_done[action], atomic_load( &groups[i]->reclaimed ),
+                     plan->entries[groups[i]->source].path );
+        }
+    }
+    free( groups );
+}
+
+extern void execute_plan( plan_t *plan, action_t action,
+                          int n_threads, bool confirm )
+{
+    FILE *info = info_output( );
+    if ( 0 == plan->n_groups ) {
+        fprintf( info, "No file to %s\n", action_names[action] );
+        return;
+    }
+    if ( confirm && ! confirm_plan( plan, action ) ) {
+        fprintf( info, "No file %s\n", action_done[action] );
+        return;
+    }
+    execution_t exec;
+    memset( &exec, 0, sizeof(exec) );
+    exec.plan = plan;
+    exec.action = action;
+    run_workers( n_threads, plan->n_groups, check_groups, &exec );
+
+    size_t n_kept;
+    inode_t *kept = kept_inodes( plan, &n_kept );
+    exec.removals = malloc_or_exit( sizeof(plan_entry_t *) *
+                                    ( plan->n_entries + 1 ) );
+    for ( size_t i = 0; i < plan->n_groups; ++i ) {
+        const plan_group_t *group = &plan->groups[i];
+        plan_entry_t *entries = &plan->entries[group->first];
+        for ( size_t j = 0; j < group->n; ++j ) {
+            inode_t inode = { entries[j].dev, entries[j].ino };
+            if ( entries[j].keep ) {
+                continue;
+            }
+            if ( NULL != bsearch( &inode, kept, n_kept, sizeof(inode_t),
+                                  compare_inodes ) ) {
+                fprintf( info, "Not %s %s: also planned to be kept\n",
+                         action_done[action], entries[j].path );
+                ++exec.skipped;
+            } else if ( group->valid ) {
+                exec.removals[exec.n_removals++] = &entries[j];
+            } else {
+                fprintf( info, "Not %s %s: no file to keep is left "
+                         "unchanged\n", action_done[action], entries[j].path );
+                ++exec.skipped;
+            }
+        }
+    }
+    free( kept );
+    qsort( exec.removals, exec.n_removals, sizeof(plan_entry_t *),
+           compare_removals );
+    size_t n_removals = 0;      // the same file may be planned twice
+    for ( size_t i = 0; i < exec.n_removals; ++i ) {
+        if ( 0 == n_removals || 0 != strcmp( exec.removals[i]->path,
+                                        exec.removals[n_removals-1]->path ) ) {
+            exec.removals[n_removals++] = exec.removals[i];
+        }
+    }
+    exec.n_removals = n_removals;
+    exec.dirs = malloc_or_exit( sizeof(size_t) * ( exec.n_removals + 1 ) );
+    for ( size_t i = 0; i < exec.n_removals; ++i ) {
+        const char *p1 = exec.removals[i]->path;
+        if ( 0 == i || dir_length( p1 ) !=
+                       dir_length( exec.removals[i-1]->path ) ||
+             0 != memcmp( p1, exec.removals[i-1]->path, dir_length( p1 ) ) ) {
+            exec.dirs[exec.n_dirs++] = i;
+        }
+    }
+    run_workers( n_threads, exec.n_dirs, remove_files, &exec );
+
+    report_groups( plan, action );
+    fprintf( info, "%zu files %s, %lu bytes reclaimed\n",
+             atomic_load( &exec.done ), action_done[action],
+             atomic_load( &exec.bytes ) );
+    if ( 0 != atomic_load( &exec.skipped ) ) {
+        fprintf( info, "%zu planned files were not %s\n",
+                 atomic_load( &exec.skipped ), action_done[action] );
+    }
+    free( exec.dirs );
+    free( exec.removals );
+}
@@ -0,0 +1,114 @@
+#ifndef __BATCH_H__
+#define __BATCH_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "comp.h"
+#include "walk.h"
+
+/*
+    Batch removal of identical files, without questions. In each group of
+    identical files, a keep policy selects the files to keep, and all
+    others are planned for removal:
+
+    - oldest:   keep the file with the oldest modification time
+    - newest:   keep the file with the newest modification time
+    - shortest: keep the file with the shortest path
+    - root:     keep the file found under the first search path given
+    - match=<pattern>: keep all files whose path matches the shell pattern
+                (fnmatch, where '*' also matches '/'). Groups without any
+                matching file are left alone.
+
+    Ties are resolved in favor of the first path in byte order, so that the
+    same files are kept whatever the order of the group.
+
+    A plan is either carried out right away, or written to a plan file to
+    be reviewed, possibly edited, and replayed later. A plan file has one
+    line per file, and groups end with an empty line:
+        keep <size> <dev>:<ino> <mtime_ns>:<ctime_ns> <path>
+        remove <size> <dev>:<ino> <mtime_ns>:<ctime_ns> <path>
+    Lines starting with '#' are comments. Backslashes and newlines in paths
+    are written as \\ and \n.
+
+    Removals are spread over a few threads, one directory at a time, with
+    unlinkat relative to the open directory. A file is removed only if it is
+    still the same inode with the same size and times, if at least one file
+    kept in its group still exists, unchanged, and if both files still have
+    the same bytes, compared right before the removal, so that the last copy
+    of some content is never removed, even if files changed since planned,
+    in place or with their times restored. A file kept in any group is
+    never removed, even if another group plans its removal.
+
+    Instead of being removed, files can be replaced, so that all paths
+    remain and space is still reclaimed:
+    - link:   by a hard link to the file kept
+    - clone:  by a copy sharing the data of the file kept (FICLONE), with
+              the owner, mode and times of the file replaced
+    - dedupe: in place, by sharing the data of the file kept, once the
+              kernel has checked that contents are identical (FIDEDUPERANGE)
+    Links and clones are made under a temporary name in the same directory,
+    then renamed over the file replaced, so that its path never refers to a
+    missing or incomplete file. Files kept and replaced must be on the same
+    file system, and clone and dedupe need a file system sharing extents,
+    such as btrfs or XFS.
+*/
+
+typedef enum {
+    REMOVE_ACTION, LINK_ACTION, CLONE_ACTION, DEDUPE_ACTION
+} action_t;
+
+typedef enum {
+    KEEP_OLDEST, KEEP_NEWEST, KEEP_SHORTEST, KEEP_ROOT, KEEP_MATCHING
+} keep_rule_t;
+
+typedef struct {
+    keep_rule_t     rule;
+    const char      *name;      // as given
+    const char      *pattern;   // KEEP_MATCHING only
+    const search_t  *roots;     // KEEP_ROOT only, ended by a NULL path
+} keep_policy_t;
+
+typedef struct {
+    const char          *path;
+    const file_info_t   *info;
+} plan_file_t;
+
+typedef struct _plan plan_t;
+
+// parse an action name (remove, link, clone or dedupe). Return false if it
+// is unknown.
+extern bool parse_action( const char *name, action_t *action );
+
+// remove or replace path, which is identical to source (unused to remove).
+// Return false in case of failure, with errno set. Otherwise, add to
+// reclaimed the number of bytes reclaimed.
+extern bool apply_action( action_t action, const char *source,
+                          const char *path, uint64_t *reclaimed );
+
+// parse a keep policy name. Return false if it is unknown. Roots are set
+// separately.
+extern bool parse_keep_policy( const char *name, keep_policy_t *policy );
+
+// policy is NULL for a plan read from a file
+extern plan_t *new_plan( const keep_policy_t *policy );
+extern void free_plan( plan_t *plan );
+
+// select the files to keep among n identical files, and add the group to
+// the plan. Thread safe.
+extern void plan_group( plan_t *plan, uint64_t size,
+                        const plan_file_t *files, size_t n );
+
+// write the plan file, groups sorted by size and path
+extern void write_plan( plan_t *plan, const char *path );
+
+// read a plan file, exit if it is invalid
+extern plan_t *read_plan( const char *path );
+
+// remove or replace the files planned for removal with n_threads, and
+// report the space reclaimed per group. If confirm is true, the plan is
+// summarized and confirmed as a whole first.
+extern void execute_plan( plan_t *plan, action_t action,
+                          int n_threads, bool confirm );
+
+#endif /* __BATCH_H__ */
@@ -0,0 +1,271 @@
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include "comp.h"
+#include "cache.h"
+#include "output.h"
+
+#define CACHE_MAGIC     "FDUPHASH"
+#define CACHE_VERSION   1
+
+typedef struct {
+    char            magic[8];
+    uint32_t        version;
+    uint32_t        entry_size;
+    uint64_t        n_entries;
+} cache_header_t;
+
+// entries are saved in the cache file sorted by dev and ino
+typedef struct {
+    uint64_t        dev, ino, size;
+    int64_t         mtime_ns, ctime_ns;
+    uint64_t        sample;
+    digest_t        digest;
+    uint32_t        flags;
+    uint32_t        reserved;
+} cache_entry_t;
+
+// state of entries loaded from the cache file
+#define ENTRY_USED      (1 << 0)    // looked up during this run
+#define ENTRY_REPLACED  (1 << 1)    // superseded by a new entry
+
+#define INITIAL_ADDED_SIZE  1024
+
+struct _cache {
+    char            *path;
+    cache_entry_t   *entries;       // loaded from the cache file
+    atomic_uchar    *state;         // one per loaded entry
+    size_t          n_entries;
+
+    pthread_mutex_t lock;           // protects the following members
+    cache_entry_t   *added;         // new entries, in no particular order
+    size_t          n_added, max_added;
+    bool            modified;
+};
+
+static void *malloc_or_exit( size_t size )
+{
+    void *d = malloc( size );
+    if ( NULL == d ) {
+        exit( NO_MEMORY_ERROR );
+    }
+    return d;
+}
+
+static void load_cache( cache_t *cache )
+{
+    FILE *f = fopen( cache->path, "rb" );
+    if ( NULL == f ) {
+        if ( ENOENT != errno ) {
+            fprintf( info_output(),
+                     "Warning: unable to open cache file %s (errno %d)\n",
+                     cache->path, errno );
+        }
+        return;                 // no cache yet
+    }
+    // the number of entries must match the file size before it is trusted
+    cache_header_t header;
+    struct stat stat_data;
+    if ( 1 != fread( &header, sizeof(header), 1, f ) ||
+         0 != memcmp( header.magic, CACHE_MAGIC, sizeof(header.magic) ) ||
+         CACHE_VERSION != header.version ||
+         sizeof(cache_entry_t) != header.entry_size ||
+         0 != fstat( fileno( f ), &stat_data ) ||
+         header.n_entries != ( (uint64_t)stat_data.st_size - sizeof(header) ) /
+                                                    sizeof(cache_entry_t) ||
+         0 != ( (uint64_t)stat_data.st_size - sizeof(header) ) %
+                                                    sizeof(cache_entry_t) ) {
+        fprintf( info_output(),
+                 "Warning: ignoring invalid cache file %s\n", cache->path );
+        fclose( f );
+        return;
+    }
+    cache->entries = malloc_or_exit( sizeof(cache_entry_t) * header.n_entries );
+    if ( header.n_entries != fread( cache->entries, sizeof(cache_entry_t),
+                                    header.n_entries, f ) ) {
+        fprintf( info_output(),
+                 "Warning: ignoring truncated cache file %s\n", cache->path );
+        free( cache->entries );
+        cache->entries = NULL;
+        fclose( f );
+        return;
+    }
+    fclose( f );
+    cache->n_entries = header.n_entries;
+    cache->state = malloc_or_exit( sizeof(atomic_uchar) * cache->n_entries );
+    for ( size_t i = 0; i < cache->n_entries; ++i ) {
+        atomic_init( &cache->state[i], 0 );
+    }
+}
+
+extern cache_t *open_cache( const char *path, bool reset )
+{
+    cache_t *cache = malloc_or_exit( sizeof(cache_t) );
+    cache->path = malloc_or_exit( strlen( path ) + 1 );
+    strcpy( cache->path, path );
+    cache->entries = NULL;
+    cache->state = NULL;
+    cache->n_entries = 0;
+    pthread_mutex_init( &cache->lock, NULL );
+    cache->added = NULL;
+    cache->n_added = cache->max_added = 0;
+    cache->modified = reset;    // invalidated cache must be rewritten
+
+    if ( ! reset ) {
+        load_cache( cache );
+    }
+    return cache;
+}
+
+static int compare_keys( const void *e1, const void *e2 )
+{
+    const cache_entry_t *ce1 = e1, *ce2 = e2;
+    if ( ce1->dev != ce2->dev ) {
+        return ( ce1->dev < ce2->dev ) ? -1 : 1;
+    }
+    if ( ce1->ino != ce2->ino ) {
+        return ( ce1->ino < ce2->ino ) ? -1 : 1;
+    }
+    return 0;
+}
+
+static cache_entry_t *find_entry( cache_t *cache, const file_info_t *info )
+{
+    if ( 0 == cache->n_entries ) {
+        return NULL;
+    }
+    cache_entry_t key;
+    key.dev = info->dev;
+    key.ino = info->ino;
+    return bsearch( &key, cache->entries, cache->n_entries,
+                    sizeof(cache_entry_t), compare_keys );
+}
+
+extern bool cache_lookup( cache_t *cache, const file_info_t *info,
+                          cache_data_t *data )
+{
+    cache_entry_t *entry = find_entry( cache, info );
+    if ( NULL == entry ) {
+        return false;
+    }
+    atomic_fetch_or( &cache->state[entry - cache->entries], ENTRY_USED );
+    if ( entry->size != info->size || entry->mtime_ns != info->mtime_ns ||
+         entry->ctime_ns != info->ctime_ns ) {
+        return false;           // file was modified since it was cached
+    }
+    data->flags = entry->flags;
+    data->sample = entry->sample;
+    data->digest = entry->digest;
+    return true;
+}
+
+extern void cache_update( cache_t *cache, const file_info_t *info,
+                          const cache_data_t *data )
+{
+    cache_entry_t *entry = find_entry( cache, info );
+    if ( NULL != entry ) {
+        atomic_fetch_or( &cache->state[entry - cache->entries], ENTRY_REPLACED );
+    }
+
+    pthread_mutex_lock( &cache->lock );
+    if ( cache->n_added == cache->max_added ) {
+        cache->max_added = ( 0 == cache->max_added ) ?
+                                INITIAL_ADDED_SIZE : 2 * cache->max_added;
+        cache->added = realloc( cache->added,
+                                sizeof(cache_entry_t) * cache->max_added );
+        if ( NULL == cache->added ) {
+            exit( NO_MEMORY_ERROR );
+        }
+    }
+    cache_entry_t *added = &cache->added[cache->n_added++];
+    memset( added, 0, sizeof(cache_entry_t) );
+    added->dev = info->dev;
+    added->ino = info->ino;
+    added->size = info->size;
+    added->mtime_ns = info->mtime_ns;
+    added->ctime_ns = info->ctime_ns;
+    added->flags = data->flags;
+    added->sample = data->sample;
+    added->digest = data->digest;
+    cache->modified = true;
+    pthread_mutex_unlock( &cache->lock );
+}
+
+static bool save_cache( cache_t *cache, cache_entry_t *entries, size_t n )
+{
+    char *tmp_path = malloc_or_exit( strlen( cache->path ) + 5 );
+    strcpy( tmp_path, cache->path );
+    strcat( tmp_path, ".tmp" );
+
+    FILE *f = fopen( tmp_path, "wb" );
+    if ( NULL == f ) {
+        free( tmp_path );
+        return false;
+    }
+    cache_header_t header;
+    memset( &header, 0, sizeof(header) );
+    memcpy( header.magic, CACHE_MAGIC, sizeof(header.magic) );
+    header.version = CACHE_VERSION;
+    header.entry_size = sizeof(cache_entry_t);
+    header.n_entries = n;
+
+    bool done = 1 == fwrite( &header, sizeof(header), 1, f ) &&
+                n == fwrite( entries, sizeof(cache_entry_t), n, f ) &&
+                0 == fflush( f ) && 0 == fsync( fileno( f ) );
+    if ( 0 != fclose( f ) ) {
+        done = false;
+    }
+    if ( done ) {   // atomically replace the previous cache
+        done = 0 == rename( tmp_path, cache->path );
+    }
+    if ( ! done ) {
+        unlink( tmp_path );
+    }
+    free( tmp_path );
+    return done;
+}
+
+extern void close_cache( cache_t *cache, bool compact )
+{
+    if ( cache->modified || compact ) {
+        size_t n = 0;
+        cache_entry_t *entries = malloc_or_exit( sizeof(cache_entry_t) *
+                                    ( cache->n_entries + cache->n_added + 1 ) );
+        for ( size_t i = 0; i < cache->n_entries; ++i ) {
+            unsigned char state = atomic_load( &cache->state[i] );
+            if ( 0 == ( state & ENTRY_REPLACED ) &&
+                 ( ! compact || 0 != ( state & ENTRY_USED ) ) ) {
+                entries[n++] = cache->entries[i];
+            }
+        }
+        memcpy( &entries[n], cache->added, sizeof(cache_entry_t) * cache->n_added );
+        n += cache->n_added;
+        qsort( entries, n, sizeof(cache_entry_t), compare_keys );
+
+        size_t kept = 0;            // the same file may have been added twice
+        for ( size_t i = 0; i < n; ++i ) {
+            if ( 0 == kept || 0 != compare_keys( &entries[kept-1], &entries[i] ) ) {
+                entries[kept++] = entries[i];
+            }
+        }
+        if ( ! save_cache( cache, entries, kept ) ) {
+            fprintf( info_output(),
+                     "Warning: unable to save cache file %s (errno %d)\n",
+                     cache->path, errno );
+        }
+        free( entries );
+    }
+    pthread_mutex_destroy( &cache->lock );
+    free( cache->added );
+    free( cache->state );
+    free( cache->entries );
+    free( cache->path );
+    free( cache );
+}
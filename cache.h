@@ -0,0 +1,48 @@
+#ifndef __CACHE_H__
+#define __CACHE_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "hash.h"
+#include "walk.h"
+
+/*
+    Persistent cache of file samples and digests, so that files unchanged
+    since the previous run do not have to be read again. Entries are keyed
+    by device and inode, and are valid only if size, modification time and
+    status change time are still the same.
+
+    The cache file is read entirely when opened and rewritten atomically
+    (written to a temporary file, then renamed) when closed, only if it was
+    modified. Lookups and updates are thread safe.
+*/
+
+#define CACHED_SAMPLE   (1 << 0)
+#define CACHED_DIGEST   (1 << 1)
+
+typedef struct {
+    uint32_t        flags;      // CACHED_SAMPLE and/or CACHED_DIGEST
+    uint64_t        sample;
+    digest_t        digest;
+} cache_data_t;
+
+typedef struct _cache cache_t;
+
+// open the cache file at path, if it exists. If reset is true, its current
+// content is ignored (invalidated) and replaced when the cache is closed.
+extern cache_t *open_cache( const char *path, bool reset );
+
+// return true if data for this file is in the cache and still valid
+extern bool cache_lookup( cache_t *cache, const file_info_t *info,
+                          cache_data_t *data );
+
+// replace any previous data for this file
+extern void cache_update( cache_t *cache, const file_info_t *info,
+                          const cache_data_t *data );
+
+// save the cache if modified. If compact is true, the saved cache keeps
+// only the entries that were looked up or updated during this run.
+extern void close_cache( cache_t *cache, bool compact );
+
+#endif /* __CACHE_H__ */
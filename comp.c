@@ -4,36 +4,32 @@
 #include <string.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/resource.h>
+#include <fcntl.h>
 #include <dirent.h>
 #include <unistd.h>
 #include <errno.h>
 #include <stdint.h>
+#include <stddef.h>
 #include <assert.h>
 #include <magic.h>
-
-#ifdef TIME_MEASURE
-#include <time.h>   // only for timing measurements
-#endif
+#include <pthread.h>
+#include <stdatomic.h>
 
 #include "comp.h"
-
-#ifdef TIME_MEASURE
-#define SEC_TO_NANOSEC(s)       ((s)*1000000000)
-#define NANOSEC_TO_MILLISEC(n)  ((n)/1000000)
-static int64_t get_nanosecond_timestamp( void )
-{
-    uint64_t nanoseconds;
-    struct timespec ts;
-    if ( -1 == clock_gettime(CLOCK_MONOTONIC_RAW, &ts) ) {
-        printf("Failed to obtain timestamp. errno = %i: %s\n", errno,
-               strerror(errno));
-        nanoseconds = UINT64_MAX; // use this to indicate error
-    } else {
-        nanoseconds = SEC_TO_NANOSEC((uint64_t)ts.tv_sec) + (uint64_t)ts.tv_nsec;
-    }
-    return nanoseconds;
-}
-#endif
+#include "hash.h"
+#include "pool.h"
+#include "walk.h"
+#include "cache.h"
+#include "index.h"
+#include "reader.h"
+#include "mapped.h"
+#include "output.h"
+#include "batch.h"
+#include "tree.h"
+#include "simd.h"
+#include "stats.h"
+#include "trace.h"
 
 static void *malloc_or_exit( size_t size )
 {
@@ -44,135 +40,312 @@ static void *malloc_or_exit( size_t size )
     return d;
 }
 
-// return true if path is NOT used for other purpose, allowing it to be freed
-typedef bool (*process_file_t)( char *path, size_t size, void *context );
+/*
+    Streaming comparison of 2 files of the same size. Files are compared
+    chunk by chunk on their whole length. The chunk size starts small and
+    doubles at each step, so that files differing early are rejected after
+    reading very little, while large identical files are read with large
+    chunks. Buffers belong to each call so that several comparisons may be
+    done at the same time. Chunk offsets are always multiples of 4 KB, and
+    buffers are aligned, so that files opened with O_DIRECT can be read.
+*/
+#define MIN_COMPARE_CHUNK   ( 4 * 1024 )
+#define MAX_COMPARE_CHUNK   ( 1024 * 1024 )
 
-static void traverse_directory( char *path, bool nosub,
-                                process_file_t process, void *ctxt)
+// buffer allocated with room for reading size bytes with O_DIRECT
+static void *alloc_buffer_or_exit( size_t size )
 {
-//    printf( "Entering directory %s\n", path );
-    DIR *ref_dir = opendir( path );
-    if ( NULL == ref_dir ) {
-        printf( "Unable to open directory %s (errno %d) - exiting\n", path, errno );
-        exit(FILE_IO_ERROR);
+    void *d;
+    size = ( size + DIRECT_ALIGN - 1 ) & ~(size_t)( DIRECT_ALIGN - 1 );
+    if ( 0 != posix_memalign( &d, DIRECT_ALIGN, size ) ) {
+        exit( NO_MEMORY_ERROR );
     }
+    return d;
+}
 
-    while ( true ) {
-        struct dirent *ref_de = readdir( ref_dir );
-        if ( NULL == ref_de ) {
+// Read exactly len bytes at offset, unless end of file is reached first.
+// With READ_DIRECT, the read length is rounded up to the O_DIRECT alignment.
+// Return false with errno set if the file cannot be read.
+static bool read_chunk( int fd, char *buffer, size_t len, off_t offset,
+                        unsigned flags, size_t *nread )
+{
+    size_t want = len;
+    if ( flags & READ_DIRECT ) {
+        want = ( len + DIRECT_ALIGN - 1 ) & ~(size_t)( DIRECT_ALIGN - 1 );
+    }
+    size_t n = 0;
+    while ( n < want ) {
+        ssize_t res = pread( fd, buffer + n, want - n, offset + (off_t)n );
+        if ( res < 0 ) {
+            if ( EINTR == errno ) {
+                continue;
+            }
+            return false;
+        }
+        if ( 0 == res ) {
             break;
         }
-
-        unsigned char ref_detype = ref_de->d_type;
-        char * ref_dename = ref_de->d_name;
-        if ( ref_dename[0] == '.' ) {
-            if ( ref_dename[1] == 0 || ( ref_dename[1] == '.' && ref_dename[2] == 0 ) )
-                continue;       // skip parent and current directory
+        n += (size_t)res;
+        if ( ( flags & READ_DIRECT ) && 0 != n % DIRECT_ALIGN ) {
+            break;      // end of file
         }
+    }
+    release_read_pages( fd, (uint64_t)offset, want, flags );
+    *nread = ( n < len ) ? n : len;
+    return true;
+}
 
-        int cur_path_size = strlen(path);
-        char *new_path = malloc_or_exit( cur_path_size + strlen(ref_dename) + 2 );
-        strcpy( new_path, path );
-        if ( '/' != path[cur_path_size-1]) {
-            new_path[cur_path_size] = '/';
-            ++cur_path_size;
-        }
-        strcpy( new_path + cur_path_size, ref_dename );
-        struct stat stat_data;
-        int res;
+// a file that cannot be read is reported, and taken as different from all
+static void read_ref_error( const pool_t *pool, file_ref_t ref, int err )
+{
+    char *path = pool_path( pool, ref );
+    fprintf( info_output(),
+             "Warning: error reading file %s (errno %d)\n", path, err );
+    free( path );
+}
 
-        switch ( ref_detype ) {
-        case DT_REG:
-            res = stat( new_path, &stat_data );
-            if ( res != 0 ) {
-                printf( "unable to stat regular file %s\n", new_path );
-                exit(FILE_IO_ERROR);
-            }
-//            printf( "size %ld, path %s\n", stat_data.st_size, new_path );
-            if ( process( new_path, stat_data.st_size, ctxt ) ) {
-                free( new_path );
-            }
+// If nread is not NULL, the number of bytes read is added to *nread. A
+// file that cannot be read is reported and found different.
+static bool stream_compare( const pool_t *pool, file_ref_t ref1, int fd1,
+                            file_ref_t ref2, int fd2, size_t size,
+                            size_t *nread, unsigned flags )
+{
+    size_t max_chunk = ( size < MAX_COMPARE_CHUNK ) ? size : MAX_COMPARE_CHUNK;
+    if ( 0 == max_chunk ) {
+        max_chunk = 1;  // still check both files are actually empty
+    }
+    char *buffer1 = alloc_buffer_or_exit( max_chunk );
+    char *buffer2 = alloc_buffer_or_exit( max_chunk );
+
+    bool same = true;
+    size_t chunk = MIN_COMPARE_CHUNK;
+    off_t offset = 0;
+    while ( true ) {
+        if ( chunk > max_chunk ) {
+            chunk = max_chunk;
+        }
+        size_t n1, n2;
+        if ( ! read_chunk( fd1, buffer1, chunk, offset, flags, &n1 ) ) {
+            read_ref_error( pool, ref1, errno );
+            same = false;
             break;
-        case DT_DIR:
-            if ( ! nosub ) {
-                traverse_directory( new_path, nosub, process, ctxt );
-            }
-            free( new_path );
+        }
+        if ( ! read_chunk( fd2, buffer2, chunk, offset, flags, &n2 ) ) {
+            read_ref_error( pool, ref2, errno );
+            same = false;
             break;
-        default:
-            printf( "Skipping special file %s\n", new_path );
-            free( new_path );
+        }
+        if ( NULL != nread ) {
+            *nread += n1 + n2;
+        }
+        if ( n1 != n2 || ! same_bytes( buffer1, buffer2, n1 ) ) {
+            same = false;   // n1 != n2 if a file was modified after stat
+            add_count( SHORT_CUT_COUNT, (size_t)offset + n1 < size );
             break;
         }
+        if ( n1 < chunk ) {
+            break;          // end of both files
+        }
+        offset += (off_t)n1;
+        chunk *= 2;
     }
-    closedir( ref_dir );
+    free( buffer1 );
+    free( buffer2 );
+    return same;
 }
 
-#define MAX_STATIC_BUFFER_SIZE  (2 * 1024 * 1024 )
-static bool bin_compare( FILE *f1, FILE *f2 )
+// Compare large files through mappings with READ_MAPPED, or if the mapped
+// comparison fails because a file was truncated, with regular reads. A file
+// that could not be opened (fd -1) is different from all.
+static bool compare_files( const pool_t *pool, file_ref_t ref1, int fd1,
+                           file_ref_t ref2, int fd2, size_t size,
+                           size_t *nread, unsigned flags )
 {
-    static char buffer1[ MAX_STATIC_BUFFER_SIZE ];
-    static char buffer2[ MAX_STATIC_BUFFER_SIZE ];
-
-    fseek( f1, 0, SEEK_SET );       // f1 may be used multiple times
-    size_t n1 = fread( buffer1, 1, MAX_STATIC_BUFFER_SIZE, f1 );
-    size_t n2 = fread( buffer2, 1, MAX_STATIC_BUFFER_SIZE, f2 );
-    if ( n1 != n2 ) return false;   // should never happen, sizes are the same
-
-    for ( size_t i = 0; i < n1; ++ i ) {
-        if ( buffer1[i] != buffer2[i] )
-            return false;
+    if ( -1 == fd1 || -1 == fd2 ) {
+        return false;       // already reported when opened
     }
-    return true;
+    uint64_t span = trace_start( );
+    bool same;
+    if ( ! ( ( flags & READ_MAPPED ) && size >= MAPPED_MIN_SIZE &&
+             mapped_compare( fd1, fd2, size, nread, &same ) ) ) {
+        same = stream_compare( pool, ref1, fd1, ref2, fd2, size, nread, flags );
+    }
+    trace_span( span, "compare", NULL, "size", size );
+    return same;
 }
 
 /*
-    Use a simple map with file size as key. Since multiple files can have
-    the same size, the data is linked list of file paths with the same size.
+    All files found are kept in a flat table of fixed size records, which
+    is sorted by size once the directories are walked, so that files with
+    the same size are contiguous. File references point to directory and
+    file names in a pool, from which full paths are rebuilt only to open or
+    show files. When looking for duplicates among all files, files alone
+    with their size are removed from the table in the same pass.
 
-    key = size -> data = name_list_t of names allocated in memory
+    Hard links and bind mounts give several names to the same inode. Before
+    comparing the files of a size, they are sorted by inode and only the
+    first name of each inode is read.
+
+    Search paths may also be index files (see index.h). Their entries are
+    added to the table as records named by their full path, which is in the
+    mapped index, and their samples and digests are taken from the index:
+    files found in an index are never read.
 */
 
-// used for storing list of files with the same size
-// The prev list is circular with the head item pointing to the last one
-// this allow O(0) access to the last item during creation
-typedef struct _name_list {
-    struct _name_list   *next;  // regular linked list ending with NULL
-    struct _name_list   *prev;  // circular linked list during creation
-    char                *name;
-} name_list_t;
-
-// once created the orignal list is never directly modified. Instead, each
-// time lists need modification, they are first duplicated. After duplication
-// the prev linked list is not circular anymore (head->prev is NULL)
-static name_list_t *duplicate_list( const name_list_t *l )
-{
-    name_list_t *dl, *p;
-    dl = p = NULL;
-    for ( const name_list_t *item = l; NULL != item; item = item->next ) {
-        name_list_t *d = malloc_or_exit( sizeof( name_list_t ) );
-        d->name = item->name;
-        d->prev = p;
-        d->next = NULL;
-        if ( NULL == dl ) {
-            dl = d;
+typedef struct {
+    file_info_t     info;       // size, dev, ino and times
+    file_ref_t      ref;
+} file_record_t;
+
+typedef struct {
+    uint64_t    sample;     // hash of head and tail blocks
+    digest_t    digest;     // full content digest
+    file_ref_t  ref;
+    const file_info_t *info;
+    uint32_t    cached;     // CACHED_SAMPLE/DIGEST found in cache
+    uint32_t    computed;   // CACHED_SAMPLE/DIGEST calculated in this run
+    bool        truncated;  // file truncated or unreadable while being read
+} candidate_t;
+
+typedef struct {
+    index_t         *index;
+    name_ref_t      paths;      // reference of the first index path in pool
+    size_t          paths_len;
+} search_index_t;
+
+struct _collection {
+    file_record_t   *records;   // sorted by size
+    size_t          n_records;
+    size_t          n_singles;  // files removed, alone with their size
+    pool_t          *pool;
+    search_index_t  *indexes;   // search paths that are index files
+    size_t          n_indexes;
+};
+
+// return the index entry of a file found in an index, or NULL
+static const index_entry_t *indexed_entry( const collection_t *files,
+                                           file_ref_t ref )
+{
+    if ( NO_DIR != ref.dir ) {
+        return NULL;
+    }
+    for ( size_t i = 0; i < files->n_indexes; ++i ) {
+        const search_index_t *si = &files->indexes[i];
+        if ( ref.name >= si->paths && ref.name < si->paths + si->paths_len ) {
+            return index_path_entry( si->index, ref.name - si->paths );
+        }
+    }
+    return NULL;
+}
+
+// return the first record with that size and the number of such records
+static file_record_t *find_size( const collection_t *files, size_t size,
+                                 size_t *n )
+{
+    size_t low = 0, high = files->n_records;
+    while ( low < high ) {      // first record with at least size
+        size_t mid = low + ( high - low ) / 2;
+        if ( files->records[mid].info.size < size ) {
+            low = mid + 1;
         } else {
-            p->next = d;
+            high = mid;
+        }
+    }
+    size_t end = low;
+    while ( end < files->n_records && files->records[end].info.size == size ) {
+        ++end;
+    }
+    *n = end - low;
+    return &files->records[low];
+}
+
+// LSD radix sort by size, one byte at a time, skipping the bytes that are
+// the same in all sizes. The sort is stable: files with the same size stay
+// in the order they were found.
+static void sort_by_size( file_record_t *records, size_t n )
+{
+    size_t (*counts)[256] = malloc_or_exit( sizeof(size_t) * 256 * 8 );
+    memset( counts, 0, sizeof(size_t) * 256 * 8 );
+    for ( size_t i = 0; i < n; ++i ) {
+        uint64_t size = records[i].info.size;
+        for ( int b = 0; b < 8; ++b ) {
+            ++counts[b][( size >> ( 8 * b ) ) & 0xff];
         }
-        p = d;
     }
-    return dl;
+    file_record_t *tmp = malloc_or_exit( sizeof(file_record_t) * ( n + 1 ) );
+    file_record_t *src = records, *dst = tmp;
+    for ( int b = 0; b < 8 && n > 1; ++b ) {
+        size_t *count = counts[b];
+        if ( count[( src[0].info.size >> ( 8 * b ) ) & 0xff] == n ) {
+            continue;
+        }
+        size_t offset = 0;
+        for ( int v = 0; v < 256; ++v ) {   // counts become first indexes
+            size_t c = count[v];
+            count[v] = offset;
+            offset += c;
+        }
+        for ( size_t i = 0; i < n; ++i ) {
+            dst[count[( src[i].info.size >> ( 8 * b ) ) & 0xff]++] = src[i];
+        }
+        file_record_t *t = src;
+        src = dst;
+        dst = t;
+    }
+    if ( src != records ) {
+        memcpy( records, src, sizeof(file_record_t) * n );
+    }
+    free( tmp );
+    free( counts );
+}
+
+// make room in the table for n more records
+static void reserve_records( collection_t *files, size_t n )
+{
+    file_record_t *records = realloc( files->records, sizeof(file_record_t) *
+                                      ( files->n_records + n + 1 ) );
+    if ( NULL == records ) {
+        exit( NO_MEMORY_ERROR );
+    }
+    files->records = records;
+}
+
+// add the n entries of an index to the table, which has room for them, as
+// records named by their path in the index
+static void add_index_records( collection_t *files, const search_index_t *si,
+                               const index_entry_t *entries, size_t n )
+{
+    file_record_t *records = files->records;
+    for ( size_t i = 0; i < n; ++i ) {
+        if ( entries[i].path >= si->paths_len ) {
+            fprintf( info_output(), "Error: corrupted index file - exiting\n" );
+            exit( FILE_IO_ERROR );
+        }
+        file_record_t *record = &records[files->n_records++];
+        record->info.size = entries[i].size;
+        record->info.dev = entries[i].dev;
+        record->info.ino = entries[i].ino;
+        record->info.mtime_ns = entries[i].mtime_ns;
+        record->info.ctime_ns = entries[i].ctime_ns;
+        record->ref.dir = NO_DIR;
+        record->ref.name = si->paths + entries[i].path;
+    }
 }
 
-// shallow free, does not free the file name here (still in use in the
-// original list)
-static void free_duplicate_list( name_list_t *l)
+// add all indexed files to the table, not sorted
+static void add_all_index_records( collection_t *files )
 {
-    name_list_t *entry = l;
-    while ( NULL != entry ) {
-        name_list_t *to_remove = entry;
-        entry = entry->next;
-        free( to_remove );
+    size_t n_indexed = 0;
+    for ( size_t i = 0; i < files->n_indexes; ++i ) {
+        size_t n;
+        const index_entry_t *entries = index_entries( files->indexes[i].index, &n );
+        reserve_records( files, n );
+        add_index_records( files, &files->indexes[i], entries, n );
+        n_indexed += n;
+    }
+    if ( 0 != n_indexed ) {
+        fprintf( info_output( ), "Loaded %ld files from %ld index files\n",
+                 n_indexed, files->n_indexes );
     }
 }
 
@@ -281,21 +454,121 @@ static void view_file( magic_t cookie, const char *path )
     printf( "No viewer defined for %s\n", desc );
 }
 
+/*
+    Candidates go through successive elimination stages: files are first
+    grouped by size, then each size group is split according to a small
+    sample taken from the head and tail of each file, and only the files
+    left with the same sample are fully read once, to calculate their
+    digest. Files with the same digest are duplicates, unless the optional
+    byte to byte verification finds otherwise.
+
+    In lockstep mode, files with the same size are instead compared all at
+    once, without digest (see lockstep_partition).
+*/
+typedef enum {
+    SIZE_STAGE, SAMPLE_STAGE, DIGEST_STAGE, VERIFY_STAGE, LOCKSTEP_STAGE,
+    N_STAGES
+} stage_t;
+
+typedef struct {
+    size_t      dropped;    // number of files eliminated at that stage
+    size_t      bytes;      // number of bytes read at that stage
+    size_t      cached;     // number of files not read thanks to the cache
+} stage_stats_t;
+
+static const char *STAGE_NAMES[N_STAGES] = {
+    "size", "sample", "digest", "verify", "lockstep"
+};
+
+#define SAMPLE_BLOCK_SIZE   4096    // size of head and tail sample blocks
+
+typedef struct _bucket bucket_t;
+
+// file descriptors left for lockstep comparisons, shared by all workers so
+// that one worker can use the whole budget for a large group
+typedef struct {
+    size_t          available;
+    pthread_mutex_t lock;
+    pthread_cond_t  released;
+} fd_pool_t;
+
 typedef struct {
-    const char  *path;
-    map_t       *map;
+    collection_t *files;
+    pool_t      *pool;
+    cache_t     *cache;     // NULL if no cache is used
+    reader_t    *reader;    // NULL if contents are not compared
     magic_t     cookie;
+    FILE        *out;       // where duplicates are reported
+    bucket_t    *bucket;    // size bucket being processed
+    atomic_bool *stop;      // set when interactive removal is stopped
+    plan_t      *plan;      // batch removal plan, or NULL
     size_t      redundant;
+    size_t      links;      // names of an inode already found with another name
+    stage_stats_t stats[N_STAGES];
+    size_t      fd_budget;  // max number of files open at once in lockstep
+    fd_pool_t   *fds;       // shared by workers, NULL out of process_buckets
     bool        compare;
+    bool        lockstep;
+    unsigned    read_flags; // READ_MAPPED, READ_NOCACHE or READ_DIRECT
+    bool        verify;
     bool        remove;
     bool        confirm;
-    bool        zero;
+    action_t    action;     // what to do with the files selected for removal
+    cache_data_t *known;    // with -d, per record, read in the first pass
+    tree_t      *tree;      // with -d, once directories are grouped
 
 } target_context_t;
 
+/*
+    Size buckets are independent, and they are processed concurrently by
+    a few workers, largest buckets first so that a big bucket started last
+    does not delay the end. Each bucket is reported in its own memory
+    stream, and reports are printed by the main thread in size order, once
+    all previous buckets are done, so that the output does not depend on
+    the number of workers.
+
+    With interactive removal, the duplicate groups found in a bucket are
+    kept with their position in the report, and the main thread asks which
+    files to remove right after printing each group.
+*/
+typedef struct _removal_group {
+    struct _removal_group *next;
+    long        offset;     // end of the group in the bucket report
+    char        **names;
+    int         nnames;
+} removal_group_t;
+
+struct _bucket {
+    size_t      size;
+    file_record_t *records;     // slice of the file table
+    size_t      n_records;
+    file_record_t *targets;     // with -t, slice of the target table
+    size_t      n_targets;
+    char        *report;    // memory stream, set once done
+    size_t      report_len;
+    removal_group_t *groups, *last_group;
+    bool        done;       // protected by the bucket queue lock
+};
+
+static void add_removal_group( bucket_t *bucket, long offset,
+                               char **names, int nnames )
+{
+    removal_group_t *group = malloc_or_exit( sizeof(removal_group_t) );
+    group->next = NULL;
+    group->offset = offset;
+    group->names = names;
+    group->nnames = nnames;
+    if ( NULL == bucket->groups ) {
+        bucket->groups = group;
+    } else {
+        bucket->last_group->next = group;
+    }
+    bucket->last_group = group;
+}
+
 // return true to stop immediately, false to keep processing files
 static bool interactive_remove_files( target_context_t *tc,
-                                      const name_list_t *names, int nnames )
+                                      char **names, int nnames )
 {
     while ( true ) {
         printf( "> Enter v to view content, x to exit, or a space separated "
@@ -315,17 +588,13 @@ static bool interactive_remove_files( target_context_t *tc,
                     return true;
                 }
                 if ( 'v' == *end || 'V' == *end ) {
-                    view_file( tc->cookie, names[0].name );
+                    view_file( tc->cookie, names[0] );
                     break;
                 }
                 long int val = strtol( end, &end, 10 );
 //                printf( "val %ld nnames %d\n", val, nnames );
                 if ( val < nnames ) {
-                    const name_list_t *cur = names;
-                    for ( int i = 0; i < val; ++i ) {
-                        cur = cur->next;
-                    }
-                    to_remove[k++] = cur->name;
+                    to_remove[k++] = names[val];
                 }
                 while ( *end == ' ' && end - buffer < n ) ++end;
             }
@@ -346,11 +615,29 @@ static bool interactive_remove_files( target_context_t *tc,
                     do_remove = true;
                 }
                 if ( do_remove ) {
+                    const char *source = NULL;  // first name not selected
+                    for ( int i = 0; i < nnames && NULL == source; ++i ) {
+                        source = names[i];
+                        for ( int j = 0; j < k; ++j ) {
+                            if ( to_remove[j] == names[i] ) {
+                                source = NULL;
+                            }
+                        }
+                    }
+                    uint64_t reclaimed = 0;
                     for ( int i = 0; i < k; ++i ) {
-                        if ( -1 == remove( to_remove[i] ) ) {
-                            printf( "Failed to remove %s\n", to_remove[i] );
+                        if ( REMOVE_ACTION != tc->action && NULL == source ) {
+                            printf( "Not replacing %s: no file left to keep\n",
+                                    to_remove[i] );
+                        } else if ( ! apply_action( tc->action, source,
+                                                    to_remove[i], &reclaimed ) ) {
+                            printf( "Failed to %s %s (errno %d)\n",
+                                    ( REMOVE_ACTION == tc->action ) ?
+                                        "remove" : "replace",
+                                    to_remove[i], errno );
                         }
                     }
+                    printf( " %lu bytes reclaimed\n", reclaimed );
                     free(to_remove);
                     free( buffer );
                     return false;
@@ -365,380 +652,2194 @@ static bool interactive_remove_files( target_context_t *tc,
     }
 }
 
-static bool compare_all( target_context_t *tc, size_t size,
-                         const name_list_t *name_list )
+static void set_output_file( output_file_t *file, const char *path,
+                             const file_info_t *info, const char *role )
 {
-    // if nothing to compare ()0 or 1 name), just return
-    if ( NULL == name_list || NULL == name_list->next ) return false;
+    file->path = path;
+    file->dev = info->dev;
+    file->ino = info->ino;
+    file->role = role;
+}
 
-    // list is modified below - must make a copy of the original map content
-    name_list_t *list = duplicate_list( name_list );
-    name_list_t *same;
+static int compare_output_paths( const void *f1, const void *f2 )
+{
+    return strcmp( ((const output_file_t *)f1)->path,
+                   ((const output_file_t *)f2)->path );
+}
 
-    bool stop = false;
-    while ( true ) {
-        same = list;        // move head of list in same (tentatively)
-        list = list->next;  // remove head from list
-        list->prev = NULL;
-        same->next = NULL;
-        same->prev = NULL;
-        name_list_t *last_same = same;
-
-        FILE *f1 = fopen( same->name, "rb" );
-        if ( NULL == f1 ) {
-            printf( "Failed to open file %s (errno %d) exiting\n",
-                    same->name, errno );
-            exit(FILE_IO_ERROR);
-        }
-
-        name_list_t *next_item;
-        for ( name_list_t *item = list; item; item = next_item ) {
-            FILE *f2 = fopen( item->name, "rb" );
-            if ( NULL == f2 ) {
-                printf( "Failed to open file %s (errno %d) exiting\n",
-                        item->name, errno );
-                exit(FILE_IO_ERROR);
-            }
-            next_item = item->next;
-            if ( bin_compare( f1, f2 ) ) {  // same: move item to same list
-                if ( NULL != item->prev ) {
-                    item->prev->next = item->next;
-                } else {
-                    list = item->next;
-                }
-                if ( NULL != item->next ) {
-                    item->next->prev = item->prev;
-                }
-                last_same->next = item;
-                item->next = NULL;
-                item->prev = last_same;
-                last_same = item;
-            }
-            fclose( f2 );
-        }
-        if ( same->next ) { // at least 2 names in same list
-            name_list_t *cur = same;
-            int nnames = 0;
-            printf( "size %ld\n", size );
-            while ( cur ) {
-                printf( "  %s\n", cur->name );
-                ++nnames;
-                cur = cur->next;
-            }
-            tc->redundant += nnames - 1;    // all but one are redundant
-            if ( tc->remove ) {    // ask which names to remove (sep with ' ')
-                stop = interactive_remove_files( tc, same, nnames );
-            }
-        }
-        fclose( f1 );
-        free_duplicate_list( same );
-        if ( stop ) {
-            free_duplicate_list( list );
-            break;
+static int compare_planned_paths( const void *f1, const void *f2 )
+{
+    return strcmp( ((const plan_file_t *)f1)->path,
+                   ((const plan_file_t *)f2)->path );
+}
+
+// report n >= 2 identical files
+// return true to stop immediately, false to keep processing files
+static bool report_same( target_context_t *tc, size_t size,
+                         const candidate_t *same, size_t n )
+{
+    int nnames = (int)n;
+    char **names = malloc_or_exit( sizeof(char *) * nnames );
+    output_file_t *files = malloc_or_exit( sizeof(output_file_t) * n );
+    for ( int i = 0; i < nnames; ++i ) {
+        names[i] = pool_path( tc->pool, same[i].ref );
+        set_output_file( &files[i], names[i], same[i].info, NULL );
+    }
+    // digests are known unless files were compared only in lockstep
+    bool digest = 0 != ( ( same[0].cached | same[0].computed ) & CACHED_DIGEST );
+    output_group( tc->out, "duplicates", size,
+                  ( digest ) ? &same[0].digest : NULL, files, n );
+    free( files );
+    if ( NULL != tc->plan ) {
+        plan_file_t *planned = malloc_or_exit( sizeof(plan_file_t) * n );
+        for ( size_t i = 0; i < n; ++i ) {
+            planned[i].path = names[i];
+            planned[i].info = same[i].info;
         }
-        if ( NULL == list || NULL == list->next ) {
-            if ( NULL != list ) {
-                free_duplicate_list( list );
-            }
-            break;      // single left in original list cannot match any other
+        plan_group( tc->plan, size, planned, n );
+        free( planned );
+    }
+    tc->redundant += nnames - 1;    // all but one are redundant
+    if ( tc->remove ) {     // removal is requested when the report is shown
+        add_removal_group( tc->bucket, ftell( tc->out ), names, nnames );
+    } else {
+        for ( int i = 0; i < nnames; ++i ) {
+            free( names[i] );
         }
+        free( names );
     }
-    return stop;
+    return atomic_load( tc->stop );
 }
 
-// called for every map entry, unless it returns true
-static bool visit_entries( uint32_t index, const void *key,
-                           const void *data, void *ctxt )
+// return -1 if the file cannot be opened, once reported: it is then taken
+// as different from all files
+static int open_ref( const pool_t *pool, file_ref_t ref, unsigned flags )
 {
-    (void)index;
-    target_context_t *tc = ctxt;
-    size_t size = (size_t)key;
-    const name_list_t *list = data;
+    char *path = pool_path( pool, ref );
+    int fd = open_read_file( path, flags );
+    if ( -1 == fd ) {
+        fprintf( info_output(),
+                 "Warning: unable to open file %s (errno %d)\n", path, errno );
+    }
+    free( path );
+    return fd;
+}
 
-    if ( tc->compare ) {        // compare all files with same size
-        return compare_all( tc, size, list );
-    } else if ( list->next ) {  // list all files with same size if more than 1
-        printf( "size %ld\n", size );
-        for ( const name_list_t *ntry = list; NULL != ntry; ntry = ntry->next ) {
-            printf( "  %s\n", ntry->name );
-            ++tc->redundant;
-        }
+static void close_ref( int fd )
+{
+    if ( -1 != fd ) {
+        close( fd );
     }
-    return false;
 }
 
-// compare single file/dir target to all duplicates
-static bool compare_target( char *path, size_t size, void *context )
+// compare byte to byte n candidates with the same digest. Candidates are
+// reordered, each group of identical files first, in their original order.
+static bool verify_group( target_context_t *tc, size_t size,
+                          candidate_t *candidates, size_t n )
 {
-    target_context_t *tc = context;
-    if ( 0 == size ) {
-        if ( tc->zero ) {
-            printf( "Empty target file %s\n", path );
+    candidate_t *left = malloc_or_exit( sizeof(candidate_t) * n );
+    bool stop = false;
+    while ( n > 1 && ! stop ) {
+        int fd1 = open_ref( tc->pool, candidates[0].ref, tc->read_flags );
+        size_t n_same = 1, n_left = 0;
+        for ( size_t i = 1; i < n; ++i ) {
+            int fd2 = ( -1 == fd1 ) ? -1 :
+                            open_ref( tc->pool, candidates[i].ref, tc->read_flags );
+            if ( compare_files( tc->pool, candidates[0].ref, fd1,
+                                candidates[i].ref, fd2, size,
+                                &tc->stats[VERIFY_STAGE].bytes,
+                                tc->read_flags ) ) {
+                candidates[n_same++] = candidates[i];
+            } else {
+                left[n_left++] = candidates[i];
+            }
+            close_ref( fd2 );
+        }
+        close_ref( fd1 );
+        memcpy( &candidates[n_same], left, sizeof(candidate_t) * n_left );
+        if ( n_same > 1 ) {
+            stop = report_same( tc, size, candidates, n_same );
+        } else {
+            ++tc->stats[VERIFY_STAGE].dropped;
         }
-        return true;
+        candidates += n_same;
+        n -= n_same;
     }
-    const name_list_t *list = map_lookup_entry( tc->map, (void *)size );
-    if ( NULL == list ) {   // no file matching the target file size
-        return true;
+    if ( 1 == n && ! stop ) {   // single left cannot match any other
+        ++tc->stats[VERIFY_STAGE].dropped;
     }
+    free( left );
+    return stop;
+}
 
-    if ( ! tc->compare ) {
-        printf( "size %ld\n  <target> %s\n", size, path );
-        for ( const name_list_t *ntry = list; NULL != ntry; ntry = ntry->next ) {
-            printf( "  %s\n", ntry->name );
-        }
-        return false;
+// FNV-1a, good enough to split files according to their samples, since
+// files with the same sample are always fully compared afterwards.
+static uint64_t hash_block( uint64_t h, const unsigned char *block, size_t n )
+{
+    for ( size_t i = 0; i < n; ++i ) {
+        h ^= block[i];
+        h *= 0x100000001b3;
     }
+    return h;
+}
 
-    FILE *f1 = fopen( path, "rb" );
-    if ( NULL == f1 ) {
-        printf( "Error: Failed to open target file %s (errno %d) exiting\n",
-                path, errno );
-        exit(FILE_IO_ERROR);
+typedef struct {
+    candidate_t     *candidate;
+    hash_state_t    state;      // digest stage only
+} read_context_t;
+
+static void sample_block( void *context, const unsigned char *data, size_t len )
+{
+    candidate_t *c = ((read_context_t *)context)->candidate;
+    if ( NULL == data ) {
+        c->truncated = true;
+    } else {
+        c->sample = hash_block( c->sample, data, len );
+    }
+}
+
+static void digest_block( void *context, const unsigned char *data, size_t len )
+{
+    read_context_t *rc = context;
+    if ( NULL == data ) {
+        rc->candidate->truncated = true;
+    } else {
+        hash_update( &rc->state, data, len );
     }
+}
+
+// Read all candidates whose sample or digest (according to stage) is not
+// already known. All reads are handed over at once to the reader, which
+// keeps many of them in flight. Candidates truncated or unreadable while
+// being read are moved at the end and dropped: return the number of
+// candidates left.
+static size_t read_candidates( target_context_t *tc, stage_t stage, size_t size,
+                               candidate_t *candidates, size_t n )
+{
+    uint32_t flag = ( SAMPLE_STAGE == stage ) ? CACHED_SAMPLE : CACHED_DIGEST;
+    read_job_t *jobs = malloc_or_exit( sizeof(read_job_t) * n );
+    read_context_t *contexts = malloc_or_exit( sizeof(read_context_t) * n );
 
-    tc->path = path;
-    // binary content comparison is required
-    int nnames = 0;
-    name_list_t *duplicates, *prev;
-    duplicates = prev = NULL;
-    for ( const name_list_t *ntry = list; NULL != ntry; ntry = ntry->next ) {
-        FILE *f2 = fopen( ntry->name, "rb" );
-        if ( NULL == f2 ) {
-            printf( "Failed to open file %s (errno %d) exiting\n",
-                    ntry->name, errno );
-            exit(FILE_IO_ERROR);
+    size_t n_jobs = 0;
+    for ( size_t i = 0; i < n; ++i ) {
+        candidate_t *c = &candidates[i];
+        if ( c->cached & flag ) {
+            ++tc->stats[stage].cached;
+            continue;
         }
-        if ( bin_compare( f1, f2 ) ) {  // same content
-            ++tc->redundant;
-            if ( 0 == nnames ) {
-                printf( "size %ld\n  <target> %s\n", size, path );
-                if ( tc->remove ) {
-                    duplicates = malloc_or_exit( sizeof( name_list_t ) );
-                    duplicates->name = path;
-                    duplicates->next = NULL;
-                    duplicates->prev = NULL;
-                    prev = duplicates;
-                }
-            }
-            printf( "  %s\n", ntry->name );
-            if ( tc->remove ) {
-                name_list_t *to_remove = malloc_or_exit( sizeof( name_list_t ) );
-                to_remove->name = ntry->name;
-                to_remove->next = NULL;
-                to_remove->prev = prev;
-                prev->next = to_remove;
-                prev = to_remove;
+        read_job_t *job = &jobs[n_jobs];
+        job->path = pool_path( tc->pool, c->ref );
+        job->dev = c->info->dev;
+        job->ranges[0].offset = 0;
+        if ( SAMPLE_STAGE == stage ) {
+            c->sample = 0xcbf29ce484222325;
+            job->ranges[0].length = ( size > SAMPLE_BLOCK_SIZE ) ?
+                                                SAMPLE_BLOCK_SIZE : size;
+            job->n_ranges = 1;
+            if ( size > SAMPLE_BLOCK_SIZE ) {   // tail, possibly overlapping head
+                job->ranges[1].offset = size - SAMPLE_BLOCK_SIZE;
+                job->ranges[1].length = SAMPLE_BLOCK_SIZE;
+                job->n_ranges = 2;
             }
-            ++ nnames;
+            job->process = sample_block;
+        } else {
+            hash_init( &contexts[n_jobs].state );
+            job->ranges[0].length = size;
+            job->n_ranges = 1;
+            job->process = digest_block;
         }
+        contexts[n_jobs].candidate = c;
+        job->context = &contexts[n_jobs];
+        c->computed |= flag;
+        ++n_jobs;
     }
-    fclose( f1 );
-    if ( tc->remove ) {
-        interactive_remove_files( tc, duplicates, nnames );
+    if ( n_jobs > 0 ) {
+        uint64_t span = trace_start( );
+        tc->stats[stage].bytes += read_files( tc->reader, jobs, n_jobs );
+        trace_span( span, STAGE_NAMES[stage], NULL, "files", n_jobs );
     }
-    free_duplicate_list( duplicates );
-    return false;
-}
 
-extern void process_duplicates( map_t *map, args_t *args )
-{
-    magic_t magic = open_magic_lib( );
-#ifdef TIME_MEASURE
-    uint64_t file_process_start = get_nanosecond_timestamp();
-#endif
-    target_context_t tc;
-    tc.cookie = magic;
-    tc.map = map;
-    tc.redundant = 0;
-    tc.compare = args->compare;
-    tc.remove = args->remove;
-    tc.confirm = args->confirm;
+    for ( size_t j = 0; j < n_jobs; ++j ) {
+        free( (char *)jobs[j].path );
+        candidate_t *c = contexts[j].candidate;
+        if ( c->truncated ) {
+            c->computed &= ~flag;
+        } else if ( DIGEST_STAGE == stage ) {
+            hash_final( &contexts[j].state, &c->digest );
+        }
+    }
+    free( contexts );
+    free( jobs );
 
-    if ( NULL != args->target ) {   // single target file/dir case
-        struct stat stat_data;
-        if ( 0 != stat( args->target->path, &stat_data ) ) {
-            printf( "Error: unable to stat target file %s\n", args->target->path );
-            exit(FILE_IO_ERROR);
-        }
-        tc.zero = args->target->zero;
-        if ( S_ISREG( stat_data.st_mode ) ) {   // Handle single regular file
-            compare_target( args->target->path, stat_data.st_size, &tc );
-        } else if ( S_ISDIR( stat_data.st_mode ) ){ // Handle single directory
-            traverse_directory( args->target->path, args->target->nosub,
-                                compare_target, &tc );
+    size_t kept = 0;
+    for ( size_t i = 0; i < n; ++i ) {
+        if ( candidates[i].truncated ) {
+            ++tc->stats[stage].dropped;
         } else {
-            printf( "Target %s is a special file: mode 0x%x - exiting\n",
-                    args->target->path, stat_data.st_mode );
+            if ( kept != i ) {
+                candidate_t c = candidates[kept];
+                candidates[kept] = candidates[i];
+                candidates[i] = c;
+            }
+            ++kept;
         }
-    } else {
-        tc.path = NULL;
-        map_process_entries( map, visit_entries, (void *)&tc );
     }
-    if ( ! tc.remove ) {
-#ifdef TIME_MEASURE
-        printf( "Time elapsed processing files %ld milliseconds\n",
-                            get_nanosecond_timestamp() - file_process_start );
-#endif
-        printf( "Found %ld redundant files\n", tc.redundant );
-    }
-    close_magic_lib( magic );
+    return kept;
 }
 
-typedef struct {
-    map_t           *map;
-    size_t          count;
-    bool            zero;
-} map_context_t;
+static int compare_samples( const void *c1, const void *c2 )
+{
+    uint64_t h1 = ((const candidate_t *)c1)->sample;
+    uint64_t h2 = ((const candidate_t *)c2)->sample;
+    return ( h1 < h2 ) ? -1 : ( h1 > h2 );
+}
+
+static int compare_digests( const void *c1, const void *c2 )
+{
+    return digest_compare( &((const candidate_t *)c1)->digest,
+                           &((const candidate_t *)c2)->digest );
+}
 
-// called for a single target file, or for each target file in a directory
-// Always return true to free the target path if called from traverse_directory
-static bool check_target_content( char *path, size_t size, void *context )
+// With -d, leave out of n candidates with the same digest the files inside
+// copies of identical directories, which are reported with them. Return the
+// number of candidates kept, moved first.
+static size_t skip_copies( target_context_t *tc, candidate_t *candidates,
+                           size_t n )
 {
-    map_context_t *mcp = context;
-    if ( 0 == size ) {
-        if ( mcp->zero ) {
-            printf( "Empty target file %s\n", path );
+    size_t kept = 0;
+    for ( size_t i = 0; i < n; ++i ) {
+        if ( ! tree_in_copy( tc->tree, candidates[i].ref.dir ) ) {
+            candidate_t c = candidates[kept];
+            candidates[kept++] = candidates[i];
+            candidates[i] = c;
         }
-        return true;
-    }
-    FILE *target = fopen( path, "rb" );
-    if ( NULL == target ) {
-        printf( "Failed to open target file %s (errno %d) exiting\n",
-                path, errno );
-        exit(FILE_IO_ERROR);
     }
-    const name_list_t *list = map_lookup_entry( mcp->map, (void *)size  );
-    bool found = false;
-    if ( NULL != list  ) {
-        for ( const name_list_t *entry = list; NULL != entry; entry = entry->next ) {
-            const char *name = entry->name;
-            FILE *f = fopen( name, "rb" );
-            bool match = bin_compare( target, f );  // at least one matching file found
-            fclose( f );
-
-            if ( match ) {
-                printf( " %s content is found as %s\n", path, name );
-                found = true;
+    return kept;
+}
+
+// Read once each file with the same sample to group them by digest.
+static bool group_by_digest( target_context_t *tc, size_t size,
+                             candidate_t *candidates, size_t n )
+{
+    n = read_candidates( tc, DIGEST_STAGE, size, candidates, n );
+    qsort( candidates, n, sizeof(candidate_t), compare_digests );
+
+    bool stop = false;
+    for ( size_t first = 0, last; first < n && ! stop; first = last ) {
+        for ( last = first + 1;
+              last < n && same_digest( &candidates[last].digest,
+                                       &candidates[first].digest );
+              ++last ) ;
+        if ( last - first == 1 ) {
+            ++tc->stats[DIGEST_STAGE].dropped;
+            continue;
+        }
+        size_t n_same = last - first;
+        if ( NULL != tc->tree ) {
+            n_same = skip_copies( tc, &candidates[first], n_same );
+            if ( n_same < 2 ) {
+                continue;
             }
         }
+        if ( tc->verify ) {
+            stop = verify_group( tc, size, &candidates[first], n_same );
+        } else {
+            stop = report_same( tc, size, &candidates[first], n_same );
+        }
+    }
+    return stop;
+}
+
+/*
+    Lockstep comparison: all files in a group are open at once and read
+    chunk by chunk at the same offset. After each chunk, each class of files
+    with the same content so far is split according to the chunk content,
+    and files left alone in their class are closed. Identical files are
+    found without relying on digests.
+
+    The number of files open at once is limited by fd_budget, the whole
+    budget left by readers, shared by all workers: a worker waits until its
+    group fits in the descriptors not used by the others. Groups within the
+    budget are read only once. Larger groups are first split by sample,
+    which reads only their head and tail blocks, and sample groups within
+    the budget are then compared in lockstep. Only sample groups still
+    larger than the budget are read twice: in full for their digests, and
+    again in lockstep, by digest group. Digest groups still larger than the
+    budget are checked against their first file by batches, and the first
+    file is read again for each batch.
+*/
+#define LOCKSTEP_MEMORY     ( 64 * 1024 * 1024 )    // for all chunk buffers
+#define FD_RESERVE          32      // file descriptors kept for other uses
+
+static void claim_fds( target_context_t *tc, size_t n )
+{
+    if ( NULL == tc->fds ) {
+        return;
     }
-    if ( ! found ) {
-        printf( " %s content is not found in any path\n", path );
+    pthread_mutex_lock( &tc->fds->lock );
+    while ( tc->fds->available < n ) {
+        pthread_cond_wait( &tc->fds->released, &tc->fds->lock );
     }
-    fclose( target );
-    return true;
+    tc->fds->available -= n;
+    pthread_mutex_unlock( &tc->fds->lock );
 }
 
-extern void search_targets( map_t *map, args_t *args )
+static void release_fds( target_context_t *tc, size_t n )
 {
-#ifdef TIME_MEASURE
-    uint64_t file_process_start = get_nanosecond_timestamp();
-#endif
-    if ( NULL != args->target ) {
-        map_context_t ctxt;
-        ctxt.map = map;
-        ctxt.zero = args->target->zero;
-        ctxt.count = 0;
+    if ( NULL == tc->fds ) {
+        return;
+    }
+    pthread_mutex_lock( &tc->fds->lock );
+    tc->fds->available += n;
+    pthread_cond_broadcast( &tc->fds->released );
+    pthread_mutex_unlock( &tc->fds->lock );
+}
 
-        struct stat stat_data;
-        if ( 0 != stat( args->target->path, &stat_data ) ) {
-            printf( "Error: unable to stat target file %s\n", args->target->path );
-            exit(FILE_IO_ERROR);
-        }
-        if ( S_ISREG( stat_data.st_mode ) ) {       // Handle regular file
-//            printf( "Target is a regular file\n" );
-            check_target_content( args->target->path, stat_data.st_size, &ctxt );
+typedef struct {
+    candidate_t     candidate;
+    int             fd;
+    unsigned char   *buffer;
+    size_t          len;            // bytes read in current chunk
+    bool            failed;         // could not be opened or read
+} lockstep_file_t;
 
-        } else if ( S_ISDIR( stat_data.st_mode ) ) { // Handle directory
-//            printf( "Target is a directory\n" );
-            traverse_directory( args->target->path, args->target->nosub,
-                                check_target_content, &ctxt );
-        } else {
-            printf( "Warning: Target is a special file - skipping\n" );
+typedef struct {
+    size_t          start, end;     // range of lockstep files
+} lockstep_class_t;
+
+// files that could not be read go last, each alone in its class
+static int compare_chunks( const void *f1, const void *f2 )
+{
+    const lockstep_file_t *lf1 = f1, *lf2 = f2;
+    if ( lf1->failed || lf2->failed ) {
+        if ( lf1->failed != lf2->failed ) {
+            return ( lf1->failed ) ? 1 : -1;
         }
+        return ( lf1->buffer < lf2->buffer ) ? -1 :
+                                               ( lf1->buffer > lf2->buffer );
+    }
+    if ( lf1->len != lf2->len ) {   // file truncated since it was found
+        return ( lf1->len < lf2->len ) ? -1 : 1;
+    }
+    size_t i = first_difference( lf1->buffer, lf2->buffer, lf1->len );
+    if ( i == lf1->len ) {
+        return 0;
     }
-#ifdef TIME_MEASURE
-    printf( "Time elapsed processing files %ld milliseconds\n",
-                            get_nanosecond_timestamp() - file_process_start );
-#endif
+    return ( lf1->buffer[i] < lf2->buffer[i] ) ? -1 : 1;
 }
 
-static bool build_map( char *path, size_t size, void *context )
+// Partition n candidates (n <= fd_budget) in classes of identical files.
+// On return, candidates are ordered by class and class i ends before index
+// class_ends[i]. Return the number of classes, including single files.
+static size_t lockstep_partition( target_context_t *tc, size_t size,
+                                  candidate_t *candidates, size_t n,
+                                  size_t *class_ends )
 {
-    map_context_t *mcp = context;
+    uint64_t span = trace_start( );
+    size_t max_chunk = LOCKSTEP_MEMORY / n;
+    if ( max_chunk > MAX_COMPARE_CHUNK ) {
+        max_chunk = MAX_COMPARE_CHUNK;
+    } else if ( max_chunk < MIN_COMPARE_CHUNK ) {
+        max_chunk = MIN_COMPARE_CHUNK;
+    }
+    max_chunk &= ~(size_t)( DIRECT_ALIGN - 1 );     // keep offsets aligned
+    unsigned char *buffers = alloc_buffer_or_exit( n * max_chunk );
+    lockstep_file_t *files = malloc_or_exit( sizeof(lockstep_file_t) * n );
+    claim_fds( tc, n );
+    for ( size_t i = 0; i < n; ++i ) {
+        files[i].candidate = candidates[i];
+        files[i].fd = open_ref( tc->pool, candidates[i].ref, tc->read_flags );
+        files[i].buffer = buffers + i * max_chunk;
+        files[i].failed = -1 == files[i].fd;
+        files[i].len = 0;
+    }
+    lockstep_class_t *classes = malloc_or_exit( sizeof(lockstep_class_t) * n );
+    lockstep_class_t *next = malloc_or_exit( sizeof(lockstep_class_t) * n );
+    classes[0].start = 0;
+    classes[0].end = n;
+    size_t n_classes = 1;
 
-    if ( 0 != size ) {
-        ++mcp->count;
-        name_list_t *head = (void *)map_lookup_entry( mcp->map, (void *)size );
-        name_list_t *ntry = malloc_or_exit( sizeof( name_list_t ) );
-        ntry->name = path;
-        ntry->next = NULL;
+    size_t offset = 0, chunk = MIN_COMPARE_CHUNK;
+    while ( offset < size && 0 != n_classes ) {
+        size_t len = ( size - offset < chunk ) ? size - offset : chunk;
+        size_t n_next = 0;
+        for ( size_t c = 0; c < n_classes; ++c ) {
+            lockstep_class_t *cl = &classes[c];
+            for ( size_t i = cl->start; i < cl->end; ++i ) {
+                if ( files[i].failed ) {    // could not be opened
+                    continue;
+                }
+                files[i].failed = ! read_chunk( files[i].fd,
+                                                (char *)files[i].buffer, len,
+                                                (off_t)offset, tc->read_flags,
+                                                &files[i].len );
+                if ( files[i].failed ) {
+                    read_ref_error( tc->pool, files[i].candidate.ref, errno );
+                    files[i].len = 0;
+                }
+                tc->stats[LOCKSTEP_STAGE].bytes += files[i].len;
+            }
+            qsort( &files[cl->start], cl->end - cl->start,
+                   sizeof(lockstep_file_t), compare_chunks );
+            for ( size_t first = cl->start, last; first < cl->end; first = last ) {
+                for ( last = first + 1;
+                      last < cl->end && 0 == compare_chunks( &files[first],
+                                                             &files[last] );
+                      ++last ) ;
+                if ( last - first == 1 ) {  // unique file: done with it
+                    close_ref( files[first].fd );
+                    files[first].fd = -1;
+                    ++tc->stats[LOCKSTEP_STAGE].dropped;
+                    add_count( SHORT_CUT_COUNT, offset + len < size );
+                } else {
+                    next[n_next].start = first;
+                    next[n_next].end = last;
+                    ++n_next;
+                }
+            }
+        }
+        lockstep_class_t *tmp = classes;
+        classes = next;
+        next = tmp;
+        n_classes = n_next;
+        offset += len;
+        chunk = ( 2 * chunk > max_chunk ) ? max_chunk : 2 * chunk;
+    }
 
-        if ( NULL == head ) {
-            ntry->prev = ntry;
-            map_insert_entry( mcp->map, (void *)size, (void*)ntry );
+    // classes left are in file order, other files are alone in their class
+    size_t n_ends = 0, c = 0;
+    for ( size_t i = 0; i < n; ) {
+        if ( c < n_classes && i == classes[c].start ) {
+            i = classes[c++].end;
         } else {
-            ntry->prev = head->prev;
-            head->prev->next = ntry;
-            head->prev = ntry;
+            ++i;
         }
-        return false;
-    } else {
-        if ( mcp->zero ) {
-            printf( "Empty file %s\n", path );
+        class_ends[n_ends++] = i;
+    }
+    for ( size_t i = 0; i < n; ++i ) {
+        if ( -1 != files[i].fd ) {
+            close( files[i].fd );
         }
+        candidates[i] = files[i].candidate;
     }
-    return true;
+    release_fds( tc, n );
+    free( next );
+    free( classes );
+    free( files );
+    free( buffers );
+    trace_span( span, "lockstep", NULL, "files", n );
+    return n_ends;
 }
 
-extern map_t *collect_same_size_files( args_t *args )
+static bool report_classes( target_context_t *tc, size_t size,
+                            const candidate_t *candidates,
+                            const size_t *class_ends, size_t n_classes )
 {
-    // By default start with a medium size map table.
-    // Map entries are defined as key=size, value = (name_list_t *)
-    map_t *map = new_map( NULL, NULL,
-                          INITIAL_HASH_SIZE, MAX_COLLISIONS );
-    if ( NULL == map ) {
-        return NULL;
+    bool stop = false;
+    for ( size_t c = 0, start = 0; c < n_classes && ! stop; ++c ) {
+        if ( class_ends[c] - start > 1 ) {
+            stop = report_same( tc, size, &candidates[start],
+                                class_ends[c] - start );
+        }
+        start = class_ends[c];
     }
+    return stop;
+}
 
-    map_context_t ctxt;
-    ctxt.map = map;
-    ctxt.count = 0;
-#ifdef TIME_MEASURE
-    int64_t start = get_nanosecond_timestamp( );
-#endif
-    for ( search_t *sptr = args->paths; NULL != sptr->path; ++sptr ) {
-        ctxt.zero = sptr->zero;
-        traverse_directory( sptr->path, sptr->nosub, build_map, &ctxt );
+// Check candidates with the same digest against the first one, by batches
+// within fd_budget. Candidates that are not identical to the first one (in
+// case of digest collision) are checked again in the same way.
+static bool lockstep_check_first( target_context_t *tc, size_t size,
+                                  const candidate_t *candidates, size_t n )
+{
+    size_t *class_ends = malloc_or_exit( sizeof(size_t) * n );
+    candidate_t *same = malloc_or_exit( sizeof(candidate_t) * n );
+    candidate_t *left = malloc_or_exit( sizeof(candidate_t) * n );
+    candidate_t *batch = malloc_or_exit( sizeof(candidate_t) * tc->fd_budget );
+    size_t n_same = 1, n_left = 0;
+    same[0] = candidates[0];
+    for ( size_t i = 1, k; i < n; i += k ) {
+        k = ( n - i < tc->fd_budget - 1 ) ? n - i : tc->fd_budget - 1;
+        batch[0] = candidates[0];
+        memcpy( &batch[1], &candidates[i], sizeof(candidate_t) * k );
+        size_t n_classes = lockstep_partition( tc, size, batch, k + 1,
+                                               class_ends );
+        for ( size_t c = 0, start = 0; c < n_classes; ++c ) {
+            bool first_class = false;
+            for ( size_t j = start; j < class_ends[c]; ++j ) {
+                first_class |= batch[j].info == candidates[0].info;
+            }
+            for ( size_t j = start; j < class_ends[c]; ++j ) {
+                if ( batch[j].info == candidates[0].info ) {
+                    continue;
+                }
+                if ( first_class ) {
+                    same[n_same++] = batch[j];
+                } else {
+                    left[n_left++] = batch[j];
+                }
+            }
+            start = class_ends[c];
+        }
+    }
+    bool stop = false;
+    if ( n_same > 1 ) {
+        stop = report_same( tc, size, same, n_same );
+    }
+    if ( ! stop && n_left > 1 ) {
+        stop = lockstep_check_first( tc, size, left, n_left );
     }
-#ifdef TIME_MEASURE
-    int64_t stop = get_nanosecond_timestamp( );
-    printf( "Time elapsed building map: %ld milliseconds\n", NANOSEC_TO_MILLISEC(stop-start) );
-#endif
-    printf( "Traversed %ld files\n", ctxt.count );
-    return map;
+    free( batch );
+    free( left );
+    free( same );
+    free( class_ends );
+    return stop;
 }
 
-static bool free_entry( uint32_t index,
-                        const void *key, const void *data, void *ctxt )
+// compare n candidates, n <= fd_budget, all at once
+static bool lockstep_fitting( target_context_t *tc, size_t size,
+                              candidate_t *candidates, size_t n )
 {
-    (void)index;
-    (void)key;
-    (void)ctxt;
+    size_t *class_ends = malloc_or_exit( sizeof(size_t) * n );
+    size_t n_classes = lockstep_partition( tc, size, candidates, n,
+                                           class_ends );
+    bool stop = report_classes( tc, size, candidates, class_ends, n_classes );
+    free( class_ends );
+    return stop;
+}
 
-    name_list_t *entry = (void *)data;
-    while ( NULL != entry ) {
-        free( entry->name );
-        name_list_t *to_remove = entry;
-        entry = entry->next;
-        free( to_remove );
+static bool lockstep_group( target_context_t *tc, size_t size,
+                            candidate_t *candidates, size_t n )
+{
+    if ( n <= tc->fd_budget ) {
+        return lockstep_fitting( tc, size, candidates, n );
+    }
+    bool stop = false;
+    n = read_candidates( tc, DIGEST_STAGE, size, candidates, n );
+    qsort( candidates, n, sizeof(candidate_t), compare_digests );
+    for ( size_t first = 0, last; first < n && ! stop; first = last ) {
+        for ( last = first + 1;
+              last < n && same_digest( &candidates[last].digest,
+                                       &candidates[first].digest );
+              ++last ) ;
+        if ( last - first == 1 ) {
+            ++tc->stats[DIGEST_STAGE].dropped;
+        } else if ( last - first <= tc->fd_budget ) {
+            stop = lockstep_fitting( tc, size, &candidates[first],
+                                     last - first );
+        } else {
+            stop = lockstep_check_first( tc, size, &candidates[first],
+                                         last - first );
+        }
     }
-    return false;
+    return stop;
 }
 
-extern void free_collected_data( map_t *map )
+// raise the soft limit on open files as much as allowed, and keep some
+// descriptors for other uses
+static size_t get_fd_budget( void )
 {
-    map_process_entries( map, free_entry, NULL );
-    map_free( map );
+    struct rlimit limit;
+    if ( 0 != getrlimit( RLIMIT_NOFILE, &limit ) ) {
+        return 2;
+    }
+    if ( limit.rlim_cur < limit.rlim_max ) {
+        rlim_t cur = limit.rlim_cur;
+        limit.rlim_cur = limit.rlim_max;
+        if ( 0 != setrlimit( RLIMIT_NOFILE, &limit ) ) {
+            limit.rlim_cur = cur;
+        }
+    }
+    if ( RLIM_INFINITY == limit.rlim_cur || limit.rlim_cur > 1024 * 1024 ) {
+        limit.rlim_cur = 1024 * 1024;
+    }
+    return ( limit.rlim_cur > FD_RESERVE + 2 ) ?
+                            (size_t)( limit.rlim_cur - FD_RESERVE ) : 2;
+}
+
+static void update_cache( cache_t *cache, const candidate_t *candidates,
+                          size_t n )
+{
+    for ( size_t i = 0; i < n; ++i ) {
+        if ( 0 != candidates[i].computed ) {
+            cache_data_t data;
+            data.flags = candidates[i].cached | candidates[i].computed;
+            data.sample = candidates[i].sample;
+            data.digest = candidates[i].digest;
+            cache_update( cache, candidates[i].info, &data );
+        }
+    }
+}
+
+// names of the same inode also have the same times. Times are checked too
+// since a file found in an index of a volume not mounted may have the
+// device and inode numbers of another file.
+static bool same_inode( const file_info_t *i1, const file_info_t *i2 )
+{
+    return i1->dev == i2->dev && i1->ino == i2->ino &&
+           i1->mtime_ns == i2->mtime_ns && i1->ctime_ns == i2->ctime_ns;
+}
+
+static int compare_inodes( const void *f1, const void *f2 )
+{
+    const file_info_t *i1 = &((const file_record_t *)f1)->info;
+    const file_info_t *i2 = &((const file_record_t *)f2)->info;
+    if ( i1->dev != i2->dev ) {
+        return ( i1->dev < i2->dev ) ? -1 : 1;
+    }
+    if ( i1->ino != i2->ino ) {
+        return ( i1->ino < i2->ino ) ? -1 : 1;
+    }
+    if ( i1->mtime_ns != i2->mtime_ns ) {
+        return ( i1->mtime_ns < i2->mtime_ns ) ? -1 : 1;
+    }
+    return ( i1->ctime_ns < i2->ctime_ns ) ? -1 : ( i1->ctime_ns > i2->ctime_ns );
+}
+
+// the record of the first name of a candidate
+static const file_record_t *candidate_record( const candidate_t *c )
+{
+    return (const file_record_t *)( (const char *)c->info -
+                                    offsetof( file_record_t, info ) );
+}
+
+// take the samples and digests already known, from the index where a file
+// was found, from the first pass with -d, or from the cache
+static void lookup_candidates( target_context_t *tc, candidate_t *candidates,
+                               size_t n )
+{
+    for ( size_t i = 0; i < n; ++i ) {
+        candidate_t *c = &candidates[i];
+        const index_entry_t *entry = indexed_entry( tc->files, c->ref );
+        const cache_data_t *known = ( NULL == tc->known ) ? NULL :
+                        &tc->known[candidate_record( c ) - tc->files->records];
+        cache_data_t data;
+        if ( NULL != entry ) {
+            c->cached = CACHED_SAMPLE | CACHED_DIGEST;
+            c->sample = entry->sample;
+            c->digest = entry->digest;
+        } else if ( NULL != known && 0 != known->flags ) {
+            c->cached = known->flags;
+            c->sample = known->sample;
+            c->digest = known->digest;
+        } else if ( NULL != tc->cache &&
+                    cache_lookup( tc->cache, c->info, &data ) ) {
+            c->cached = data.flags;
+            c->sample = data.sample;
+            c->digest = data.digest;
+        }
+    }
+}
+
+static void init_candidate( candidate_t *c, const file_record_t *record )
+{
+    c->ref = record->ref;
+    c->info = &record->info;
+    c->cached = c->computed = 0;
+    c->truncated = false;
+}
+
+// sort the n records of a size by inode and return one candidate per inode
+static candidate_t *inode_candidates( file_record_t *records, size_t n,
+                                      size_t *count )
+{
+    qsort( records, n, sizeof(file_record_t), compare_inodes );
+    candidate_t *candidates = malloc_or_exit( sizeof(candidate_t) * n );
+    size_t kept = 0;
+    for ( size_t first = 0, last; first < n; first = last ) {
+        for ( last = first + 1;
+              last < n && same_inode( &records[last].info, &records[first].info );
+              ++last ) ;
+        init_candidate( &candidates[kept++], &records[first] );
+    }
+    *count = kept;
+    return candidates;
+}
+
+// sort the n names of an inode by path, so that the name used for the
+// inode does not depend on the order in which directories were walked
+static void sort_links( const pool_t *pool, file_record_t *names, size_t n )
+{
+    char **paths = malloc_or_exit( sizeof(char *) * n );
+    for ( size_t i = 0; i < n; ++i ) {
+        paths[i] = pool_path( pool, names[i].ref );
+    }
+    for ( size_t i = 1; i < n; ++i ) {      // few names: insertion sort
+        for ( size_t j = i; j > 0 && strcmp( paths[j-1], paths[j] ) > 0; --j ) {
+            char *path = paths[j];
+            paths[j] = paths[j-1];
+            paths[j-1] = path;
+            file_record_t record = names[j];
+            names[j] = names[j-1];
+            names[j-1] = record;
+        }
+    }
+    for ( size_t i = 0; i < n; ++i ) {
+        free( paths[i] );
+    }
+    free( paths );
+}
+
+// report all names of the same inode, which are found without any I/O
+static void report_links( target_context_t *tc, size_t size,
+                          const file_record_t *names, size_t n )
+{
+    output_file_t *files = malloc_or_exit( sizeof(output_file_t) * n );
+    for ( size_t i = 0; i < n; ++i ) {
+        set_output_file( &files[i], pool_path( tc->pool, names[i].ref ),
+                         &names[i].info, NULL );
+    }
+    output_group( tc->out, "links", size, NULL, files, n );
+    for ( size_t i = 0; i < n; ++i ) {
+        free( (char *)files[i].path );
+    }
+    free( files );
+    tc->links += n - 1;
+}
+
+// Sort the n records of a size by inode and return an array of candidates,
+// one for the first name of each distinct inode, and their number in count.
+static candidate_t *collapse_links( target_context_t *tc, size_t size,
+                                    file_record_t *records, size_t n,
+                                    size_t *count )
+{
+    qsort( records, n, sizeof(file_record_t), compare_inodes );
+    candidate_t *candidates = malloc_or_exit( sizeof(candidate_t) * n );
+    size_t kept = 0;
+    for ( size_t first = 0, last; first < n; first = last ) {
+        for ( last = first + 1;
+              last < n && same_inode( &records[last].info, &records[first].info );
+              ++last ) ;
+        if ( last - first > 1 ) {
+            sort_links( tc->pool, &records[first], last - first );
+            report_links( tc, size, &records[first], last - first );
+        }
+        init_candidate( &candidates[kept++], &records[first] );
+    }
+    *count = kept;
+    return candidates;
+}
+
+// compare n candidates with distinct inodes
+static bool compare_all( target_context_t *tc, size_t size,
+                         candidate_t *candidates, size_t n )
+{
+    // if nothing to compare (0 or 1 inode), just return
+    if ( n < 2 ) {
+        ++tc->stats[SIZE_STAGE].dropped;
+        return false;
+    }
+
+    lookup_candidates( tc, candidates, n );
+    if ( tc->lockstep && n <= tc->fd_budget ) {
+        return lockstep_group( tc, size, candidates, n );
+    }
+    bool stop = false;
+    n = read_candidates( tc, SAMPLE_STAGE, size, candidates, n );
+    qsort( candidates, n, sizeof(candidate_t), compare_samples );
+
+    for ( size_t first = 0, last; first < n && ! stop; first = last ) {
+        for ( last = first + 1;
+              last < n && candidates[last].sample == candidates[first].sample;
+              ++last ) ;
+        if ( last - first == 1 ) {
+            ++tc->stats[SAMPLE_STAGE].dropped;
+            continue;
+        }
+        if ( tc->lockstep ) {
+            stop = lockstep_group( tc, size, &candidates[first], last - first );
+        } else {
+            stop = group_by_digest( tc, size, &candidates[first], last - first );
+        }
+    }
+    if ( NULL != tc->cache ) {
+        update_cache( tc->cache, candidates, n );
+    }
+    return stop;
+}
+
+/*
+    Target mode (fdup -t): target files are collected first in their own
+    table, and each target size makes a bucket with the search files of that
+    size. In a bucket, each inode, target or search file, is read at most
+    once: all samples first, then the digests of the files whose sample is
+    shared with a target, and each target is matched by its digest, whatever
+    the number of targets. Targets are reported in path order, each with the
+    other names of its inode found in search paths as links, and the names
+    of all search files with the same content.
+*/
+
+// compare a record with a candidate, by inode
+static int compare_candidate_inode( const void *record, const void *c )
+{
+    return compare_inodes( record, candidate_record( c ) );
+}
+
+// first of the n records sorted by inode with the inode of info, and the
+// number of such records in count
+static const file_record_t *find_inode( const file_record_t *records, size_t n,
+                                        const file_info_t *info, size_t *count )
+{
+    const file_record_t *end = records + n;
+    const file_record_t *found = NULL;
+    for ( size_t low = 0, high = n; low < high && NULL == found; ) {
+        size_t mid = low + ( high - low ) / 2;
+        int res = compare_inodes( &records[mid], info );
+        if ( 0 == res ) {
+            found = &records[mid];
+        } else if ( res < 0 ) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    *count = 0;
+    if ( NULL == found ) {
+        return NULL;
+    }
+    while ( found > records && same_inode( &found[-1].info, info ) ) {
+        --found;
+    }
+    for ( const file_record_t *r = found; r < end && same_inode( &r->info, info );
+          ++r ) {
+        ++*count;
+    }
+    return found;
+}
+
+// Read the samples of the n candidates, then the digests of those with the
+// same sample as another candidate that is a target, and move them first,
+// sorted by digest. Return their number.
+static size_t digest_targets( target_context_t *tc, size_t size,
+                              const file_record_t *targets, size_t n_targets,
+                              candidate_t *candidates, size_t n )
+{
+    lookup_candidates( tc, candidates, n );
+    n = read_candidates( tc, SAMPLE_STAGE, size, candidates, n );
+    qsort( candidates, n, sizeof(candidate_t), compare_samples );
+    size_t kept = 0;
+    for ( size_t first = 0, last; first < n; first = last ) {
+        bool target = false;
+        for ( last = first; last < n &&
+                            candidates[last].sample == candidates[first].sample;
+              ++last ) {
+            target |= NULL != bsearch( candidate_record( &candidates[last] ),
+                                       targets, n_targets, sizeof(file_record_t),
+                                       compare_inodes );
+        }
+        if ( ! target || last - first == 1 ) {
+            tc->stats[SAMPLE_STAGE].dropped += last - first;
+            continue;
+        }
+        for ( size_t i = first; i < last; ++i, ++kept ) {
+            candidate_t c = candidates[kept];
+            candidates[kept] = candidates[i];
+            candidates[i] = c;
+        }
+    }
+    size_t n_read = read_candidates( tc, DIGEST_STAGE, size, candidates, kept );
+    if ( NULL != tc->cache ) {
+        update_cache( tc->cache, candidates, n );
+    }
+    qsort( candidates, n_read, sizeof(candidate_t), compare_digests );
+    return n_read;
+}
+
+typedef struct {
+    char        *path;
+    size_t      index;      // in the targets of the bucket
+} target_path_t;
+
+static int compare_target_paths( const void *t1, const void *t2 )
+{
+    return strcmp( ((const target_path_t *)t1)->path,
+                   ((const target_path_t *)t2)->path );
+}
+
+// report a target with the other names of its inode in the search files
+// (sorted by inode), and the names of the candidates that match it
+static void report_target_group( target_context_t *tc, size_t size,
+                                 const file_record_t *target, char *path,
+                                 const bucket_t *bucket,
+                                 const candidate_t **matches, size_t n_matches,
+                                 const digest_t *digest )
+{
+    size_t n_max = bucket->n_records + 1;
+    output_file_t *group = malloc_or_exit( sizeof(output_file_t) * n_max );
+    char **names = malloc_or_exit( sizeof(char *) * n_max );
+    plan_file_t *planned = malloc_or_exit( sizeof(plan_file_t) * n_max );
+    set_output_file( &group[0], path, &target->info, "target" );
+    names[0] = path;
+    planned[0].path = path;
+    planned[0].info = &target->info;
+    size_t n_group = 1, n_names = 1;
+
+    size_t n_links;
+    const file_record_t *links = find_inode( bucket->records, bucket->n_records,
+                                             &target->info, &n_links );
+    for ( size_t i = 0; i < n_links; ++i ) {
+        char *name = pool_path( tc->pool, links[i].ref );
+        if ( 0 == strcmp( name, path ) ) {      // target itself
+            free( name );
+            continue;
+        }
+        if ( tc->compare ) {
+            ++tc->links;
+        }
+        set_output_file( &group[n_group++], name, &links[i].info, "link" );
+    }
+    qsort( &group[1], n_group - 1, sizeof(output_file_t), compare_output_paths );
+    const file_record_t *end = bucket->records + bucket->n_records;
+    for ( size_t i = 0; i < n_matches; ++i ) {
+        const file_record_t *name = candidate_record( matches[i] );
+        for ( const file_record_t *r = name;
+              r < end && same_inode( &r->info, &name->info ); ++r ) {
+            planned[n_names].path = pool_path( tc->pool, r->ref );
+            planned[n_names++].info = &r->info;
+        }
+    }
+    qsort( &planned[1], n_names - 1, sizeof(plan_file_t), compare_planned_paths );
+    for ( size_t i = 1; i < n_names; ++i ) {
+        set_output_file( &group[n_group++], planned[i].path, planned[i].info,
+                         NULL );
+        names[i] = (char *)planned[i].path;
+    }
+    if ( tc->compare ) {
+        tc->redundant += n_names - 1;
+    } else {
+        n_names = 1;    // files are neither removed nor planned
+    }
+    if ( n_group > 1 ) {
+        output_group( tc->out, "target", size, digest, group, n_group );
+    }
+    if ( NULL != tc->plan && n_names > 1 ) {
+        plan_group( tc->plan, size, planned, n_names );
+    }
+    if ( tc->remove && n_names > 1 ) {  // names are freed once removal is done
+        add_removal_group( tc->bucket, ftell( tc->out ), names, (int)n_names );
+        for ( size_t i = 1; i < n_group; ++i ) {
+            if ( NULL != group[i].role ) {
+                free( (char *)group[i].path );
+            }
+        }
+    } else {
+        for ( size_t i = 0; i < n_group; ++i ) {
+            free( (char *)group[i].path );
+        }
+        free( names );
+    }
+    free( planned );
+    free( group );
+}
+
+// the candidates other than target with the same digest, in the digest run
+// of candidate c, that are search files (not only targets), and identical
+// to target if verify is set. Return their number.
+static size_t match_target( target_context_t *tc, size_t size,
+                            const bucket_t *bucket, const file_record_t *target,
+                            const candidate_t *c,
+                            const candidate_t *candidates, size_t n,
+                            const candidate_t **matches )
+{
+    size_t first = c - candidates, last = first + 1;
+    while ( first > 0 && same_digest( &candidates[first-1].digest, &c->digest ) ) {
+        --first;
+    }
+    while ( last < n && same_digest( &candidates[last].digest, &c->digest ) ) {
+        ++last;
+    }
+    const file_record_t *records = bucket->records;
+    size_t n_matches = 0;
+    int fd1 = -1;
+    bool opened = false;    // fd1, opened once needed
+    for ( size_t i = first; i < last; ++i ) {
+        const file_record_t *r = candidate_record( &candidates[i] );
+        if ( r < records || r >= records + bucket->n_records ||
+             same_inode( &r->info, &target->info ) ) {
+            continue;
+        }
+        if ( tc->verify && NULL == indexed_entry( tc->files, candidates[i].ref ) ) {
+            if ( ! opened ) {
+                fd1 = open_ref( tc->pool, target->ref, tc->read_flags );
+                opened = true;
+            }
+            int fd2 = ( -1 == fd1 ) ? -1 :
+                            open_ref( tc->pool, candidates[i].ref, tc->read_flags );
+            bool same = compare_files( tc->pool, target->ref, fd1,
+                                       candidates[i].ref, fd2, size,
+                                       &tc->stats[VERIFY_STAGE].bytes,
+                                       tc->read_flags );
+            close_ref( fd2 );
+            if ( ! same ) {
+                ++tc->stats[VERIFY_STAGE].dropped;
+                continue;
+            }
+        }
+        matches[n_matches++] = &candidates[i];
+    }
+    close_ref( fd1 );
+    return n_matches;
+}
+
+// find and report the search files identical to the targets of a bucket
+static void process_targets( target_context_t *tc, bucket_t *bucket )
+{
+    size_t size = bucket->size;
+    file_record_t *targets = bucket->targets;
+    size_t n_targets = bucket->n_targets;
+    size_t n_search, n = 0;
+    candidate_t *search = inode_candidates( bucket->records, bucket->n_records,
+                                            &n_search );
+    // one candidate per inode: search files, then targets not searched
+    candidate_t *candidates = malloc_or_exit( sizeof(candidate_t) *
+                                              ( n_search + n_targets ) );
+    memcpy( candidates, search, sizeof(candidate_t) * n_search );
+    n = n_search;
+    qsort( targets, n_targets, sizeof(file_record_t), compare_inodes );
+    for ( size_t first = 0, last; first < n_targets; first = last ) {
+        for ( last = first + 1;
+              last < n_targets && same_inode( &targets[last].info,
+                                              &targets[first].info );
+              ++last ) ;
+        if ( NULL == bsearch( &targets[first], search, n_search,
+                              sizeof(candidate_t), compare_candidate_inode ) ) {
+            init_candidate( &candidates[n++], &targets[first] );
+        }
+    }
+    free( search );
+
+    // the candidate of each target with a digest, if its content is compared
+    const candidate_t **target_candidates =
+                    malloc_or_exit( sizeof(candidate_t *) * n_targets );
+    memset( target_candidates, 0, sizeof(candidate_t *) * n_targets );
+    size_t n_digests = 0;
+    if ( tc->compare ) {
+        n_digests = digest_targets( tc, size, targets, n_targets, candidates, n );
+        for ( size_t i = 0; i < n_digests; ++i ) {
+            size_t count;
+            const file_record_t *t = find_inode( targets, n_targets,
+                                        candidates[i].info, &count );
+            for ( size_t j = 0; j < count; ++j ) {
+                target_candidates[t - targets + j] = &candidates[i];
+            }
+        }
+    }
+
+    target_path_t *order = malloc_or_exit( sizeof(target_path_t) * n_targets );
+    for ( size_t i = 0; i < n_targets; ++i ) {
+        order[i].path = pool_path( tc->pool, targets[i].ref );
+        order[i].index = i;
+    }
+    qsort( order, n_targets, sizeof(target_path_t), compare_target_paths );
+    const candidate_t **matches = malloc_or_exit( sizeof(candidate_t *) *
+                                                  ( n + 1 ) );
+    size_t k = 0;
+    for ( ; k < n_targets && ! atomic_load( tc->stop ); ++k ) {
+        const file_record_t *target = &targets[order[k].index];
+        const candidate_t *c = target_candidates[order[k].index];
+        size_t n_matches = 0;
+        if ( ! tc->compare ) {  // same size is enough without comparison
+            for ( size_t i = 0; i < n_search; ++i ) {
+                if ( ! same_inode( candidates[i].info, &target->info ) ) {
+                    matches[n_matches++] = &candidates[i];
+                }
+            }
+        } else if ( NULL != c ) {
+            n_matches = match_target( tc, size, bucket, target, c,
+                                      candidates, n_digests, matches );
+        }
+        report_target_group( tc, size, target, order[k].path, bucket,
+                             matches, n_matches, ( NULL == c ) ? NULL : &c->digest );
+    }
+    for ( ; k < n_targets; ++k ) {      // not reported after a stop
+        free( order[k].path );
+    }
+    free( matches );
+    free( order );
+    free( target_candidates );
+    free( candidates );
+}
+
+/*
+    Identical directories (fdup -d): directories are digested from the
+    digests of their files, but a file needs a real digest only if another
+    inode has its size and sample, since no other file can have the same
+    content otherwise. A first pass over all buckets reads these samples and
+    digests, kept per record for all names of each inode, and the other
+    files get a digest made from their inode, which is enough to match
+    directories holding links to the same files. Once identical directories
+    are grouped and reported, the buckets are processed again with what the
+    first pass found, and files inside copies of identical directories are
+    left out of the groups of identical files (see skip_copies).
+*/
+
+// first pass of -d over the records of a bucket
+static void digest_bucket( target_context_t *tc, bucket_t *bucket )
+{
+    size_t size = bucket->size;
+    size_t n;
+    candidate_t *candidates = inode_candidates( bucket->records,
+                                                bucket->n_records, &n );
+    if ( n > 1 ) {
+        lookup_candidates( tc, candidates, n );
+        size_t n_read = read_candidates( tc, SAMPLE_STAGE, size, candidates, n );
+        qsort( candidates, n_read, sizeof(candidate_t), compare_samples );
+        for ( size_t first = 0, last; first < n_read; first = last ) {
+            for ( last = first + 1; last < n_read &&
+                            candidates[last].sample == candidates[first].sample;
+                  ++last ) ;
+            if ( last - first > 1 ) {
+                read_candidates( tc, DIGEST_STAGE, size,
+                                 &candidates[first], last - first );
+            }
+        }
+        if ( NULL != tc->cache ) {
+            update_cache( tc->cache, candidates, n );
+        }
+    }
+    const file_record_t *end = bucket->records + bucket->n_records;
+    for ( size_t i = 0; i < n; ++i ) {
+        candidate_t *c = &candidates[i];
+        cache_data_t data;
+        data.flags = ( c->cached | c->computed ) &
+                     ( CACHED_SAMPLE | CACHED_DIGEST );
+        data.sample = c->sample;
+        data.digest = c->digest;
+        if ( c->truncated ) {
+            data.flags = 0;
+        }
+        // names of an inode follow its first name
+        for ( const file_record_t *r = candidate_record( c );
+              r < end && same_inode( &r->info, c->info ); ++r ) {
+            tc->known[r - tc->files->records] = data;
+        }
+    }
+    free( candidates );
+}
+
+// compare or list all files of a bucket, with at least 2 names. Bucket
+// records are sorted by inode.
+static void process_bucket( target_context_t *tc, bucket_t *bucket )
+{
+    if ( NULL != bucket->targets ) {
+        process_targets( tc, bucket );
+        return;
+    }
+    if ( NULL != tc->known && NULL == tc->tree ) {
+        digest_bucket( tc, bucket );
+        return;
+    }
+    size_t size = bucket->size;
+    size_t n;
+    candidate_t *candidates = collapse_links( tc, size, bucket->records,
+                                              bucket->n_records, &n );
+    if ( tc->compare ) {        // compare all files with same size
+        compare_all( tc, size, candidates, n );
+    } else if ( n > 1 ) {       // list all files with same size if more than 1
+        output_file_t *files = malloc_or_exit( sizeof(output_file_t) * n );
+        for ( size_t i = 0; i < n; ++i ) {
+            set_output_file( &files[i], pool_path( tc->pool, candidates[i].ref ),
+                             candidates[i].info, NULL );
+            ++tc->redundant;
+        }
+        output_group( tc->out, "same size", size, NULL, files, n );
+        for ( size_t i = 0; i < n; ++i ) {
+            free( (char *)files[i].path );
+        }
+        free( files );
+    }
+    free( candidates );
+}
+
+typedef struct {
+    target_context_t *tc;       // shared settings and totals
+    bucket_t        *buckets;   // in size order
+    size_t          n_buckets;
+    size_t          *order;     // bucket indexes, largest buckets first
+    atomic_size_t   next;       // next index in order
+    int             io_depth;
+    pthread_mutex_t lock;
+    pthread_cond_t  done_cond;
+    atomic_bool     stop;
+} bucket_queue_t;
+
+// one bucket per slice of records with the same size, since records are
+// sorted by size. Single files are usually removed already, but not with -d.
+static void collect_buckets( bucket_queue_t *queue, collection_t *files )
+{
+    file_record_t *records = files->records;
+    size_t n = files->n_records;
+    for ( size_t first = 0, last; first < n; first = last ) {
+        for ( last = first + 1;
+              last < n && records[last].info.size == records[first].info.size;
+              ++last ) ;
+        queue->n_buckets += ( last - first > 1 );
+    }
+    queue->buckets = malloc_or_exit( sizeof(bucket_t) * ( queue->n_buckets + 1 ) );
+    queue->n_buckets = 0;
+    for ( size_t first = 0, last; first < n; first = last ) {
+        for ( last = first + 1;
+              last < n && records[last].info.size == records[first].info.size;
+              ++last ) ;
+        if ( last - first == 1 ) {
+            continue;
+        }
+        bucket_t *bucket = &queue->buckets[queue->n_buckets++];
+        memset( bucket, 0, sizeof(bucket_t) );
+        bucket->size = records[first].info.size;
+        bucket->records = &records[first];
+        bucket->n_records = last - first;
+    }
+}
+
+// with -t, one bucket per slice of targets with the same size, for which
+// some search files have that size
+static void collect_target_buckets( bucket_queue_t *queue, collection_t *files,
+                                    collection_t *targets )
+{
+    file_record_t *records = targets->records;
+    size_t n = targets->n_records;
+    queue->buckets = malloc_or_exit( sizeof(bucket_t) * ( n + 1 ) );
+    for ( size_t first = 0, last; first < n; first = last ) {
+        size_t size = records[first].info.size;
+        for ( last = first + 1; last < n && records[last].info.size == size;
+              ++last ) ;
+        size_t n_found;
+        file_record_t *found = find_size( files, size, &n_found );
+        if ( 0 == n_found ) {
+            continue;
+        }
+        bucket_t *bucket = &queue->buckets[queue->n_buckets++];
+        memset( bucket, 0, sizeof(bucket_t) );
+        bucket->size = size;
+        bucket->records = found;
+        bucket->n_records = n_found;
+        bucket->targets = &records[first];
+        bucket->n_targets = last - first;
+    }
+}
+
+static const bucket_t *sorted_buckets;     // only while sorting the order
+
+// largest amount of data first, then size order
+static int compare_bucket_work( const void *i1, const void *i2 )
+{
+    const bucket_t *b1 = &sorted_buckets[*(const size_t *)i1];
+    const bucket_t *b2 = &sorted_buckets[*(const size_t *)i2];
+    double w1 = (double)b1->size * b1->n_records;
+    double w2 = (double)b2->size * b2->n_records;
+    if ( w1 != w2 ) {
+        return ( w1 > w2 ) ? -1 : 1;
+    }
+    return ( *(const size_t *)i1 < *(const size_t *)i2 ) ? -1 : 1;
+}
+
+static void add_totals( target_context_t *totals, const target_context_t *tc )
+{
+    totals->redundant += tc->redundant;
+    totals->links += tc->links;
+    for ( int i = 0; i < N_STAGES; ++i ) {
+        totals->stats[i].dropped += tc->stats[i].dropped;
+        totals->stats[i].bytes += tc->stats[i].bytes;
+        totals->stats[i].cached += tc->stats[i].cached;
+    }
+}
+
+// each worker has its own reader and counters, added to the shared totals
+// when the worker is done
+static void *bucket_worker( void *arg )
+{
+    bucket_queue_t *queue = arg;
+    target_context_t tc = *queue->tc;
+    tc.redundant = tc.links = 0;
+    memset( tc.stats, 0, sizeof(tc.stats) );
+    tc.reader = ( tc.compare ) ?
+                    new_reader( queue->io_depth, tc.read_flags ) : NULL;
+
+    while ( true ) {
+        size_t i = atomic_fetch_add( &queue->next, 1 );
+        if ( i >= queue->n_buckets ) {
+            break;
+        }
+        bucket_t *bucket = &queue->buckets[queue->order[i]];
+        if ( ! atomic_load( &queue->stop ) ) {
+            tc.out = open_memstream( &bucket->report, &bucket->report_len );
+            if ( NULL == tc.out ) {
+                exit( NO_MEMORY_ERROR );
+            }
+            tc.bucket = bucket;
+            uint64_t span = trace_start( );
+            process_bucket( &tc, bucket );
+            trace_span( span, "bucket", NULL, "size", bucket->size );
+            fclose( tc.out );
+        }
+        pthread_mutex_lock( &queue->lock );
+        bucket->done = true;
+        pthread_cond_broadcast( &queue->done_cond );
+        pthread_mutex_unlock( &queue->lock );
+    }
+    if ( NULL != tc.reader ) {
+        free_reader( tc.reader );
+    }
+    pthread_mutex_lock( &queue->lock );
+    add_totals( queue->tc, &tc );
+    pthread_mutex_unlock( &queue->lock );
+    return NULL;
+}
+
+// print a bucket report, and request removals after each duplicate group,
+// unless stop is already true. Return true if removal is stopped.
+static bool print_bucket( target_context_t *tc, bucket_t *bucket, bool stop )
+{
+    long printed = 0;
+    while ( NULL != bucket->groups ) {
+        removal_group_t *group = bucket->groups;
+        bucket->groups = group->next;
+        if ( ! stop ) {
+            fwrite( bucket->report + printed, 1, group->offset - printed, stdout );
+            printed = group->offset;
+            stop = interactive_remove_files( tc, group->names, group->nnames );
+        }
+        for ( int i = 0; i < group->nnames; ++i ) {
+            free( group->names[i] );
+        }
+        free( group->names );
+        free( group );
+    }
+    if ( ! stop && NULL != bucket->report ) {
+        fwrite( bucket->report + printed, 1, bucket->report_len - printed, stdout );
+    }
+    free( bucket->report );
+    return stop;
+}
+
+// targets is NULL unless files are compared only with targets (-t)
+static void process_buckets( target_context_t *tc, collection_t *targets,
+                             int n_workers, int io_depth )
+{
+    bucket_queue_t queue;
+    memset( &queue, 0, sizeof(queue) );
+    queue.tc = tc;
+    if ( tc->compare ) {
+        tc->stats[SIZE_STAGE].dropped += tc->files->n_singles;
+    }
+    if ( NULL == targets ) {
+        collect_buckets( &queue, tc->files );
+    } else {
+        collect_target_buckets( &queue, tc->files, targets );
+    }
+    if ( 0 == queue.n_buckets ) {
+        free( queue.buckets );
+        return;
+    }
+    if ( NULL == tc->tree ) {   // not again in the second pass of -d
+        for ( size_t i = 0; i < queue.n_buckets; ++i ) {
+            add_bucket( queue.buckets[i].n_records );
+        }
+    }
+    queue.order = malloc_or_exit( sizeof(size_t) * queue.n_buckets );
+    for ( size_t i = 0; i < queue.n_buckets; ++i ) {
+        queue.order[i] = i;
+    }
+    sorted_buckets = queue.buckets;
+    qsort( queue.order, queue.n_buckets, sizeof(size_t), compare_bucket_work );
+    atomic_init( &queue.next, 0 );
+    atomic_init( &queue.stop, false );
+    queue.io_depth = io_depth;
+    pthread_mutex_init( &queue.lock, NULL );
+    pthread_cond_init( &queue.done_cond, NULL );
+    tc->stop = &queue.stop;
+
+    if ( (size_t)n_workers > queue.n_buckets ) {
+        n_workers = (int)queue.n_buckets;
+    }
+    // lockstep gets what is left by the readers of all workers
+    size_t fd_budget = tc->fd_budget;
+    fd_pool_t fds;
+    if ( tc->lockstep ) {
+        size_t readers = (size_t)n_workers * (size_t)io_depth;
+        tc->fd_budget = ( fd_budget > readers + 2 ) ? fd_budget - readers : 2;
+        fds.available = tc->fd_budget;
+        pthread_mutex_init( &fds.lock, NULL );
+        pthread_cond_init( &fds.released, NULL );
+        tc->fds = &fds;
+    }
+    pthread_t *threads = malloc_or_exit( sizeof(pthread_t) * n_workers );
+    for ( int i = 0; i < n_workers; ++i ) {
+        if ( 0 != pthread_create( &threads[i], NULL, bucket_worker, &queue ) ) {
+            printf( "Error: failed to create comparison threads - exiting\n" );
+            exit( INTERNAL_ERROR );
+        }
+    }
+    size_t i = 0;
+    bool stop = false;
+    for ( ; i < queue.n_buckets && ! stop; ++i ) {
+        bucket_t *bucket = &queue.buckets[i];
+        pthread_mutex_lock( &queue.lock );
+        while ( ! bucket->done ) {
+            pthread_cond_wait( &queue.done_cond, &queue.lock );
+        }
+        pthread_mutex_unlock( &queue.lock );
+        stop = print_bucket( tc, bucket, false );
+        if ( stop ) {
+            atomic_store( &queue.stop, true );
+        }
+    }
+    for ( int w = 0; w < n_workers; ++w ) {
+        pthread_join( threads[w], NULL );
+    }
+    for ( ; i < queue.n_buckets; ++i ) {   // not printed after a stop
+        print_bucket( tc, &queue.buckets[i], true );
+    }
+    free( threads );
+    if ( tc->lockstep ) {
+        pthread_cond_destroy( &fds.released );
+        pthread_mutex_destroy( &fds.lock );
+        tc->fds = NULL;
+        tc->fd_budget = fd_budget;
+    }
+    pthread_cond_destroy( &queue.done_cond );
+    pthread_mutex_destroy( &queue.lock );
+    free( queue.order );
+    free( queue.buckets );
+}
+
+static void report_empty( FILE *out, const char *path,
+                          const file_info_t *info, const char *role )
+{
+    output_file_t file;
+    set_output_file( &file, path, info, role );
+    output_group( out, "empty", 0, NULL, &file, 1 );
+}
+
+typedef struct {
+    collection_t    *files;
+    pool_t          *pool;
+    size_t          count;
+    size_t          max_records;    // allocated in files->records
+    const char      *role;      // of empty files reported, NULL or "target"
+    pthread_mutex_t lock;       // table is shared by all walker threads
+} collect_context_t;
+
+/*
+    fmis: target files are collected in their own table, sorted by size
+    like the search files. Only the search files with the size of some
+    target are read: first their samples, then the digests of those whose
+    sample is also the sample of a target. Their digests, sorted, make an
+    index in which each target digest is looked up. Each target and each
+    search file is then read at most once, whatever the number of targets
+    with the same size, and hard links are read only once.
+*/
+
+#define NO_MATCH    SIZE_MAX
+
+// keep the n candidates whose sample is the sample of one of the n_others
+// sorted by sample, and return their number
+static size_t keep_same_samples( candidate_t *candidates, size_t n,
+                                 const candidate_t *others, size_t n_others )
+{
+    size_t kept = 0;
+    for ( size_t i = 0; i < n; ++i ) {
+        if ( NULL != bsearch( &candidates[i], others, n_others,
+                              sizeof(candidate_t), compare_samples ) ) {
+            candidates[kept++] = candidates[i];
+        }
+    }
+    return kept;
+}
+
+// return the index of the first of the n candidates sorted by digest with
+// the same content as target, or NO_MATCH. If verify is true, the content
+// is compared byte to byte, except with files found in an index.
+static size_t find_target( target_context_t *tc, size_t size,
+                           const candidate_t *target,
+                           const candidate_t *candidates, size_t n )
+{
+    const candidate_t *found = bsearch( target, candidates, n,
+                                        sizeof(candidate_t), compare_digests );
+    if ( NULL == found ) {
+        return NO_MATCH;
+    }
+    size_t first = found - candidates;
+    while ( first > 0 &&
+            same_digest( &candidates[first-1].digest, &target->digest ) ) {
+        --first;
+    }
+    if ( ! tc->verify ) {
+        return first;
+    }
+    int fd1 = open_ref( tc->pool, target->ref, tc->read_flags );
+    size_t match = NO_MATCH;
+    for ( size_t i = first; i < n && NO_MATCH == match &&
+                            same_digest( &candidates[i].digest, &target->digest );
+          ++i ) {
+        if ( NULL != indexed_entry( tc->files, candidates[i].ref ) ) {
+            match = i;      // cannot be read, the digest has to do
+            break;
+        }
+        int fd2 = ( -1 == fd1 ) ? -1 :
+                        open_ref( tc->pool, candidates[i].ref, tc->read_flags );
+        if ( compare_files( tc->pool, target->ref, fd1, candidates[i].ref, fd2,
+                            size, &tc->stats[VERIFY_STAGE].bytes,
+                            tc->read_flags ) ) {
+            match = i;
+        }
+        close_ref( fd2 );
+    }
+    close_ref( fd1 );
+    return match;
+}
+
+// report target as found with all names of the candidates with the same
+// digest, starting at match, or as missing if match is NO_MATCH
+static void report_target( target_context_t *tc, size_t size,
+                           const file_record_t *target,
+                           const candidate_t *candidates, size_t n,
+                           const file_record_t *records, size_t n_records,
+                           size_t match )
+{
+    output_file_t *group = malloc_or_exit( sizeof(output_file_t) *
+                                           ( n_records + 1 ) );
+    set_output_file( &group[0], pool_path( tc->pool, target->ref ),
+                     &target->info, "target" );
+    size_t n_group = 1;
+    for ( size_t i = match; i < n && NO_MATCH != match &&
+                            same_digest( &candidates[i].digest,
+                                         &candidates[match].digest ); ++i ) {
+        const file_record_t *name = candidate_record( &candidates[i] );
+        const file_record_t *end = records + n_records;
+        for ( const file_record_t *r = name;
+              r < end && same_inode( &r->info, &name->info ); ++r ) {
+            set_output_file( &group[n_group++], pool_path( tc->pool, r->ref ),
+                             &r->info, NULL );
+        }
+    }
+    qsort( &group[1], n_group - 1, sizeof(output_file_t), compare_output_paths );
+    if ( NO_MATCH == match ) {
+        output_group( stdout, "missing", size, NULL, group, 1 );
+    } else {
+        output_group( stdout, "found", size, &candidates[match].digest,
+                      group, n_group );
+    }
+    for ( size_t i = 0; i < n_group; ++i ) {
+        free( (char *)group[i].path );
+    }
+    free( group );
+}
+
+// check the n_targets with the same size against the n_records search
+// files of that size, and report targets in their order
+static void check_targets( target_context_t *tc, size_t size,
+                           const file_record_t *targets, size_t n_targets,
+                           file_record_t *records, size_t n_records )
+{
+    size_t *matches = malloc_or_exit( sizeof(size_t) * n_targets );
+    for ( size_t i = 0; i < n_targets; ++i ) {
+        matches[i] = NO_MATCH;
+    }
+    size_t n = 0;
+    candidate_t *candidates = inode_candidates( records, n_records, &n );
+    candidate_t *wanted = malloc_or_exit( sizeof(candidate_t) * n_targets );
+    for ( size_t i = 0; i < n_targets; ++i ) {
+        init_candidate( &wanted[i], &targets[i] );
+    }
+    size_t n_wanted = n_targets;
+    lookup_candidates( tc, candidates, n );
+    if ( n > 0 ) {
+        n_wanted = read_candidates( tc, SAMPLE_STAGE, size, wanted, n_wanted );
+        n = read_candidates( tc, SAMPLE_STAGE, size, candidates, n );
+        qsort( wanted, n_wanted, sizeof(candidate_t), compare_samples );
+        n = keep_same_samples( candidates, n, wanted, n_wanted );
+        qsort( candidates, n, sizeof(candidate_t), compare_samples );
+        n_wanted = keep_same_samples( wanted, n_wanted, candidates, n );
+    }
+    if ( n > 0 ) {
+        n_wanted = read_candidates( tc, DIGEST_STAGE, size, wanted, n_wanted );
+        n = read_candidates( tc, DIGEST_STAGE, size, candidates, n );
+        qsort( candidates, n, sizeof(candidate_t), compare_digests );
+        for ( size_t i = 0; i < n_wanted; ++i ) {
+            size_t target = candidate_record( &wanted[i] ) - targets;
+            matches[target] = find_target( tc, size, &wanted[i], candidates, n );
+        }
+    }
+    for ( size_t i = 0; i < n_targets; ++i ) {
+        report_target( tc, size, &targets[i], candidates, n,
+                       records, n_records, matches[i] );
+    }
+    free( wanted );
+    free( candidates );
+    free( matches );
+}
+
+// may be called concurrently by several walker threads
+static void add_record( const walk_file_t *file,
+                        const search_t *search, void *context )
+{
+    collect_context_t *ccp = context;
+
+    if ( 0 != file->info.size ) {
+        file_record_t record;
+        record.info = file->info;
+        record.ref.dir = file->dir_id;
+        record.ref.name = pool_add_name( ccp->pool, file->name );
+
+        pthread_mutex_lock( &ccp->lock );
+        collection_t *files = ccp->files;
+        if ( files->n_records == ccp->max_records ) {
+            ccp->max_records *= 2;
+            files->records = realloc( files->records,
+                                      sizeof(file_record_t) * ccp->max_records );
+            if ( NULL == files->records ) {
+                exit( NO_MEMORY_ERROR );
+            }
+        }
+        files->records[files->n_records++] = record;
+        ++ccp->count;
+        pthread_mutex_unlock( &ccp->lock );
+    } else if ( search->zero ) {
+        char *path = walk_path( file->dir, file->name );
+        report_empty( stdout, path, &file->info, ccp->role );
+        free( path );
+    }
+}
+
+// remove files alone with their size in sorted records, and return the
+// number of records left
+static size_t remove_singles( file_record_t *records, size_t n )
+{
+    size_t kept = 0;
+    for ( size_t first = 0, last; first < n; first = last ) {
+        for ( last = first + 1;
+              last < n && records[last].info.size == records[first].info.size;
+              ++last ) ;
+        if ( last - first > 1 ) {
+            memmove( &records[kept], &records[first],
+                     sizeof(file_record_t) * ( last - first ) );
+            kept += last - first;
+        }
+    }
+    return kept;
+}
+
+// map the index files given as search paths, and return the other paths
+// to walk, and their number in n_walked
+static search_t *open_search_indexes( collection_t *files, const args_t *args,
+                                      size_t *n_walked )
+{
+    size_t n_paths = 0;
+    while ( NULL != args->paths[n_paths].path ) {
+        ++n_paths;
+    }
+    search_t *walked = new_paths( n_paths + 1 );
+    files->indexes = malloc_or_exit( sizeof(search_index_t) * ( n_paths + 1 ) );
+    *n_walked = 0;
+    for ( size_t i = 0; i < n_paths; ++i ) {
+        if ( ! is_index_file( args->paths[i].path ) ) {
+            walked[(*n_walked)++] = args->paths[i];
+            continue;
+        }
+        search_index_t *si = &files->indexes[files->n_indexes++];
+        si->index = open_index( args->paths[i].path );
+        const char *paths = index_paths( si->index, &si->paths_len );
+        si->paths = pool_add_names( files->pool, paths, si->paths_len );
+    }
+    return walked;
+}
+
+extern collection_t *collect_same_size_files( args_t *args )
+{
+    collection_t *files = malloc_or_exit( sizeof(collection_t) );
+    files->pool = new_pool( );
+    files->n_records = 0;
+    files->n_singles = 0;
+    files->n_indexes = 0;
+
+    collect_context_t ctxt;
+    ctxt.files = files;
+    ctxt.pool = files->pool;
+    ctxt.count = 0;
+    ctxt.max_records = INITIAL_RECORDS;
+    ctxt.role = NULL;
+    files->records = malloc_or_exit( sizeof(file_record_t) * ctxt.max_records );
+    pthread_mutex_init( &ctxt.lock, NULL );
+    start_phase( "walk" );
+    size_t n_paths;
+    search_t *paths = open_search_indexes( files, args, &n_paths );
+    // paths written in an index are absolute, so that it can be searched
+    // from any directory
+    char **resolved = NULL;
+    if ( NULL != args->index ) {
+        resolved = malloc_or_exit( sizeof(char *) * ( n_paths + 1 ) );
+        for ( size_t i = 0; i < n_paths; ++i ) {
+            resolved[i] = realpath( paths[i].path, NULL );
+            if ( NULL != resolved[i] ) {    // else reported by the walk
+                paths[i].path = resolved[i];
+            }
+        }
+    }
+    if ( 0 != n_paths ) {
+        walk_directories( paths, n_paths, args->n_threads, files->pool,
+                          add_record, &ctxt );
+    }
+    pthread_mutex_destroy( &ctxt.lock );
+    if ( NULL != resolved ) {
+        for ( size_t i = 0; i < n_paths; ++i ) {
+            free( resolved[i] );
+        }
+        free( resolved );
+    }
+    free( paths );
+
+    if ( NULL == args->target ) {   // otherwise added when targets are known
+        add_all_index_records( files );
+    }
+    sort_by_size( files->records, files->n_records );
+    // only files with the same size matter, unless all files are indexed or
+    // directories are compared
+    if ( NULL == args->target && NULL == args->index && ! args->dirs ) {
+        size_t kept = remove_singles( files->records, files->n_records );
+        files->n_singles = files->n_records - kept;
+        files->n_records = kept;
+        file_record_t *records = realloc( files->records,
+                                 sizeof(file_record_t) * ( kept + 1 ) );
+        if ( NULL != records ) {
+            files->records = records;
+        }
+    }
+    end_phase( );
+    fprintf( info_output( ), "Traversed %ld files\n", ctxt.count );
+    return files;
+}
+
+// collect the target files, sorted by size, in their own table, with their
+// names in the pool of the search files. A single target file has no
+// directory in the pool, its name is its path.
+static collection_t *collect_targets( const search_t *target, pool_t *pool,
+                                      int n_threads )
+{
+    collection_t *targets = malloc_or_exit( sizeof(collection_t) );
+    targets->pool = pool;
+    targets->n_records = 0;
+    targets->n_singles = 0;
+    targets->indexes = NULL;
+    targets->n_indexes = 0;
+
+    collect_context_t ctxt;
+    ctxt.files = targets;
+    ctxt.pool = pool;
+    ctxt.count = 0;
+    ctxt.max_records = INITIAL_RECORDS;
+    ctxt.role = "target";
+    targets->records = malloc_or_exit( sizeof(file_record_t) * ctxt.max_records );
+    pthread_mutex_init( &ctxt.lock, NULL );
+
+    struct stat stat_data;
+    add_count( STAT_COUNT, 1 );
+    if ( 0 != stat( target->path, &stat_data ) ) {
+        printf( "Error: unable to stat target file %s\n", target->path );
+        exit(FILE_IO_ERROR);
+    }
+    if ( S_ISREG( stat_data.st_mode ) ) {       // Handle regular file
+        walk_file_t file;
+        file.dir = NULL;
+        file.name = target->path;
+        file.dir_id = NO_DIR;
+        walk_stat_info( &stat_data, &file.info );
+        if ( 0 == file.info.size ) {            // path is the name
+            if ( target->zero ) {
+                report_empty( stdout, target->path, &file.info, "target" );
+            }
+        } else {
+            add_record( &file, target, &ctxt );
+        }
+    } else if ( S_ISDIR( stat_data.st_mode ) ) { // Handle directory
+        walk_directories( target, 1, n_threads, pool, add_record, &ctxt );
+    } else {
+        printf( "Warning: Target is a special file - skipping\n" );
+    }
+    pthread_mutex_destroy( &ctxt.lock );
+    sort_by_size( targets->records, targets->n_records );
+    return targets;
+}
+
+// add to the search files the indexed files with the size of some target,
+// the only ones that matter
+static void add_target_sizes( collection_t *files, const collection_t *targets )
+{
+    const file_record_t *records = targets->records;
+    size_t n = targets->n_records;
+    for ( int pass = 0; pass < 2; ++pass ) {    // count, then add
+        size_t count = 0;
+        for ( size_t first = 0, last; first < n; first = last ) {
+            size_t size = records[first].info.size;
+            for ( last = first + 1; last < n && records[last].info.size == size;
+                  ++last ) ;
+            for ( size_t i = 0; i < files->n_indexes; ++i ) {
+                size_t n_found;
+                const index_entry_t *found =
+                    index_find_size( files->indexes[i].index, size, &n_found );
+                if ( 1 == pass ) {
+                    add_index_records( files, &files->indexes[i], found, n_found );
+                }
+                count += n_found;
+            }
+        }
+        if ( 0 == pass ) {
+            reserve_records( files, count );
+        }
+    }
+    sort_by_size( files->records, files->n_records );
+}
+
+static unsigned get_read_flags( const args_t *args )
+{
+    unsigned flags = 0;
+    if ( args->mapped ) {
+        flags |= READ_MAPPED;
+    }
+    if ( args->nocache ) {
+        flags |= READ_NOCACHE;
+    }
+    if ( args->direct ) {
+        flags |= READ_DIRECT;
+    }
+    return flags;
+}
+
+// digest of a file without any other file with the same size and sample
+static void inode_digest( const file_info_t *info, digest_t *digest )
+{
+    uint8_t marker = 0xff;          // unlike contents hashed for digests
+    hash_state_t state;
+    hash_init( &state );
+    hash_update( &state, &marker, sizeof(marker) );
+    hash_update( &state, &info->dev, sizeof(info->dev) );
+    hash_update( &state, &info->ino, sizeof(info->ino) );
+    hash_update( &state, &info->mtime_ns, sizeof(info->mtime_ns) );
+    hash_update( &state, &info->ctime_ns, sizeof(info->ctime_ns) );
+    hash_final( &state, digest );
+}
+
+// With -d, run the first pass, then group and report identical directories.
+// Single files are counted and left in the table for the second pass.
+// Return the number of directories that are copies of another.
+static size_t group_directories( target_context_t *tc, int n_workers,
+                                 int io_depth )
+{
+    collection_t *files = tc->files;
+    file_record_t *records = files->records;
+    size_t n = files->n_records;
+    tc->known = malloc_or_exit( sizeof(cache_data_t) * ( n + 1 ) );
+    memset( tc->known, 0, sizeof(cache_data_t) * ( n + 1 ) );
+    process_buckets( tc, NULL, n_workers, io_depth );
+
+    tree_file_t *tree_files = malloc_or_exit( sizeof(tree_file_t) * ( n + 1 ) );
+    size_t n_tree_files = 0;
+    for ( size_t i = 0; i < n; ++i ) {
+        if ( NO_DIR == records[i].ref.dir ) {   // indexed or single path
+            continue;
+        }
+        tree_file_t *tf = &tree_files[n_tree_files++];
+        tf->dir = records[i].ref.dir;
+        tf->size = records[i].info.size;
+        if ( tc->known[i].flags & CACHED_DIGEST ) {
+            tf->digest = tc->known[i].digest;
+        } else {
+            inode_digest( &records[i].info, &tf->digest );
+        }
+    }
+    tc->tree = new_tree( tc->pool, tree_files, n_tree_files );
+    free( tree_files );
+    size_t copies = report_tree( tc->tree, tc->out );
+
+    for ( size_t first = 0, last; first < n; first = last ) {
+        for ( last = first + 1;
+              last < n && records[last].info.size == records[first].info.size;
+              ++last ) ;
+        files->n_singles += ( last - first == 1 );
+    }
+    return copies;
+}
+
+extern void process_duplicates( collection_t *files, args_t *args )
+{
+    magic_t magic = open_magic_lib( );
+    target_context_t tc;
+    tc.cookie = magic;
+    tc.files = files;
+    tc.pool = files->pool;
+    tc.cache = ( NULL == args->cache ) ? NULL :
+                            open_cache( args->cache, args->reset_cache );
+    tc.reader = NULL;
+    tc.out = stdout;
+    tc.bucket = NULL;
+    tc.stop = NULL;
+    tc.plan = NULL;
+    if ( NULL != args->keep ) {
+        keep_policy_t policy;
+        parse_keep_policy( args->keep, &policy );
+        policy.roots = args->paths;
+        tc.plan = new_plan( &policy );
+    }
+    tc.redundant = 0;
+    tc.links = 0;
+    memset( tc.stats, 0, sizeof(tc.stats) );
+    tc.compare = args->compare;
+    tc.lockstep = args->lockstep;
+    tc.read_flags = get_read_flags( args );
+    tc.fd_budget = ( args->lockstep ) ? get_fd_budget( ) : 0;
+    tc.fds = NULL;
+    tc.verify = args->verify;
+    tc.remove = args->remove;
+    tc.confirm = args->confirm;
+    tc.action = REMOVE_ACTION;
+    if ( NULL != args->action ) {
+        parse_action( args->action, &tc.action );
+    }
+    tc.known = NULL;
+    tc.tree = NULL;
+    if ( 0 != files->n_indexes && ( tc.verify || tc.lockstep ) ) {
+        fprintf( info_output(), "WARNING: options -b and -l are ignored "
+                                "when searching an index\n" );
+        tc.verify = tc.lockstep = false;
+    }
+
+    // no I/O to spread over workers if contents are not compared
+    int n_workers = ( args->compare ) ? args->n_threads : 1;
+    size_t dir_copies = 0;
+    stage_stats_t first_pass[N_STAGES];
+    if ( NULL != args->target ) {   // target file or directory subtrees
+        start_phase( "targets" );
+        collection_t *targets = collect_targets( args->target, files->pool,
+                                                 args->n_threads );
+        if ( 0 != files->n_indexes ) {
+            add_target_sizes( files, targets );
+        }
+        start_phase( "compare" );
+        process_buckets( &tc, targets, n_workers, args->io_depth );
+        free( targets->records );
+        free( targets );
+    } else if ( args->dirs ) {
+        start_phase( "directories" );
+        dir_copies = group_directories( &tc, n_workers, args->io_depth );
+        memcpy( first_pass, tc.stats, sizeof(first_pass) );
+        memset( tc.stats, 0, sizeof(tc.stats) );
+        start_phase( "compare" );
+        process_buckets( &tc, NULL, n_workers, args->io_depth );
+        // samples and digests were all read in the first pass
+        for ( int i = 0; i < N_STAGES; ++i ) {
+            tc.stats[i].bytes += first_pass[i].bytes;
+        }
+        tc.stats[SAMPLE_STAGE].cached = first_pass[SAMPLE_STAGE].cached;
+        tc.stats[DIGEST_STAGE].cached = first_pass[DIGEST_STAGE].cached;
+        free_tree( tc.tree );
+        free( tc.known );
+    } else {
+        start_phase( "compare" );
+        process_buckets( &tc, NULL, n_workers, args->io_depth );
+    }
+    end_phase( );
+    if ( tc.compare ) {
+        for ( int i = 0; i < N_STAGES; ++i ) {
+            add_stage( STAGE_NAMES[i], tc.stats[i].dropped, tc.stats[i].bytes,
+                       tc.stats[i].cached );
+        }
+    }
+    if ( ! tc.remove ) {
+        FILE *info = info_output( );
+        if ( args->dirs ) {
+            fprintf( info, "Found %ld redundant directories\n", dir_copies );
+        }
+        fprintf( info, "Found %ld redundant files\n", tc.redundant );
+        if ( 0 != tc.links ) {
+            fprintf( info, "Found %ld hard links, not counted as redundant files\n",
+                     tc.links );
+        }
+        if ( tc.compare ) {
+            for ( int i = 0; i < N_STAGES; ++i ) {
+                fprintf( info, "  %-8s stage: %ld files dropped, %ld bytes read, "
+                         "%ld files cached\n", STAGE_NAMES[i],
+                         tc.stats[i].dropped, tc.stats[i].bytes, tc.stats[i].cached );
+            }
+        }
+    }
+    if ( NULL != tc.plan ) {     // once all duplicates are reported
+        start_phase( "remove" );
+        if ( NULL != args->plan ) {
+            write_plan( tc.plan, args->plan );
+        } else {
+            execute_plan( tc.plan, tc.action, args->n_threads, args->confirm );
+        }
+        free_plan( tc.plan );
+    }
+    if ( NULL != tc.cache ) {
+        start_phase( "cache" );
+        close_cache( tc.cache, args->compact_cache );
+    }
+    end_phase( );
+    if ( NULL != tc.reader ) {
+        free_reader( tc.reader );
+    }
+    close_magic_lib( magic );
+}
+
+extern void search_targets( collection_t *files, args_t *args )
+{
+    if ( NULL == args->target ) {
+        return;
+    }
+    // a single thread, so that targets of a size are reported in walk order
+    start_phase( "targets" );
+    collection_t *targets = collect_targets( args->target, files->pool, 1 );
+    if ( 0 != files->n_indexes ) {
+        add_target_sizes( files, targets );
+    }
+
+    target_context_t tc;
+    memset( &tc, 0, sizeof(tc) );
+    tc.files = files;
+    tc.pool = files->pool;
+    tc.out = stdout;
+    tc.compare = true;
+    tc.read_flags = get_read_flags( args );
+    tc.verify = args->verify;
+    tc.reader = new_reader( args->io_depth, tc.read_flags );
+
+    start_phase( "compare" );
+    file_record_t *records = targets->records;
+    size_t n = targets->n_records;
+    for ( size_t first = 0, last; first < n; first = last ) {
+        size_t size = records[first].info.size;
+        for ( last = first + 1; last < n && records[last].info.size == size;
+              ++last ) ;
+        size_t n_found;
+        file_record_t *found = find_size( files, size, &n_found );
+        if ( 0 != n_found ) {
+            add_bucket( n_found );
+        }
+        uint64_t span = trace_start( );
+        check_targets( &tc, size, &records[first], last - first,
+                       found, n_found );
+        trace_span( span, "targets", NULL, "size", size );
+    }
+    end_phase( );
+    for ( int i = SAMPLE_STAGE; i <= VERIFY_STAGE; ++i ) {
+        add_stage( STAGE_NAMES[i], tc.stats[i].dropped, tc.stats[i].bytes,
+                   tc.stats[i].cached );
+    }
+    free_reader( tc.reader );
+    free( targets->records );
+    free( targets );
+}
+
+/*
+    Index writing: the sample and digest of each inode are read once, or
+    taken from the cache or from the indexes searched, and an entry is made
+    for each of its names. Paths are gathered in a memory stream, at the
+    offsets given in entries until the index is written.
+*/
+typedef struct {
+    index_entry_t   *entries;
+    size_t          n_entries;
+    FILE            *paths;
+} index_writer_t;
+
+static void add_index_entries( index_writer_t *iw, const pool_t *pool,
+                               const candidate_t *c,
+                               const file_record_t *end )
+{
+    const file_record_t *name = candidate_record( c );
+    for ( const file_record_t *r = name;
+          r < end && same_inode( &r->info, &name->info ); ++r ) {
+        index_entry_t *entry = &iw->entries[iw->n_entries++];
+        memset( entry, 0, sizeof(index_entry_t) );
+        entry->size = r->info.size;
+        entry->digest = c->digest;
+        entry->sample = c->sample;
+        entry->dev = r->info.dev;
+        entry->ino = r->info.ino;
+        entry->mtime_ns = r->info.mtime_ns;
+        entry->ctime_ns = r->info.ctime_ns;
+        entry->path = (uint64_t)ftell( iw->paths );
+        char *path = pool_path( pool, r->ref );
+        fwrite( path, 1, strlen( path ) + 1, iw->paths );
+        free( path );
+    }
+}
+
+extern void write_search_index( collection_t *files, args_t *args )
+{
+    target_context_t tc;
+    memset( &tc, 0, sizeof(tc) );
+    tc.files = files;
+    tc.pool = files->pool;
+    tc.cache = ( NULL == args->cache ) ? NULL :
+                            open_cache( args->cache, args->reset_cache );
+    tc.read_flags = get_read_flags( args );
+    tc.reader = new_reader( args->io_depth, tc.read_flags );
+
+    index_writer_t iw;
+    char *paths = NULL;
+    size_t paths_len = 0;
+    iw.entries = malloc_or_exit( sizeof(index_entry_t) * ( files->n_records + 1 ) );
+    iw.n_entries = 0;
+    iw.paths = open_memstream( &paths, &paths_len );
+    if ( NULL == iw.paths ) {
+        exit( NO_MEMORY_ERROR );
+    }
+    start_phase( "index" );
+    file_record_t *records = files->records;
+    size_t n_records = files->n_records;
+    for ( size_t first = 0, last; first < n_records; first = last ) {
+        size_t size = records[first].info.size;
+        for ( last = first + 1;
+              last < n_records && records[last].info.size == size; ++last ) ;
+        size_t n;
+        candidate_t *candidates = inode_candidates( &records[first],
+                                                    last - first, &n );
+        lookup_candidates( &tc, candidates, n );
+        n = read_candidates( &tc, SAMPLE_STAGE, size, candidates, n );
+        n = read_candidates( &tc, DIGEST_STAGE, size, candidates, n );
+        for ( size_t i = 0; i < n; ++i ) {
+            add_index_entries( &iw, tc.pool, &candidates[i], &records[last] );
+        }
+        if ( NULL != tc.cache ) {
+            update_cache( tc.cache, candidates, n );
+        }
+        free( candidates );
+    }
+    fclose( iw.paths );
+    free_reader( tc.reader );
+    if ( NULL != tc.cache ) {
+        close_cache( tc.cache, args->compact_cache );
+    }
+    for ( int i = SAMPLE_STAGE; i <= DIGEST_STAGE; ++i ) {
+        add_stage( STAGE_NAMES[i], tc.stats[i].dropped, tc.stats[i].bytes,
+                   tc.stats[i].cached );
+    }
+    if ( ! write_index( args->index, iw.entries, iw.n_entries,
+                        paths, paths_len ) ) {
+        fprintf( info_output(),
+                 "Error: unable to write index file %s (errno %d) - exiting\n",
+                 args->index, errno );
+        exit( FILE_IO_ERROR );
+    }
+    end_phase( );
+    fprintf( info_output( ), "Indexed %ld files, %ld bytes read\n",
+             iw.n_entries, tc.stats[SAMPLE_STAGE].bytes +
+                           tc.stats[DIGEST_STAGE].bytes );
+    free( paths );
+    free( iw.entries );
+}
+
+// names are all in the pool, or in the indexes
+extern void free_collected_data( collection_t *files )
+{
+    free( files->records );
+    free_pool( files->pool );
+    for ( size_t i = 0; i < files->n_indexes; ++i ) {
+        close_index( files->indexes[i].index );
+    }
+    free( files->indexes );
+    free( files );
 }
@@ -2,11 +2,12 @@
 #ifndef __COMP_H__
 #define __COMP_H__
 
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
 #include <stdbool.h>
 
-#include "map.h"
-
 // exit codes
 #define NO_ERROR            0
 #define ARGUMENT_ERROR      1
@@ -15,8 +16,10 @@
 #define INTERNAL_ERROR      4
 
 // initial dynamic structure sizes
-#define INITIAL_HASH_SIZE   2048
-#define MAX_COLLISIONS      6
+#define INITIAL_RECORDS     4096
+
+// default number of reads in flight when comparing file contents
+#define DEFAULT_IO_DEPTH    32
 
 // defsult viewer for showing file contents
 #define IMAGE_VIEWER    "eom"
@@ -31,7 +34,18 @@ typedef struct {
 typedef struct {
     search_t    *paths;
     search_t    *target;
-    bool        compare, remove, confirm;
+    int         n_threads;      // number of threads walking or comparing
+    int         io_depth;       // number of reads in flight per thread
+    char        *cache;         // digest cache file path, or NULL
+    char        *keep;          // batch removal keep policy, or NULL
+    char        *plan;          // batch removal plan file to write, or NULL
+    char        *replay;        // batch removal plan file to carry out
+    char        *action;        // remove (default), link, clone or dedupe
+    char        *index;         // index file to write, or NULL
+    bool        reset_cache, compact_cache;
+    bool        compare, lockstep, mapped, verify, remove, confirm;
+    bool        nocache, direct;    // avoid filling the page cache
+    bool        dirs;           // report identical directories
 } args_t;
 
 static inline void error( char *msg )
@@ -53,6 +67,24 @@ static inline void set_new_target( args_t *args,
     args->target = target;
 }
 
+static inline int default_threads( void )
+{
+    long n = sysconf( _SC_NPROCESSORS_ONLN );
+    return ( n < 1 ) ? 1 : (int)n;
+}
+
+// parse the value of an option given as -x=<n>, with n > 0
+static inline int get_count_value( char opt, const char *value )
+{
+    char *end;
+    long n = strtol( value, &end, 10 );
+    if ( '\0' != *end || n < 1 || n > 1024 ) {
+        printf( "-%c: ", opt );
+        error( "invalid count" );
+    }
+    return (int)n;
+}
+
 static inline search_t *new_paths( int n_paths )
 {
     search_t *paths = malloc( sizeof(search_t) * n_paths );
@@ -77,11 +109,17 @@ static inline void free_target_n_paths( args_t *args )
     free( args->paths );
 }
 
-extern map_t *collect_same_size_files( args_t *args );
+// files collected from all search paths
+typedef struct _collection collection_t;
+
+extern collection_t *collect_same_size_files( args_t *args );
+
+extern void process_duplicates( collection_t *files, args_t *args );
+extern void search_targets( collection_t *files, args_t *args );
 
-extern void process_duplicates( map_t *map, args_t *args );
-extern void search_targets( map_t *map, args_t *args );
+// write the content index of all files collected to args->index
+extern void write_search_index( collection_t *files, args_t *args );
 
-extern void free_collected_data( map_t *map );
+extern void free_collected_data( collection_t *files );
 
 #endif /* __COMP_H__ */
@@ -0,0 +1,190 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/sysmacros.h>
+#include <sys/mman.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <linux/fs.h>
+#include <linux/fiemap.h>
+
+#include "comp.h"
+#include "device.h"
+
+#define MAX_DEVICES         64      // rotational states remembered
+
+typedef struct {
+    uint64_t        dev;
+    bool            rotational;
+    int             in_flight;  // reads claimed by all readers
+} device_t;
+
+static pthread_mutex_t device_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t device_cond = PTHREAD_COND_INITIALIZER;
+static device_t devices[MAX_DEVICES];
+static int n_devices;
+
+// a partition has no queue directory, but its parent device has
+static bool read_rotational( uint64_t dev )
+{
+    const char *formats[2] = { "/sys/dev/block/%u:%u/queue/rotational",
+                               "/sys/dev/block/%u:%u/../queue/rotational" };
+    for ( int i = 0; i < 2; ++i ) {
+        char path[64];
+        snprintf( path, sizeof(path), formats[i], major( dev ), minor( dev ) );
+        FILE *f = fopen( path, "r" );
+        if ( NULL != f ) {
+            int value = 0;
+            bool found = 1 == fscanf( f, "%d", &value );
+            fclose( f );
+            if ( found ) {
+                return 0 != value;
+            }
+        }
+    }
+    return false;
+}
+
+// to call with device_lock held
+static device_t *find_device( uint64_t dev )
+{
+    for ( int i = 0; i < n_devices; ++i ) {
+        if ( devices[i].dev == dev ) {
+            return &devices[i];
+        }
+    }
+    return NULL;
+}
+
+extern bool device_rotational( uint64_t dev )
+{
+    pthread_mutex_lock( &device_lock );
+    device_t *device = find_device( dev );
+    if ( NULL != device ) {
+        bool rotational = device->rotational;
+        pthread_mutex_unlock( &device_lock );
+        return rotational;
+    }
+    bool rotational = read_rotational( dev );
+    if ( n_devices < MAX_DEVICES ) {
+        devices[n_devices].dev = dev;
+        devices[n_devices].rotational = rotational;
+        devices[n_devices].in_flight = 0;
+        ++n_devices;
+    }
+    pthread_mutex_unlock( &device_lock );
+    return rotational;
+}
+
+extern bool claim_device_read( uint64_t dev, int limit, bool wait )
+{
+    pthread_mutex_lock( &device_lock );
+    device_t *device = find_device( dev );
+    while ( wait && NULL != device && device->in_flight >= limit ) {
+        pthread_cond_wait( &device_cond, &device_lock );
+    }
+    bool claimed = NULL == device || device->in_flight < limit;
+    if ( NULL != device && claimed ) {
+        ++device->in_flight;
+    }
+    pthread_mutex_unlock( &device_lock );
+    return claimed;
+}
+
+extern void release_device_read( uint64_t dev )
+{
+    pthread_mutex_lock( &device_lock );
+    device_t *device = find_device( dev );
+    if ( NULL != device ) {
+        --device->in_flight;
+        pthread_cond_broadcast( &device_cond );
+    }
+    pthread_mutex_unlock( &device_lock );
+}
+
+extern uint64_t file_physical_offset( int fd, uint64_t offset )
+{
+    // room for the request and the first extent, which is the only needed
+    uint64_t buffer[( sizeof(struct fiemap) +
+                      sizeof(struct fiemap_extent) ) / sizeof(uint64_t)];
+    memset( buffer, 0, sizeof(buffer) );
+    struct fiemap *map = (struct fiemap *)buffer;
+    map->fm_start = offset;
+    map->fm_length = FIEMAP_MAX_OFFSET - offset;
+    map->fm_extent_count = 1;
+    const struct fiemap_extent *extent = &map->fm_extents[0];
+    if ( 0 != ioctl( fd, FS_IOC_FIEMAP, map ) || 0 == map->fm_mapped_extents ||
+         0 != ( extent->fe_flags & FIEMAP_EXTENT_UNKNOWN ) ) {
+        return NO_PHYSICAL_OFFSET;
+    }
+    if ( offset > extent->fe_logical ) {
+        return extent->fe_physical + ( offset - extent->fe_logical );
+    }
+    return extent->fe_physical;
+}
+
+#ifndef __NR_cachestat
+#define __NR_cachestat      451     // since linux 6.5
+#endif
+
+// same layouts as struct cachestat_range and struct cachestat
+typedef struct {
+    uint64_t        off, len;
+} cachestat_range_t;
+
+typedef struct {
+    uint64_t        nr_cache, nr_dirty, nr_writeback;
+    uint64_t        nr_evicted, nr_recently_evicted;
+} cachestat_t;
+
+static atomic_bool no_cachestat;    // set once cachestat is not available
+
+// without cachestat, map the range and check its pages with mincore
+static bool mapped_resident( int fd, uint64_t offset, uint64_t length,
+                             uint64_t page_size )
+{
+    uint64_t start = offset & ~( page_size - 1 );
+    size_t len = (size_t)( offset + length - start );
+    size_t n_pages = ( len + page_size - 1 ) / page_size;
+    void *base = mmap( NULL, len, PROT_READ, MAP_SHARED, fd, (off_t)start );
+    if ( MAP_FAILED == base ) {
+        return false;
+    }
+    unsigned char *pages = malloc( n_pages );
+    bool resident = NULL != pages && 0 == mincore( base, len, pages );
+    for ( size_t i = 0; resident && i < n_pages; ++i ) {
+        resident = 0 != ( pages[i] & 1 );
+    }
+    free( pages );
+    munmap( base, len );
+    return resident;
+}
+
+extern bool file_resident( int fd, uint64_t offset, uint64_t length )
+{
+    if ( 0 == length ) {
+        return true;
+    }
+    uint64_t page_size = (uint64_t)sysconf( _SC_PAGESIZE );
+    if ( ! atomic_load( &no_cachestat ) ) {
+        uint64_t start = offset & ~( page_size - 1 );
+        cachestat_range_t range = { start, offset + length - start };
+        cachestat_t stat;
+        if ( 0 == syscall( __NR_cachestat, fd, &range, &stat, 0 ) ) {
+            return stat.nr_cache >= ( range.len + page_size - 1 ) / page_size;
+        }
+        if ( ENOSYS != errno ) {
+            return false;
+        }
+        atomic_store( &no_cachestat, true );
+    }
+    return mapped_resident( fd, offset, length, page_size );
+}
@@ -0,0 +1,38 @@
+#ifndef __DEVICE_H__
+#define __DEVICE_H__
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+/*
+    Properties of devices and files used to schedule reads: whether the
+    block device holding a file system is rotational (reads are then
+    ordered by physical offset to limit seeks), where a file is stored on
+    its device, and whether a file range is already in the page cache.
+
+    Devices without a block device in sysfs (tmpfs, network or virtual
+    file systems) are considered as non rotational. All functions are
+    thread safe.
+*/
+
+#define NO_PHYSICAL_OFFSET  UINT64_MAX
+
+// return true if dev (st_dev of a file) is on a rotational block device
+extern bool device_rotational( uint64_t dev );
+
+// Reads in flight on rotational devices are counted for the whole process,
+// as each comparing thread has its own reader. Claim a read on dev if fewer
+// than limit are in flight, or return false, unless wait is set, in which
+// case wait for one to be released. Devices not remembered are not limited.
+extern bool claim_device_read( uint64_t dev, int limit, bool wait );
+extern void release_device_read( uint64_t dev );
+
+// return the physical offset on its device of the file data at offset, or
+// NO_PHYSICAL_OFFSET if it is unknown (e.g. file system without FIEMAP)
+extern uint64_t file_physical_offset( int fd, uint64_t offset );
+
+// return true if all pages of length bytes at offset are in the page cache
+extern bool file_resident( int fd, uint64_t offset, uint64_t length );
+
+#endif /* __DEVICE_H__ */
@@ -6,52 +6,179 @@
 #include <assert.h>
 
 #include "comp.h"
+#include "output.h"
+#include "batch.h"
+#include "stats.h"
+#include "trace.h"
 
 static void help( void )
 {
-    printf( "fdup -h -cnNrwzZt=<path> [-nNzZ <path>]*\n\n" );
+    printf( "fdup -h -0bcEIlmnNrsuUwzZa=<action>C=<file>i=<file>j=<n>k=<policy>\n" );
+    printf( "     o=<format>P=<file>q=<n>R=<file>s=<format>t=<path>T=<file>\n" );
+    printf( "     [-nNzZ <path>]*\n\n" );
     printf( "look for multiple instances of the same file content in all\n" );
     printf( "directories and their sub-directories\n\n" );
     printf( "Options:\n" );
     printf( "   -h          print this help message and exit.\n" );
+    printf( "   -j=<n>      use n threads to walk directories and to compare files\n" );
+    printf( "               of different sizes. By default, one thread per processor\n" );
+    printf( "               is used.\n" );
+    printf( "   -q=<n>      keep up to n reads in flight per comparing thread\n" );
+    printf( "               (default %d).\n", DEFAULT_IO_DEPTH );
+    printf( "   -o=<format> write results as text (default), json (one JSON object\n" );
+    printf( "               per line) or nul (NUL separated fields).\n" );
+    printf( "   -0          same as -o=nul.\n" );
+    printf( "   -a=<action> what to do with the files selected for removal (with\n" );
+    printf( "               -r, -k or -R): remove (default), or replace them with\n" );
+    printf( "               a hard link (link), a clone (clone) or a shared copy\n" );
+    printf( "               (dedupe) of a file kept (see below).\n" );
+    printf( "   -b          verify byte to byte that files with the same content\n" );
+    printf( "               digest are identical.\n" );
     printf( "   -c          compare file contents. By default, check only if file\n" );
     printf( "               sizes are the same.\n" );
+    printf( "   -d          report identical directories first, then the identical\n" );
+    printf( "               files outside their copies (with -c, see below).\n" );
+    printf( "   -C=<file>   keep file samples and digests in the cache file, to\n" );
+    printf( "               avoid reading again unchanged files in the next runs.\n" );
+    printf( "   -E          compact the cache: keep only the entries used in this\n" );
+    printf( "               run (ignored if -C is not given).\n" );
+    printf( "   -i=<file>   write the content index of all files found to file,\n" );
+    printf( "               instead of looking for identical files (see below).\n" );
+    printf( "   -I          invalidate the cache: ignore its current content, which\n" );
+    printf( "               is replaced by this run (ignored if -C is not given).\n" );
+    printf( "   -l          compare all files with the same size at once, chunk by\n" );
+    printf( "               chunk, instead of comparing their digests.\n" );
+    printf( "   -m          map large files in memory to compare them, instead of\n" );
+    printf( "               reading them.\n" );
     printf( "   -n          do not enter subdirectories. This option applies only\n" );
     printf( "               to the following path and may be repeated before each\n" );
     printf( "               directory path to search\n");
     printf( "   -N          same as -n but it applies to all following paths\n" );
+    printf( "   -k=<policy> remove identical files without questions, keeping only\n" );
+    printf( "               the files selected by policy: oldest, newest, shortest,\n" );
+    printf( "               root or match=<pattern> (see below).\n" );
+    printf( "   -P=<file>   with -k, write the removal plan to file instead of\n" );
+    printf( "               removing files.\n" );
+    printf( "   -R=<file>   remove the files planned in file (written with -P),\n" );
+    printf( "               without searching directories.\n" );
+    printf( "   -s          write run statistics at the end (see below).\n" );
+    printf( "   -s=<format> same as -s, written as text (default) or json (a single\n" );
+    printf( "               JSON object).\n" );
     printf( "   -r          remove some of the same files. By default, just list\n" );
     printf( "               their names. The list of file(s) to remove is requested\n" );
-    printf( "   -w          removal with extra confirmation after files are selected\n" );
+    printf( "   -u          drop file contents from the page cache once read.\n" );
+    printf( "   -U          read file contents without going through the page\n" );
+    printf( "               cache (O_DIRECT), if the file system allows it.\n" );
+    printf( "   -w          removal with extra confirmation after files are selected,\n" );
+    printf( "               or once for the whole plan with -k or -R\n" );
     printf( "   -z          show empty files while traversing directories. By default\n" );
     printf( "               empty files are silently ignored. This option applies only\n" );
     printf( "               to the following path and may be repeated before each path\n" );
     printf( "               to search\n" );
     printf( "   -Z          same as -z but it applies to all following paths\n" );
     printf( "   -t=<path>   set a specific target file or directory to find\n" );
-    printf( "               duplicates of\n\n" );
+    printf( "               duplicates of\n" );
+    printf( "   -T=<file>   write a trace of the work done by each thread to file\n" );
+    printf( "               (see below).\n\n" );
 
     printf( "The following paths are the pathnames of the root directories to scan\n" );
-    printf( "for identical files. If absent, the current directory is used instead.\n\n" );
+    printf( "for identical files. If absent, the current directory is used instead.\n" );
+    printf( "A path may also be an index file written with option -i, which is\n" );
+    printf( "searched instead of the directories it was made from.\n\n" );
 
     printf( "Notes:\n" );
     printf( "   With no option selected, fdup displays the path of all files\n" );
     printf( "   with the same size. To check if file contents are truly\n" );
     printf( "   identical, set the option -c.\n\n" );
-    printf( "   Options -r and -w are ignored if option -c is not selected.\n\n" );
+    printf( "   Options -b, -C, -l, -m, -r, -u, -U and -w are ignored if option -c\n" );
+    printf( "   is not selected.\n\n" );
+    printf( "   Options -u and -U avoid evicting from the page cache the data used by\n" );
+    printf( "   other programs while scanning. Option -m is ignored with them.\n\n" );
+    printf( "   With options -o=json and -o=nul, only results are written to the\n" );
+    printf( "   standard output, one group of files at a time, with its type (e.g.\n" );
+    printf( "   duplicates, links or same size), size, content digest if known and\n" );
+    printf( "   the path, device and inode of each file. Other messages are written\n" );
+    printf( "   to the standard error. In JSON, a path that is not valid UTF-8 has\n" );
+    printf( "   its invalid bytes replaced by U+FFFD, and its exact bytes are also\n" );
+    printf( "   given in hexadecimal as path_hex. Option -r requires text output.\n\n" );
+    printf( "   Option -c compares the content digest of files. Files with the same\n" );
+    printf( "   digest are considered identical, unless option -b is also given, in\n" );
+    printf( "   which case their content is compared byte to byte.\n\n" );
+    printf( "   Option -l reads in lockstep all files with the same size, keeping\n" );
+    printf( "   them all open, so that each byte is read at most once and identical\n" );
+    printf( "   files are found without digest. Groups too large for the number of\n" );
+    printf( "   files that can be open are first split by sample and digest. Option\n" );
+    printf( "   -b is ignored with option -l.\n\n" );
     printf( "   Option -r tries to remove some identical files. All identical files\n" );
     printf( "   are listed and the indexes of the files to remove in the list are\n" );
     printf( "   requested. If none are selected, no removal happens. If the index is\n" );
     printf( "   invalid (out of range), the question is asked again. It is possible to\n" );
     printf( "   view the common file content if a viewer is installed for that content\n" );
     printf( "   and to stop the interactive removal at any point\n\n" );
+    printf( "   Option -k selects in each group of identical files the files to keep,\n" );
+    printf( "   and removes all others: the file with the oldest or newest\n" );
+    printf( "   modification time, the file with the shortest path, the file found\n" );
+    printf( "   under the first path given (root), or all files whose path matches\n" );
+    printf( "   the shell pattern (match=<pattern>, e.g. match=*/photos/*). Groups\n" );
+    printf( "   without any file to keep are left alone. Files are removed once all\n" );
+    printf( "   groups are found, by several threads, and only if they did not\n" );
+    printf( "   change, some file kept in their group is still there, and both\n" );
+    printf( "   still have the same bytes. Option -r is ignored with option -k.\n\n" );
+    printf( "   With option -P, the removal plan is written to a text file instead,\n" );
+    printf( "   one line per file (keep or remove, size, device:inode, modification\n" );
+    printf( "   and change times in nanoseconds, and path) and an empty line after\n" );
+    printf( "   each group. It can be reviewed, edited, and carried out later with\n" );
+    printf( "   option -R, which ignores all options but -a, -j and -w.\n\n" );
+    printf( "   Option -a keeps the path of the files selected for removal, which\n" );
+    printf( "   are replaced instead: link makes them hard links to a file kept on\n" );
+    printf( "   the same file system, clone makes them copies sharing its data, and\n" );
+    printf( "   dedupe shares its data in place, after the kernel checked that both\n" );
+    printf( "   contents are identical. Clone and dedupe need a file system able to\n" );
+    printf( "   share data, such as btrfs or XFS. Links and clones are created under\n" );
+    printf( "   a temporary name and renamed over the file they replace. The space\n" );
+    printf( "   reclaimed is reported for each group.\n\n" );
     printf( "   Option -w asks for extra confirmation after the files to removed have\n" );
-    printf( "   been selected, before removal happens (ignored if -r is not selected).\n\n" );
+    printf( "   been selected, before removal happens (ignored if -r, -k or -R is not\n" );
+    printf( "   selected).\n\n" );
+    printf( "   Option -i reads all files found once, or takes their digest from\n" );
+    printf( "   the cache or from the index files searched, and writes their size,\n" );
+    printf( "   digest and path to an index file, sorted by size and digest. The\n" );
+    printf( "   index is then given as a search path to fdup or fmis to look for\n" );
+    printf( "   files in the directories indexed, e.g. on a volume not mounted,\n" );
+    printf( "   without walking or reading them. Search paths are made absolute\n" );
+    printf( "   (with realpath), so that the index is used from any directory.\n" );
+    printf( "   Files found in an index are never read, so that options -b and -l\n" );
+    printf( "   are ignored when searching an index, and the files are not removed\n" );
+    printf( "   if the volume is not mounted. Options -k, -r and -t are ignored\n" );
+    printf( "   with -i.\n\n" );
     printf( "   Without option -t, the directories are scanned and each file found\n" );
     printf( "   is compared against all others. The result is a list of files that\n" );
     printf( "   have duplicates under the same or different name somehwere in the\n" );
     printf( "   directory trees. Option -t restricts the comparison to the specific\n" );
-    printf( "   file, or to all files in the specific directory given by option -t.\n\n" );
+    printf( "   file, or to all files in the specific directory given by option -t.\n" );
+    printf( "   Target files are grouped by size and digest, so that each file with\n" );
+    printf( "   the size of a target is read once whatever the number of targets,\n" );
+    printf( "   and targets are reported by size, then in path order.\n\n" );
+    printf( "   With option -d, identical directories are reported first: they hold\n" );
+    printf( "   files with the same contents, in the same tree shape, whatever their\n" );
+    printf( "   names. In path order, the first directory of each group is kept and\n" );
+    printf( "   the next ones are its copies. Only the topmost copies are listed,\n" );
+    printf( "   and files inside copies are left out of the groups of identical\n" );
+    printf( "   files. Option -d is ignored with -i, -k, -r or -t, and option -l\n" );
+    printf( "   is ignored with -d.\n\n" );
+    printf( "   Option -s writes, once done, the wall and CPU time of each phase\n" );
+    printf( "   (walk, compare, remove...), the number of directories opened,\n" );
+    printf( "   entries read, stat calls and files opened, the files dropped and\n" );
+    printf( "   bytes read at each stage, the number of files found different by a\n" );
+    printf( "   byte comparison before their end, a histogram of the groups of\n" );
+    printf( "   files with the same size by number of files, and the peak memory\n" );
+    printf( "   used. They go where other messages go (see -o).\n\n" );
+    printf( "   Option -T records when each directory is opened and read, each\n" );
+    printf( "   batch of stat calls, each file read, each byte comparison and each\n" );
+    printf( "   group of files of a size compared, on the thread that did it, and\n" );
+    printf( "   writes them in the Chrome trace event format, e.g. for Perfetto\n" );
+    printf( "   (ui.perfetto.dev), to see whether a run waits on metadata, on reads\n" );
+    printf( "   or on the processor.\n\n" );
     printf( "Directory paths must be given after all options.\n\n" );
 }
 
@@ -59,13 +186,31 @@ static void get_args( int argc, char **argv, args_t *args )
 {
     args->paths = NULL;
     args->target = NULL;
+    args->n_threads = default_threads( );
+    args->io_depth = DEFAULT_IO_DEPTH;
+    args->cache = NULL;
+    args->keep = NULL;
+    args->plan = NULL;
+    args->replay = NULL;
+    args->action = NULL;
+    args->index = NULL;
+    args->reset_cache = false;
+    args->compact_cache = false;
     args->compare = false;
+    args->lockstep = false;
+    args->mapped = false;
+    args->nocache = false;
+    args->direct = false;
+    args->verify = false;
     args->remove = false;
     args->confirm = false;
+    args->dirs = false;
     bool zero_default = false;
     bool zero = false;
     bool nosub_default = false;
     bool nosub = false;
+    keep_policy_t policy;       // only to check -k
+    action_t action = REMOVE_ACTION;
 
     int n_paths = 0;
     bool expecting_target = false;
@@ -79,9 +224,101 @@ static void get_args( int argc, char **argv, args_t *args )
                 case 'h': case 'H':
                     help();
                     exit(0);
+                case 'j':
+                    if ( '=' != arg[j+1] ) {
+                        error( "-j requires '=' before the number of threads" );
+                    }
+                    args->n_threads = get_count_value( 'j', &arg[j+2] );
+                    j += 1 + strlen(&arg[j+2]);
+                    break;
+                case 'q':
+                    if ( '=' != arg[j+1] ) {
+                        error( "-q requires '=' before the number of reads" );
+                    }
+                    args->io_depth = get_count_value( 'q', &arg[j+2] );
+                    j += 1 + strlen(&arg[j+2]);
+                    break;
+                case 'o':
+                    if ( '=' != arg[j+1] ) {
+                        error( "-o requires '=' before the output format" );
+                    }
+                    if ( ! set_output_format( &arg[j+2] ) ) {
+                        error( "unknown output format" );
+                    }
+                    j += 1 + strlen(&arg[j+2]);
+                    break;
+                case '0':
+                    set_output( NUL_OUTPUT );
+                    break;
+                case 'a':
+                    if ( '=' != arg[j+1] ) {
+                        error( "-a requires '=' before the action" );
+                    }
+                    if ( ! parse_action( &arg[j+2], &action ) ) {
+                        error( "unknown action" );
+                    }
+                    args->action = &arg[j+2];
+                    j += 1 + strlen(&arg[j+2]);
+                    break;
+                case 'b':
+                    args->verify = true;
+                    break;
                 case 'c':
                     args->compare = true;
                     break;
+                case 'd':
+                    args->dirs = true;
+                    break;
+                case 'C':
+                    if ( '=' != arg[j+1] || '\0' == arg[j+2] ) {
+                        error( "-C requires '=' before the cache file path" );
+                    }
+                    args->cache = &arg[j+2];
+                    j += 1 + strlen(&arg[j+2]);
+                    break;
+                case 'E':
+                    args->compact_cache = true;
+                    break;
+                case 'i':
+                    if ( '=' != arg[j+1] || '\0' == arg[j+2] ) {
+                        error( "-i requires '=' before the index file path" );
+                    }
+                    args->index = &arg[j+2];
+                    j += 1 + strlen(&arg[j+2]);
+                    break;
+                case 'I':
+                    args->reset_cache = true;
+                    break;
+                case 'k':
+                    if ( '=' != arg[j+1] ) {
+                        error( "-k requires '=' before the keep policy" );
+                    }
+                    if ( ! parse_keep_policy( &arg[j+2], &policy ) ) {
+                        error( "unknown keep policy" );
+                    }
+                    args->keep = &arg[j+2];
+                    j += 1 + strlen(&arg[j+2]);
+                    break;
+                case 'P':
+                    if ( '=' != arg[j+1] || '\0' == arg[j+2] ) {
+                        error( "-P requires '=' before the plan file path" );
+                    }
+                    args->plan = &arg[j+2];
+                    j += 1 + strlen(&arg[j+2]);
+                    break;
+                case 'R':
+                    if ( '=' != arg[j+1] || '\0' == arg[j+2] ) {
+                        error( "-R requires '=' before the plan file path" );
+                    }
+                    args->replay = &arg[j+2];
+                    j += 1 + strlen(&arg[j+2]);
+                    break;
+                case 'l':
+                    args->lockstep = true;
+                    break;
+                case 'm':
+                    args->mapped = true;
+                    break;
                 case 'n':
                     nosub = true;
                     break;
@@ -91,6 +328,22 @@ static void get_args( int argc, char **argv, args_t *args )
                 case 'r':
                     args->remove = true;
                     break;
+                case 's':
+                    if ( '=' != arg[j+1] ) {
+                        set_stats_format( "text" );
+                        break;
+                    }
+                    if ( ! set_stats_format( &arg[j+2] ) ) {
+                        error( "unknown stats format" );
+                    }
+                    j += 1 + strlen(&arg[j+2]);
+                    break;
+                case 'u':
+                    args->nocache = true;
+                    break;
+                case 'U':
+                    args->direct = true;
+                    break;
                 case 't':
                     if ( NULL != args->target ) {
                         error( "multiple target definitions");
@@ -111,6 +364,15 @@ static void get_args( int argc, char **argv, args_t *args )
                 case 'w':
                     args->confirm = true;
                     break;
+                case 'T':
+                    if ( '=' != arg[j+1] || '\0' == arg[j+2] ) {
+                        error( "-T requires '=' before the trace file path" );
+                    }
+                    if ( ! set_trace_file( &arg[j+2] ) ) {
+                        error( "unable to create the trace file" );
+                    }
+                    j += 1 + strlen(&arg[j+2]);
+                    break;
                 case 'z':
                     zero = true;
                     break;
@@ -151,16 +413,105 @@ static void get_args( int argc, char **argv, args_t *args )
         set_path( args, 1, NULL, false, false );
     }
 
+    if ( NULL != args->index ) {    // contents are read, but not compared
+        if ( NULL != args->target || NULL != args->keep || args->remove ) {
+            fprintf( info_output(),
+                     "WARNING: options -k, -r and -t are ignored when option -i "
+                     "is given\n" );
+        }
+        free( args->target );
+        args->target = NULL;
+        args->keep = NULL;
+        args->remove = false;
+        args->compare = true;
+    }
+    if ( args->dirs && ( NULL != args->index || NULL != args->target ||
+                         NULL != args->keep || args->remove ) ) {
+        fprintf( info_output(),
+                 "WARNING: option -d is ignored when option -i, -k, -r or -t "
+                 "is given\n" );
+        args->dirs = false;
+    }
     if ( args->compare == false ) {
+        if ( args->dirs ) {
+            fprintf( info_output(),
+                     "WARNING: option -d is ignored when option -c is not given\n" );
+        }
+        args->dirs = false;
+        if ( args->verify ) {
+            fprintf( info_output(),
+                     "WARNING: option -b is ignored when option -c is not given\n" );
+        }
+        if ( args->cache ) {
+            fprintf( info_output(),
+                     "WARNING: option -C is ignored when option -c is not given\n" );
+        }
+        args->cache = NULL;
+        if ( args->keep ) {
+            fprintf( info_output(),
+                     "WARNING: option -k is ignored when option -c is not given\n" );
+        }
+        args->keep = NULL;
         if ( args->remove) {
-            printf( "WARNING: option -r is ignored when option -c is not given\n" );
+            fprintf( info_output(),
+                     "WARNING: option -r is ignored when option -c is not given\n" );
         }
+        args->verify = false;
+        args->lockstep = false;
+        args->mapped = false;
+        args->nocache = false;
+        args->direct = false;
+        args->remove = false;
+    }
+    if ( args->mapped && ( args->nocache || args->direct ) ) {
+        fprintf( info_output(),
+                 "WARNING: option -m is ignored when option -u or -U is given\n" );
+        args->mapped = false;
+    }
+    if ( args->lockstep && args->dirs ) {
+        fprintf( info_output(),
+                 "WARNING: option -l is ignored when option -d is given\n" );
+        args->lockstep = false;
+    }
+    if ( args->lockstep && args->verify ) {
+        fprintf( info_output(),
+                 "WARNING: option -b is ignored when option -l is given\n" );
+        args->verify = false;
+    }
+    if ( NULL == args->cache && ( args->compact_cache || args->reset_cache ) ) {
+        fprintf( info_output(),
+                 "WARNING: options -E and -I are ignored when option -C is not given\n" );
+        args->compact_cache = args->reset_cache = false;
+    }
+    if ( args->keep && args->remove ) {
+        fprintf( info_output(),
+                 "WARNING: option -r is ignored when option -k is given\n" );
         args->remove = false;
     }
-    if ( args->remove == false && args->confirm == true ) {
-        printf( "WARNING: option -w is ignored when option -r is not given\n" );
+    if ( NULL == args->keep && args->plan ) {
+        fprintf( info_output(),
+                 "WARNING: option -P is ignored when option -k is not given\n" );
+        args->plan = NULL;
+    }
+    if ( args->remove == false && args->confirm == true &&
+         ( NULL == args->keep || NULL != args->plan ) && NULL == args->replay ) {
+        fprintf( info_output(),
+                 "WARNING: option -w is ignored when option -r, -k or -R "
+                 "is not given\n" );
         args->confirm = false;
     }
+    if ( args->action && ! args->remove && NULL == args->keep &&
+         NULL == args->replay ) {
+        fprintf( info_output(),
+                 "WARNING: option -a is ignored when option -r, -k or -R "
+                 "is not given\n" );
+        args->action = NULL;
+    }
+    if ( args->remove && TEXT_OUTPUT != output_format() ) {
+        fprintf( info_output(),
+                 "WARNING: options -o and -0 are ignored when option -r is given\n" );
+        set_output( TEXT_OUTPUT );
+    }
 }
 
 int main( int argc, char**argv )
@@ -180,8 +531,28 @@ int main( int argc, char**argv )
     }
 #endif
 
-    map_t *map = collect_same_size_files( &args );
-    process_duplicates( map, &args );
-    free_collected_data( map );
+    if ( NULL != args.replay ) {    // no search, just the planned removals
+        plan_t *plan = read_plan( args.replay );
+        action_t action = REMOVE_ACTION;
+        if ( NULL != args.action ) {
+            parse_action( args.action, &action );
+        }
+        start_phase( "remove" );
+        execute_plan( plan, action, args.n_threads, args.confirm );
+        free_plan( plan );
+        free_target_n_paths( &args );
+        write_stats( info_output() );
+        write_trace( );
+        return 0;
+    }
+    collection_t *files = collect_same_size_files( &args );
+    if ( NULL != args.index ) {
+        write_search_index( files, &args );
+    } else {
+        process_duplicates( files, &args );
+    }
+    free_collected_data( files );
     free_target_n_paths( &args );
+    write_stats( info_output() );
+    write_trace( );
 }
@@ -7,19 +7,46 @@
 
 #include <stdbool.h>
 #include "comp.h"
+#include "output.h"
+#include "stats.h"
+#include "trace.h"
 
 void help( void )
 {
-    printf( "fmis -h -nz <target-path> [[-nz] <path>]*\n\n" );
+    printf( "fmis -h -j=<n> -o=<format> -s=<format> -T=<file> -0bmnsuUz <target-path>\n" );
+    printf( "     [[-nz] <path>]*\n\n" );
     printf( "look for a target file or for files in the target directory whose\n" );
     printf( "content cannot be found in any following path directories or their\n" );
     printf( "sub-directories, regardless their actual file names.\n\n" );
     printf( "Options:\n" );
     printf( "   -h          print this help message and exit.\n" );
+    printf( "   -j=<n>      use n threads to walk directories. By default, one\n" );
+    printf( "               thread per processor is used.\n" );
+    printf( "   -o=<format> write results as text (default), json (one JSON object\n" );
+    printf( "               per line) or nul (NUL separated fields). Other messages\n" );
+    printf( "               are then written to the standard error.\n" );
+    printf( "   -0          same as -o=nul.\n" );
+    printf( "   -b          verify byte to byte that target files are identical to\n" );
+    printf( "               the files found with the same content digest.\n" );
+    printf( "   -m          map large files in memory to compare them, instead of\n" );
+    printf( "               reading them.\n" );
     printf( "   -n          do not enter subdirectories. This option applies only\n" );
     printf( "               to the following path and may be repeated before each\n" );
     printf( "               directory path to search\n" );
     printf( "   -N          same as -n but it applies to all following paths\n" );
+    printf( "   -s          write run statistics at the end: wall and CPU time of\n" );
+    printf( "               each phase, counts of directories, entries, stat calls\n" );
+    printf( "               and files opened, bytes read per stage, size groups by\n" );
+    printf( "               number of files and peak memory.\n" );
+    printf( "   -s=<format> same as -s, written as text (default) or json (a single\n" );
+    printf( "               JSON object).\n" );
+    printf( "   -T=<file>   write a trace of the work done by each thread to file,\n" );
+    printf( "               in the Chrome trace event format: directories opened\n" );
+    printf( "               and read, batches of stat calls, file reads and byte\n" );
+    printf( "               comparisons.\n" );
+    printf( "   -u          drop file contents from the page cache once read.\n" );
+    printf( "   -U          read file contents without going through the page\n" );
+    printf( "               cache (O_DIRECT), if the file system allows it.\n" );
     printf( "   -z          show empty files while traversing directories. By\n" );
     printf( "               defaut ignore empty files. This option applies only\n" );
     printf( "               to the following path and may be repeated before each\n" );
@@ -29,14 +56,35 @@ void help( void )
     printf( "The <target-path> can be a single file path or a directory of files to\n" );
     printf( "look for in the following paths. The following paths are the pathnames\n" );
     printf( "of the directories to scan for identical files. If no path are given\n" );
-    printf( "after the mandatory <target-path>, the current directory is used instead.\n\n" );
+    printf( "after the mandatory <target-path>, the current directory is used instead.\n" );
+    printf( "A path may also be an index file written by fdup -i, in which only\n" );
+    printf( "the files with the size of some target are looked up, by their digest,\n" );
+    printf( "without reading them or walking the directories indexed.\n\n" );
+    printf( "Only the files with the same size as some target file are read, each\n" );
+    printf( "at most once, to find target contents by their digest.\n\n" );
 }
 
 void get_args( int argc, char **argv, args_t *args )
 {
     args->paths = NULL;
     args->target = NULL;
+    args->n_threads = default_threads( );
+    args->io_depth = DEFAULT_IO_DEPTH;
+    args->cache = NULL;
+    args->keep = NULL;
+    args->plan = NULL;
+    args->replay = NULL;
+    args->action = NULL;
+    args->index = NULL;
+    args->dirs = false;
+    args->reset_cache = false;
+    args->compact_cache = false;
     args->compare = true;
+    args->lockstep = false;
+    args->mapped = false;
+    args->nocache = false;
+    args->direct = false;
+    args->verify = false;
     args->remove = false;
     args->confirm = false;
 
@@ -56,6 +104,56 @@ void get_args( int argc, char **argv, args_t *args )
                 case 'h': case 'H':
                     help();
                     exit(0);
+                case 'j':
+                    if ( '=' != arg[j+1] ) {
+                        error( "-j requires '=' before the number of threads" );
+                    }
+                    args->n_threads = get_count_value( 'j', &arg[j+2] );
+                    j += 1 + strlen(&arg[j+2]);
+                    break;
+                case 'o':
+                    if ( '=' != arg[j+1] ) {
+                        error( "-o requires '=' before the output format" );
+                    }
+                    if ( ! set_output_format( &arg[j+2] ) ) {
+                        error( "unknown output format" );
+                    }
+                    j += 1 + strlen(&arg[j+2]);
+                    break;
+                case '0':
+                    set_output( NUL_OUTPUT );
+                    break;
+                case 'b':
+                    args->verify = true;
+                    break;
+                case 'm':
+                    args->mapped = true;
+                    break;
+                case 's':
+                    if ( '=' != arg[j+1] ) {
+                        set_stats_format( "text" );
+                        break;
+                    }
+                    if ( ! set_stats_format( &arg[j+2] ) ) {
+                        error( "unknown stats format" );
+                    }
+                    j += 1 + strlen(&arg[j+2]);
+                    break;
+                case 'T':
+                    if ( '=' != arg[j+1] || '\0' == arg[j+2] ) {
+                        error( "-T requires '=' before the trace file path" );
+                    }
+                    if ( ! set_trace_file( &arg[j+2] ) ) {
+                        error( "unable to create the trace file" );
+                    }
+                    j += 1 + strlen(&arg[j+2]);
+                    break;
+                case 'u':
+                    args->nocache = true;
+                    break;
+                case 'U':
+                    args->direct = true;
+                    break;
                 case 'N':
                     nosub = nosub_default = true;
                     break;
@@ -100,6 +198,11 @@ void get_args( int argc, char **argv, args_t *args )
         set_path( args, 0, getcwd( NULL, 4096 ), nosub, zero );
         set_path( args, 1, NULL, false, false );
     }
+    if ( args->mapped && ( args->nocache || args->direct ) ) {
+        fprintf( info_output(),
+                 "WARNING: option -m is ignored when option -u or -U is given\n" );
+        args->mapped = false;
+    }
 }
 
 int main( int argc, char**argv )
@@ -118,8 +221,10 @@ int main( int argc, char**argv )
     }
 #endif
 
-    map_t *map = collect_same_size_files( &args );
-    search_targets( map, &args );
-    free_collected_data( map );
+    collection_t *files = collect_same_size_files( &args );
+    search_targets( files, &args );
+    free_collected_data( files );
     free_target_n_paths( &args );
+    write_stats( info_output() );
+    write_trace( );
 }
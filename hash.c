@@ -0,0 +1,378 @@
+
+#include <stdint.h>
+#include <string.h>
+
+#include "hash.h"
+#include "simd.h"
+
+/*
+    Portable BLAKE3, following the reference implementation: input is split
+    in 1 KB chunks, each chunk is compressed block by block into a chaining
+    value, and chaining values are merged in a binary tree as chunks
+    complete. The stack holds the chaining values of the incomplete subtrees.
+
+    Complete chunks that are not the last one are compressed many at once
+    with the SIMD kernels of the current set, one chunk per vector lane
+    (see hash_lanes.h).
+*/
+
+#define CHUNK_START         (1 << 0)
+#define CHUNK_END           (1 << 1)
+#define PARENT              (1 << 2)
+#define ROOT                (1 << 3)
+
+static const uint32_t IV[8] = {
+    0x6A09E667, 0xBB67AE85, 0x3C6EF372, 0xA54FF53A,
+    0x510E527F, 0x9B05688C, 0x1F83D9AB, 0x5BE0CD19
+};
+
+static const uint8_t MSG_SCHEDULE[7][16] = {
+    { 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15 },
+    { 2, 6, 3, 10, 7, 0, 4, 13, 1, 11, 12, 5, 9, 14, 15, 8 },
+    { 3, 4, 10, 12, 13, 2, 7, 14, 6, 5, 9, 0, 11, 15, 8, 1 },
+    { 10, 7, 12, 9, 14, 3, 13, 15, 4, 0, 11, 2, 5, 8, 1, 6 },
+    { 12, 13, 9, 11, 15, 10, 14, 8, 7, 2, 5, 3, 0, 1, 6, 4 },
+    { 9, 14, 11, 5, 8, 12, 15, 1, 13, 3, 0, 10, 2, 6, 4, 7 },
+    { 11, 15, 5, 0, 1, 9, 8, 6, 14, 10, 2, 12, 3, 4, 7, 13 },
+};
+
+static inline uint32_t rotr( uint32_t w, int c )
+{
+    return ( w >> c ) | ( w << ( 32 - c ) );
+}
+
+static inline uint32_t load32( const uint8_t *p )
+{
+    return (uint32_t)p[0] | ((uint32_t)p[1] << 8) |
+           ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static inline void store32( uint8_t *p, uint32_t w )
+{
+    p[0] = (uint8_t)w;
+    p[1] = (uint8_t)(w >> 8);
+    p[2] = (uint8_t)(w >> 16);
+    p[3] = (uint8_t)(w >> 24);
+}
+
+static inline void g( uint32_t *s, int a, int b, int c, int d,
+                      uint32_t x, uint32_t y )
+{
+    s[a] = s[a] + s[b] + x;
+    s[d] = rotr( s[d] ^ s[a], 16 );
+    s[c] = s[c] + s[d];
+    s[b] = rotr( s[b] ^ s[c], 12 );
+    s[a] = s[a] + s[b] + y;
+    s[d] = rotr( s[d] ^ s[a], 8 );
+    s[c] = s[c] + s[d];
+    s[b] = rotr( s[b] ^ s[c], 7 );
+}
+
+// compress one block in place: cv is updated with the new chaining value
+static void compress( uint32_t cv[8], const uint8_t block[HASH_BLOCK_LEN],
+                      uint8_t block_len, uint64_t counter, uint8_t flags )
+{
+    uint32_t m[16];
+    for ( int i = 0; i < 16; ++i ) {
+        m[i] = load32( block + 4 * i );
+    }
+    uint32_t s[16] = {
+        cv[0], cv[1], cv[2], cv[3], cv[4], cv[5], cv[6], cv[7],
+        IV[0], IV[1], IV[2], IV[3],
+        (uint32_t)counter, (uint32_t)(counter >> 32), block_len, flags
+    };
+#pragma GCC unroll 7    // so that message words are indexed by constants
+    for ( int r = 0; r < 7; ++r ) {
+        const uint8_t *sc = MSG_SCHEDULE[r];
+        g( s, 0, 4, 8, 12, m[sc[0]], m[sc[1]] );
+        g( s, 1, 5, 9, 13, m[sc[2]], m[sc[3]] );
+        g( s, 2, 6, 10, 14, m[sc[4]], m[sc[5]] );
+        g( s, 3, 7, 11, 15, m[sc[6]], m[sc[7]] );
+        g( s, 0, 5, 10, 15, m[sc[8]], m[sc[9]] );
+        g( s, 1, 6, 11, 12, m[sc[10]], m[sc[11]] );
+        g( s, 2, 7, 8, 13, m[sc[12]], m[sc[13]] );
+        g( s, 3, 4, 9, 14, m[sc[14]], m[sc[15]] );
+    }
+    for ( int i = 0; i < 8; ++i ) {
+        cv[i] = s[i] ^ s[i + 8];
+    }
+}
+
+// chaining value of the complete chunk at input, which is not the root
+static void portable_hash_chunks( const uint8_t *input, uint64_t counter,
+                                  uint32_t cvs[][8] )
+{
+    memcpy( cvs[0], IV, sizeof(IV) );
+    for ( int b = 0; b < HASH_CHUNK_LEN / HASH_BLOCK_LEN; ++b ) {
+        uint8_t flags = ( 0 == b ) ? CHUNK_START :
+                ( HASH_CHUNK_LEN / HASH_BLOCK_LEN - 1 == b ) ? CHUNK_END : 0;
+        compress( cvs[0], input + b * HASH_BLOCK_LEN, HASH_BLOCK_LEN,
+                  counter, flags );
+    }
+}
+
+static void parent_cv( uint32_t out[8], const uint32_t left[8],
+                       const uint32_t right[8], uint8_t flags )
+{
+    uint8_t block[HASH_BLOCK_LEN];
+    for ( int i = 0; i < 8; ++i ) {
+        store32( block + 4 * i, left[i] );
+        store32( block + 32 + 4 * i, right[i] );
+    }
+    memcpy( out, IV, sizeof(IV) );
+    compress( out, block, HASH_BLOCK_LEN, 0, PARENT | flags );
+}
+
+// chaining value of one parent, not the root, of 2 children
+static void portable_hash_parents( const uint32_t children[][8],
+                                   uint32_t cvs[][8] )
+{
+    parent_cv( cvs[0], children[0], children[1], 0 );
+}
+
+typedef struct {
+    size_t  lanes;
+    void    (*hash_chunks)( const uint8_t *input, uint64_t counter,
+                            uint32_t cvs[][8] );
+    void    (*hash_parents)( const uint32_t children[][8], uint32_t cvs[][8] );
+} lane_kernel_t;
+
+#ifdef X86_KERNELS
+
+#pragma GCC push_options
+#pragma GCC target( "sse2" )
+#define LANES           4
+#define VEC_T           sse2_vec_t
+#define LANES_FN( f )   sse2_##f
+typedef uint32_t sse2_vec_t __attribute__(( vector_size( 4 * LANES ) ));
+#include "hash_lanes.h"
+#undef LANES
+#undef VEC_T
+#undef LANES_FN
+#pragma GCC pop_options
+
+#pragma GCC push_options
+#pragma GCC target( "avx2" )
+#define BYTE_SHUFFLE
+#define LANES           8
+#define VEC_T           avx2_vec_t
+#define LANES_FN( f )   avx2_##f
+typedef uint32_t avx2_vec_t __attribute__(( vector_size( 4 * LANES ) ));
+#include "hash_lanes.h"
+#undef BYTE_SHUFFLE
+#undef LANES
+#undef VEC_T
+#undef LANES_FN
+#pragma GCC pop_options
+
+#pragma GCC push_options
+#pragma GCC target( "avx512f" )
+#define NATIVE_ROTATE
+#define LANES           16
+#define VEC_T           avx512_vec_t
+#define LANES_FN( f )   avx512_##f
+typedef uint32_t avx512_vec_t __attribute__(( vector_size( 4 * LANES ) ));
+#include "hash_lanes.h"
+#undef NATIVE_ROTATE
+#undef LANES
+#undef VEC_T
+#undef LANES_FN
+#pragma GCC pop_options
+
+static const lane_kernel_t LANE_KERNELS[N_KERNELS] = {
+    { 1, portable_hash_chunks, portable_hash_parents },
+    { 4, sse2_hash_chunks, sse2_hash_parents },
+    { 8, avx2_hash_chunks, avx2_hash_parents },
+    { 16, avx512_hash_chunks, avx512_hash_parents }
+};
+
+#else
+
+static const lane_kernel_t LANE_KERNELS[N_KERNELS] = {
+    { 1, portable_hash_chunks, portable_hash_parents },
+    { 1, portable_hash_chunks, portable_hash_parents },
+    { 1, portable_hash_chunks, portable_hash_parents },
+    { 1, portable_hash_chunks, portable_hash_parents }
+};
+
+#endif
+
+static void chunk_init( chunk_state_t *cs, uint64_t counter )
+{
+    memcpy( cs->cv, IV, sizeof(IV) );
+    cs->chunk_counter = counter;
+    memset( cs->block, 0, HASH_BLOCK_LEN );
+    cs->block_len = 0;
+    cs->blocks_compressed = 0;
+}
+
+static inline size_t chunk_len( const chunk_state_t *cs )
+{
+    return HASH_BLOCK_LEN * (size_t)cs->blocks_compressed + cs->block_len;
+}
+
+static inline uint8_t chunk_start_flag( const chunk_state_t *cs )
+{
+    return ( 0 == cs->blocks_compressed ) ? CHUNK_START : 0;
+}
+
+static void chunk_update( chunk_state_t *cs, const uint8_t *data, size_t len )
+{
+    while ( len > 0 ) {
+        // the last block is kept until more data comes: it may be final
+        if ( HASH_BLOCK_LEN == cs->block_len ) {
+            compress( cs->cv, cs->block, HASH_BLOCK_LEN,
+                      cs->chunk_counter, chunk_start_flag( cs ) );
+            ++cs->blocks_compressed;
+            memset( cs->block, 0, HASH_BLOCK_LEN );
+            cs->block_len = 0;
+        }
+        size_t take = HASH_BLOCK_LEN - cs->block_len;
+        if ( take > len ) {
+            take = len;
+        }
+        memcpy( cs->block + cs->block_len, data, take );
+        cs->block_len += (uint8_t)take;
+        data += take;
+        len -= take;
+    }
+}
+
+// chaining value of a complete chunk (never called for the root chunk)
+static void chunk_cv( const chunk_state_t *cs, uint32_t out[8] )
+{
+    memcpy( out, cs->cv, sizeof(cs->cv) );
+    compress( out, cs->block, cs->block_len, cs->chunk_counter,
+              chunk_start_flag( cs ) | CHUNK_END );
+}
+
+static void push_chunk_cv( hash_state_t *hs, uint32_t cv[8],
+                           uint64_t total_chunks )
+{
+    // merge completed subtrees: as many as trailing 0 bits in total_chunks
+    while ( 0 == ( total_chunks & 1 ) ) {
+        --hs->cv_stack_len;
+        parent_cv( cv, hs->cv_stack[hs->cv_stack_len], cv, 0 );
+        total_chunks >>= 1;
+    }
+    memcpy( hs->cv_stack[hs->cv_stack_len], cv, 8 * sizeof(uint32_t) );
+    ++hs->cv_stack_len;
+}
+
+#define MAX_BATCH       64      // chunks hashed at once into a subtree
+
+// compress the n chunks at input into their chaining values, with the
+// kernels of the current set, then of smaller sets for the chunks left
+static void chunk_cvs( const uint8_t *input, uint64_t counter, size_t n,
+                       uint32_t cvs[][8] )
+{
+    size_t i = 0;
+    for ( int set = current_kernels( ); set >= PORTABLE_KERNELS; --set ) {
+        const lane_kernel_t *kernel = &LANE_KERNELS[set];
+        for ( ; n - i >= kernel->lanes; i += kernel->lanes ) {
+            kernel->hash_chunks( input + i * HASH_CHUNK_LEN, counter + i,
+                                 &cvs[i] );
+        }
+    }
+}
+
+// replace the 2 * n chaining values in cvs by the n values of their parents
+static void parent_cvs( uint32_t cvs[][8], size_t n )
+{
+    size_t i = 0;
+    for ( int set = current_kernels( ); set >= PORTABLE_KERNELS; --set ) {
+        const lane_kernel_t *kernel = &LANE_KERNELS[set];
+        for ( ; n - i >= kernel->lanes; i += kernel->lanes ) {
+            // parents overwrite children already read
+            kernel->hash_parents( (const uint32_t (*)[8])&cvs[2 * i], &cvs[i] );
+        }
+    }
+}
+
+// Hash the n complete chunks at input, none of which is the root, starting
+// with a fresh chunk state. Chunks are taken by batches aligned on their
+// size, a power of 2, so that each batch is a complete subtree: its chunks,
+// then each level of its parents, are compressed as many at once as the
+// kernels have lanes, and only the root of the subtree is pushed.
+static void hash_chunks( hash_state_t *hs, const uint8_t *input, size_t n )
+{
+    uint64_t counter = hs->chunk.chunk_counter;
+    uint32_t cvs[MAX_BATCH][8];
+    while ( n > 0 ) {
+        size_t batch = MAX_BATCH;
+        while ( batch > n || 0 != counter % batch ) {
+            batch /= 2;
+        }
+        chunk_cvs( input, counter, batch, cvs );
+        int level = 0;
+        for ( size_t width = batch / 2; width > 0; width /= 2, ++level ) {
+            parent_cvs( cvs, width );
+        }
+        push_chunk_cv( hs, cvs[0], ( counter + batch ) >> level );
+        counter += batch;
+        input += batch * HASH_CHUNK_LEN;
+        n -= batch;
+    }
+    chunk_init( &hs->chunk, counter );
+}
+
+extern void hash_init( hash_state_t *hs )
+{
+    chunk_init( &hs->chunk, 0 );
+    hs->cv_stack_len = 0;
+}
+
+extern void hash_update( hash_state_t *hs, const void *data, size_t len )
+{
+    const uint8_t *input = data;
+    while ( len > 0 ) {
+        // a complete chunk is kept until more data comes: it may be the root
+        if ( HASH_CHUNK_LEN == chunk_len( &hs->chunk ) ) {
+            uint32_t cv[8];
+            chunk_cv( &hs->chunk, cv );
+            uint64_t total_chunks = hs->chunk.chunk_counter + 1;
+            push_chunk_cv( hs, cv, total_chunks );
+            chunk_init( &hs->chunk, total_chunks );
+        }
+        if ( 0 == chunk_len( &hs->chunk ) && len > HASH_CHUNK_LEN ) {
+            size_t n = ( len - 1 ) / HASH_CHUNK_LEN;    // not the last one
+            hash_chunks( hs, input, n );
+            input += n * HASH_CHUNK_LEN;
+            len -= n * HASH_CHUNK_LEN;
+        }
+        size_t take = HASH_CHUNK_LEN - chunk_len( &hs->chunk );
+        if ( take > len ) {
+            take = len;
+        }
+        chunk_update( &hs->chunk, input, take );
+        input += take;
+        len -= take;
+    }
+}
+
+extern void hash_final( hash_state_t *hs, digest_t *digest )
+{
+    const chunk_state_t *cs = &hs->chunk;
+    uint32_t cv[8];
+    uint8_t block[HASH_BLOCK_LEN];
+    uint8_t block_len, flags;
+
+    // find the root node: either the single chunk or the last parent node
+    if ( 0 == hs->cv_stack_len ) {
+        memcpy( cv, cs->cv, sizeof(cv) );
+        memcpy( block, cs->block, HASH_BLOCK_LEN );
+        block_len = cs->block_len;
+        flags = chunk_start_flag( cs ) | CHUNK_END;
+        compress( cv, block, block_len, cs->chunk_counter, flags | ROOT );
+    } else {
+        uint32_t right[8];
+        chunk_cv( cs, right );
+        for ( int i = hs->cv_stack_len - 1; i > 0; --i ) {
+            parent_cv( right, hs->cv_stack[i], right, 0 );
+        }
+        parent_cv( cv, hs->cv_stack[0], right, ROOT );
+    }
+    for ( int i = 0; i < 8; ++i ) {
+        store32( digest->bytes + 4 * i, cv[i] );
+    }
+}
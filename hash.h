@@ -0,0 +1,53 @@
+#ifndef __HASH_H__
+#define __HASH_H__
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <string.h>
+
+/*
+    Content digest: BLAKE3 with the default 256-bit output. It is fast
+    enough to hash every candidate file once and strong enough to assume
+    that files with the same digest have the same content.
+*/
+
+#define DIGEST_SIZE         32
+
+#define HASH_BLOCK_LEN      64
+#define HASH_CHUNK_LEN      1024
+#define HASH_MAX_DEPTH      54      // enough for 2^64 bytes
+
+typedef struct {
+    uint8_t     bytes[DIGEST_SIZE];
+} digest_t;
+
+typedef struct {
+    uint32_t    cv[8];
+    uint64_t    chunk_counter;
+    uint8_t     block[HASH_BLOCK_LEN];
+    uint8_t     block_len;
+    uint8_t     blocks_compressed;
+} chunk_state_t;
+
+typedef struct {
+    chunk_state_t   chunk;
+    uint32_t        cv_stack[HASH_MAX_DEPTH][8];
+    uint8_t         cv_stack_len;
+} hash_state_t;
+
+extern void hash_init( hash_state_t *hs );
+extern void hash_update( hash_state_t *hs, const void *data, size_t len );
+extern void hash_final( hash_state_t *hs, digest_t *digest );
+
+static inline int digest_compare( const digest_t *d1, const digest_t *d2 )
+{
+    return memcmp( d1->bytes, d2->bytes, DIGEST_SIZE );
+}
+
+static inline bool same_digest( const digest_t *d1, const digest_t *d2 )
+{
+    return 0 == digest_compare( d1, d2 );
+}
+
+#endif /* __HASH_H__ */
@@ -0,0 +1,155 @@
+/*
+    BLAKE3 compression of LANES inputs at once, one input per vector lane:
+    the 16 state words of all inputs are held in 16 vectors, so that each
+    step of the portable compression works on all inputs. Inputs are either
+    complete chunks, or the pairs of child chaining values of parent nodes.
+
+    Words are loaded as they are in memory, in little endian order on x86.
+    Included by hash.c once per instruction set, inside a target region,
+    with LANES, VEC_T (a GCC vector of LANES uint32_t) and LANES_FN(name)
+    defined, and NATIVE_ROTATE if words can be rotated in one instruction,
+    or else BYTE_SHUFFLE if bytes can be shuffled in one instruction.
+*/
+
+typedef uint16_t LANES_FN( half_vec_t )
+                    __attribute__(( vector_size( sizeof(VEC_T) ) ));
+typedef uint8_t LANES_FN( byte_vec_t )
+                    __attribute__(( vector_size( sizeof(VEC_T) ) ));
+
+// without rotate instruction, rotations by 16 and 8 bits move whole half
+// words or bytes
+static inline __attribute__(( always_inline ))
+VEC_T LANES_FN( rotr )( VEC_T w, int c )
+{
+#ifndef NATIVE_ROTATE
+    if ( 16 == c ) {
+        LANES_FN( half_vec_t ) mask;
+        for ( int i = 0; i < LANES * 2; ++i ) {
+            mask[i] = (uint16_t)( i ^ 1 );
+        }
+        return (VEC_T)__builtin_shuffle( (LANES_FN( half_vec_t ))w, mask );
+    }
+#ifdef BYTE_SHUFFLE
+    if ( 8 == c ) {
+        LANES_FN( byte_vec_t ) mask;
+        for ( int i = 0; i < LANES * 4; ++i ) {
+            mask[i] = (uint8_t)( ( i & ~3 ) | ( ( i + 1 ) & 3 ) );
+        }
+        return (VEC_T)__builtin_shuffle( (LANES_FN( byte_vec_t ))w, mask );
+    }
+#endif
+#endif
+    return ( w >> c ) | ( w << ( 32 - c ) );
+}
+
+static inline __attribute__(( always_inline ))
+void LANES_FN( g )( VEC_T *s, int a, int b, int c, int d, VEC_T x, VEC_T y )
+{
+    s[a] = s[a] + s[b] + x;
+    s[d] = LANES_FN( rotr )( s[d] ^ s[a], 16 );
+    s[c] = s[c] + s[d];
+    s[b] = LANES_FN( rotr )( s[b] ^ s[c], 12 );
+    s[a] = s[a] + s[b] + y;
+    s[d] = LANES_FN( rotr )( s[d] ^ s[a], 8 );
+    s[c] = s[c] + s[d];
+    s[b] = LANES_FN( rotr )( s[b] ^ s[c], 7 );
+}
+
+// Transpose the LANES x LANES words in rows: at each level, the blocks of
+// w x w words off the diagonal are swapped in each pair of rows i and i + w.
+static inline __attribute__(( always_inline ))
+void LANES_FN( transpose )( VEC_T *rows )
+{
+    for ( int w = 1; w < LANES; w *= 2 ) {
+        VEC_T low_mask, high_mask;
+        for ( int p = 0; p < LANES; ++p ) {
+            low_mask[p] = ( p & w ) ? LANES + p - w : p;
+            high_mask[p] = ( p & w ) ? LANES + p : p + w;
+        }
+        for ( int i = 0; i < LANES; ++i ) {
+            if ( 0 == ( i & w ) ) {
+                VEC_T a = rows[i], b = rows[i + w];
+                rows[i] = __builtin_shuffle( a, b, low_mask );
+                rows[i + w] = __builtin_shuffle( a, b, high_mask );
+            }
+        }
+    }
+}
+
+// Compress the n_blocks blocks of LANES inputs, stride bytes apart, into
+// their chaining values. Counters of lanes are counter + lane if counted,
+// else counter, and the first and last blocks get extra flags.
+static inline __attribute__(( always_inline ))
+void LANES_FN( compress_lanes )( const uint8_t *input, size_t stride,
+                                 int n_blocks, uint64_t counter, bool counted,
+                                 uint32_t flags, uint32_t first_flags,
+                                 uint32_t last_flags, uint32_t cvs[][8] )
+{
+    VEC_T h[8], counter_low, counter_high;
+    for ( int i = 0; i < 8; ++i ) {
+        h[i] = (VEC_T){ 0 } + IV[i];
+    }
+    for ( int l = 0; l < LANES; ++l ) {
+        uint64_t c = ( counted ) ? counter + (uint64_t)l : counter;
+        counter_low[l] = (uint32_t)c;
+        counter_high[l] = (uint32_t)( c >> 32 );
+    }
+    for ( int b = 0; b < n_blocks; ++b ) {
+        VEC_T m[16];    // word i of the block of each input in m[i]
+        for ( int i = 0; i < 16; i += LANES ) {
+            for ( int l = 0; l < LANES; ++l ) {
+                memcpy( &m[i + l], input + l * stride + b * HASH_BLOCK_LEN + 4 * i,
+                        sizeof(VEC_T) );
+            }
+            LANES_FN( transpose )( &m[i] );
+        }
+        uint32_t block_flags = flags | ( ( 0 == b ) ? first_flags : 0 ) |
+                               ( ( n_blocks - 1 == b ) ? last_flags : 0 );
+        VEC_T s[16] = {
+            h[0], h[1], h[2], h[3], h[4], h[5], h[6], h[7],
+            (VEC_T){ 0 } + IV[0], (VEC_T){ 0 } + IV[1],
+            (VEC_T){ 0 } + IV[2], (VEC_T){ 0 } + IV[3],
+            counter_low, counter_high,
+            (VEC_T){ 0 } + HASH_BLOCK_LEN, (VEC_T){ 0 } + block_flags
+        };
+#pragma GCC unroll 7
+        for ( int r = 0; r < 7; ++r ) {
+            const uint8_t *sc = MSG_SCHEDULE[r];
+            LANES_FN( g )( s, 0, 4, 8, 12, m[sc[0]], m[sc[1]] );
+            LANES_FN( g )( s, 1, 5, 9, 13, m[sc[2]], m[sc[3]] );
+            LANES_FN( g )( s, 2, 6, 10, 14, m[sc[4]], m[sc[5]] );
+            LANES_FN( g )( s, 3, 7, 11, 15, m[sc[6]], m[sc[7]] );
+            LANES_FN( g )( s, 0, 5, 10, 15, m[sc[8]], m[sc[9]] );
+            LANES_FN( g )( s, 1, 6, 11, 12, m[sc[10]], m[sc[11]] );
+            LANES_FN( g )( s, 2, 7, 8, 13, m[sc[12]], m[sc[13]] );
+            LANES_FN( g )( s, 3, 4, 9, 14, m[sc[14]], m[sc[15]] );
+        }
+        for ( int i = 0; i < 8; ++i ) {
+            h[i] = s[i] ^ s[i + 8];
+        }
+    }
+    for ( int l = 0; l < LANES; ++l ) {
+        for ( int i = 0; i < 8; ++i ) {
+            cvs[l][i] = h[i][l];
+        }
+    }
+}
+
+// chaining values of the LANES complete chunks at input, which are not the
+// root, with counters from counter
+static void LANES_FN( hash_chunks )( const uint8_t *input, uint64_t counter,
+                                     uint32_t cvs[][8] )
+{
+    LANES_FN( compress_lanes )( input, HASH_CHUNK_LEN,
+                                HASH_CHUNK_LEN / HASH_BLOCK_LEN, counter, true,
+                                0, CHUNK_START, CHUNK_END, cvs );
+}
+
+// chaining values of the LANES parents, not the root, of the 2 * LANES
+// children in order
+static void LANES_FN( hash_parents )( const uint32_t children[][8],
+                                      uint32_t cvs[][8] )
+{
+    LANES_FN( compress_lanes )( (const uint8_t *)children, HASH_BLOCK_LEN, 1,
+                                0, false, PARENT, 0, 0, cvs );
+}
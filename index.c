@@ -0,0 +1,242 @@
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include "comp.h"
+#include "index.h"
+#include "output.h"
+
+#define INDEX_BYTE_ORDER    0x01020304      // as read on the same machine
+
+typedef struct {
+    char            magic[8];
+    uint32_t        version;
+    uint32_t        entry_size;
+    uint32_t        byte_order;
+    uint32_t        reserved;
+    uint64_t        n_entries;
+    uint64_t        paths_len;
+} index_header_t;
+
+struct _index {
+    void            *map;
+    size_t          map_len;
+    const index_entry_t *entries;
+    size_t          n_entries;
+    const char      *paths;
+    size_t          paths_len;
+};
+
+static void *malloc_or_exit( size_t size )
+{
+    void *d = malloc( size );
+    if ( NULL == d ) {
+        exit( NO_MEMORY_ERROR );
+    }
+    return d;
+}
+
+extern bool is_index_file( const char *path )
+{
+    int fd = open( path, O_RDONLY );
+    if ( -1 == fd ) {
+        return false;
+    }
+    struct stat stat_data;
+    char magic[8];
+    bool index = 0 == fstat( fd, &stat_data ) && S_ISREG( stat_data.st_mode ) &&
+                 sizeof(magic) == read( fd, magic, sizeof(magic) ) &&
+                 0 == memcmp( magic, INDEX_MAGIC, sizeof(magic) );
+    close( fd );
+    return index;
+}
+
+static void invalid_index( const char *path, const char *reason )
+{
+    fprintf( info_output(), "Error: index file %s %s - exiting\n",
+             path, reason );
+    exit( FILE_IO_ERROR );
+}
+
+extern index_t *open_index( const char *path )
+{
+    int fd = open( path, O_RDONLY );
+    struct stat stat_data;
+    if ( -1 == fd || 0 != fstat( fd, &stat_data ) ) {
+        invalid_index( path, "cannot be opened" );
+    }
+    size_t len = (size_t)stat_data.st_size;
+    if ( len < sizeof(index_header_t) ) {
+        invalid_index( path, "is truncated" );
+    }
+    void *map = mmap( NULL, len, PROT_READ, MAP_SHARED, fd, 0 );
+    close( fd );
+    if ( MAP_FAILED == map ) {
+        invalid_index( path, "cannot be mapped" );
+    }
+    const index_header_t *header = map;
+    if ( 0 != memcmp( header->magic, INDEX_MAGIC, sizeof(header->magic) ) ) {
+        invalid_index( path, "is not an index" );
+    }
+    if ( INDEX_BYTE_ORDER != header->byte_order ||
+         INDEX_VERSION != header->version ||
+         sizeof(index_entry_t) != header->entry_size ) {
+        invalid_index( path, "was written by another version or machine" );
+    }
+    size_t entries_len = sizeof(index_entry_t) * header->n_entries;
+    if ( header->n_entries > len / sizeof(index_entry_t) ||
+         header->paths_len > UINT32_MAX ||
+         sizeof(index_header_t) + entries_len + header->paths_len != len ||
+         ( 0 != header->paths_len && '\0' != ((const char *)map)[len - 1] ) ) {
+        invalid_index( path, "is corrupted" );
+    }
+    index_t *index = malloc_or_exit( sizeof(index_t) );
+    index->map = map;
+    index->map_len = len;
+    index->entries = (const index_entry_t *)( header + 1 );
+    index->n_entries = header->n_entries;
+    index->paths = (const char *)index->entries + entries_len;
+    index->paths_len = header->paths_len;
+    return index;
+}
+
+extern void close_index( index_t *index )
+{
+    munmap( index->map, index->map_len );
+    free( index );
+}
+
+extern const index_entry_t *index_entries( const index_t *index, size_t *n )
+{
+    *n = index->n_entries;
+    return index->entries;
+}
+
+extern const char *index_paths( const index_t *index, size_t *len )
+{
+    *len = index->paths_len;
+    return index->paths;
+}
+
+extern const index_entry_t *index_find_size( const index_t *index,
+                                             uint64_t size, size_t *n )
+{
+    size_t low = 0, high = index->n_entries;
+    while ( low < high ) {      // first entry with at least size
+        size_t mid = low + ( high - low ) / 2;
+        if ( index->entries[mid].size < size ) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    size_t end = low;
+    while ( end < index->n_entries && index->entries[end].size == size ) {
+        ++end;
+    }
+    *n = end - low;
+    return &index->entries[low];
+}
+
+// paths are in entry order, so path offsets increase with entries
+extern const index_entry_t *index_path_entry( const index_t *index,
+                                              uint64_t offset )
+{
+    size_t low = 0, high = index->n_entries;
+    while ( low < high ) {
+        size_t mid = low + ( high - low ) / 2;
+        if ( index->entries[mid].path < offset ) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    if ( low == index->n_entries || index->entries[low].path != offset ) {
+        return NULL;
+    }
+    return &index->entries[low];
+}
+
+static const char *sorted_paths;    // only while sorting entries
+
+static int compare_entries( const void *e1, const void *e2 )
+{
+    const index_entry_t *ie1 = e1, *ie2 = e2;
+    if ( ie1->size != ie2->size ) {
+        return ( ie1->size < ie2->size ) ? -1 : 1;
+    }
+    int res = digest_compare( &ie1->digest, &ie2->digest );
+    if ( 0 != res ) {
+        return res;
+    }
+    return strcmp( sorted_paths + ie1->path, sorted_paths + ie2->path );
+}
+
+extern bool write_index( const char *path, index_entry_t *entries, size_t n,
+                         const char *paths, size_t len )
+{
+    if ( len > UINT32_MAX ) {
+        errno = EFBIG;
+        return false;
+    }
+    sorted_paths = paths;
+    qsort( entries, n, sizeof(index_entry_t), compare_entries );
+
+    // paths are written again in entry order, at their new offsets
+    uint64_t *offsets = malloc_or_exit( sizeof(uint64_t) * ( n + 1 ) );
+    uint64_t offset = 0;
+    for ( size_t i = 0; i < n; ++i ) {
+        offsets[i] = entries[i].path;
+        entries[i].path = offset;
+        offset += strlen( paths + offsets[i] ) + 1;
+    }
+
+    char *tmp_path = malloc_or_exit( strlen( path ) + 5 );
+    strcpy( tmp_path, path );
+    strcat( tmp_path, ".tmp" );
+    FILE *f = fopen( tmp_path, "wb" );
+    if ( NULL == f ) {
+        free( tmp_path );
+        free( offsets );
+        return false;
+    }
+    index_header_t header;
+    memset( &header, 0, sizeof(header) );
+    memcpy( header.magic, INDEX_MAGIC, sizeof(header.magic) );
+    header.version = INDEX_VERSION;
+    header.entry_size = sizeof(index_entry_t);
+    header.byte_order = INDEX_BYTE_ORDER;
+    header.n_entries = n;
+    header.paths_len = offset;
+
+    bool done = 1 == fwrite( &header, sizeof(header), 1, f ) &&
+                n == fwrite( entries, sizeof(index_entry_t), n, f );
+    for ( size_t i = 0; i < n && done; ++i ) {
+        const char *p = paths + offsets[i];
+        done = 1 == fwrite( p, strlen( p ) + 1, 1, f );
+    }
+    done = done && 0 == fflush( f ) && 0 == fsync( fileno( f ) );
+    int saved_errno = errno;
+    if ( 0 != fclose( f ) && done ) {
+        done = false;
+        saved_errno = errno;
+    }
+    if ( done ) {   // atomically replace the previous index
+        done = 0 == rename( tmp_path, path );
+        saved_errno = errno;
+    }
+    if ( ! done ) {
+        unlink( tmp_path );
+    }
+    free( tmp_path );
+    free( offsets );
+    errno = saved_errno;
+    return done;
+}
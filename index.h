@@ -0,0 +1,64 @@
+#ifndef __INDEX_H__
+#define __INDEX_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "hash.h"
+#include "walk.h"
+
+/*
+    Content index of directory trees, for searching files that are not
+    always available, such as backup volumes, without walking and reading
+    them again. For each file, an index keeps its size, sample, digest,
+    device, inode and times, and its path.
+
+    An index file has a header, then its entries sorted by size, digest and
+    path, then the paths of all entries, each ending with '\0', in the same
+    order as the entries. It is mapped in memory and used as it is, without
+    parsing: files of a size are found by binary search. Integers are in the
+    byte order of the machine that wrote the index, and an index with another
+    byte order or version is rejected.
+*/
+
+#define INDEX_MAGIC     "FDUPINDX"
+#define INDEX_VERSION   1
+
+typedef struct {
+    uint64_t        size;
+    digest_t        digest;
+    uint64_t        sample;
+    uint64_t        dev, ino;
+    int64_t         mtime_ns, ctime_ns;
+    uint64_t        path;       // offset of the path in the index paths
+} index_entry_t;
+
+typedef struct _index index_t;
+
+// return true if path is a regular file starting like an index
+extern bool is_index_file( const char *path );
+
+// map the index file at path, exit if it is invalid
+extern index_t *open_index( const char *path );
+extern void close_index( index_t *index );
+
+extern const index_entry_t *index_entries( const index_t *index, size_t *n );
+
+// all paths, each ending with '\0', and their total length
+extern const char *index_paths( const index_t *index, size_t *len );
+
+// return the first entry with that size and the number of such entries
+extern const index_entry_t *index_find_size( const index_t *index,
+                                             uint64_t size, size_t *n );
+
+// return the entry whose path is at that offset in the paths, or NULL
+extern const index_entry_t *index_path_entry( const index_t *index,
+                                              uint64_t offset );
+
+// sort n entries and write them with their paths (len bytes, less than
+// 4 GB) to an index file at path, which is replaced atomically. Return
+// false in case of failure, with errno set.
+extern bool write_index( const char *path, index_entry_t *entries, size_t n,
+                         const char *paths, size_t len );
+
+#endif /* __INDEX_H__ */
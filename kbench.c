@@ -0,0 +1,150 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+
+#include <stdbool.h>
+#include "comp.h"
+#include "hash.h"
+#include "simd.h"
+
+/*
+    Microbenchmark of the compare and digest kernels: each set supported by
+    the processor is measured on data held in cache, then on buffers much
+    larger than caches, where throughput should be limited by memory
+    bandwidth. All sets must give the same results, or kbench fails.
+*/
+
+#define CACHED_LEN      ( 128 * 1024 )
+#define LARGE_LEN       ( 256 * 1024 * 1024 )
+#define MIN_SECONDS     0.25        // measured for at least that long
+
+void help( void )
+{
+    printf( "kbench -h\n\n" );
+    printf( "measure the throughput in GB/s of each version of the compare and\n" );
+    printf( "digest kernels supported by the processor, on data in cache and\n" );
+    printf( "on large buffers. Compare throughput counts the bytes of both\n" );
+    printf( "buffers compared.\n" );
+}
+
+static double now( void )
+{
+    struct timespec ts;
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+    return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+}
+
+static void *malloc_or_exit( size_t size )
+{
+    void *d = malloc( size );
+    if ( NULL == d ) {
+        exit( NO_MEMORY_ERROR );
+    }
+    return d;
+}
+
+// repeat until MIN_SECONDS elapsed and return GB/s for 2 * len bytes per
+// comparison
+static double bench_compare( const unsigned char *a, const unsigned char *b,
+                             size_t len )
+{
+    size_t rounds = 0;
+    double start = now( ), elapsed;
+    do {
+        if ( first_difference( a, b, len ) != len ) {
+            printf( "Error: %s compare kernel found a difference - exiting\n",
+                    kernels_name( current_kernels( ) ) );
+            exit( INTERNAL_ERROR );
+        }
+        ++rounds;
+        elapsed = now( ) - start;
+    } while ( elapsed < MIN_SECONDS );
+    return 2.0 * (double)len * (double)rounds / elapsed * 1e-9;
+}
+
+static double bench_digest( const unsigned char *data, size_t len,
+                            digest_t *digest )
+{
+    size_t rounds = 0;
+    double start = now( ), elapsed;
+    do {
+        hash_state_t state;
+        hash_init( &state );
+        hash_update( &state, data, len );
+        hash_final( &state, digest );
+        ++rounds;
+        elapsed = now( ) - start;
+    } while ( elapsed < MIN_SECONDS );
+    return (double)len * (double)rounds / elapsed * 1e-9;
+}
+
+// every difference must be found at its offset, whatever the alignment
+static void check_compare( unsigned char *a, const unsigned char *b )
+{
+    for ( size_t len = 0; len < 600; len += 7 ) {
+        for ( size_t diff = 0; diff < len; diff += 3 ) {
+            a[diff + 1] ^= 0x40;
+            size_t found = first_difference( a + 1, b + 1, len );
+            a[diff + 1] ^= 0x40;
+            if ( found != diff ) {
+                printf( "Error: %s compare kernel found %zu instead of %zu "
+                        "in %zu bytes - exiting\n",
+                        kernels_name( current_kernels( ) ), found, diff, len );
+                exit( INTERNAL_ERROR );
+            }
+        }
+    }
+}
+
+int main( int argc, char **argv )
+{
+    if ( argc > 1 ) {
+        help( );
+        exit( ( 0 == strcmp( argv[1], "-h" ) ) ? NO_ERROR : ARGUMENT_ERROR );
+    }
+    unsigned char *a = malloc_or_exit( LARGE_LEN );
+    unsigned char *b = malloc_or_exit( LARGE_LEN );
+    uint64_t x = 0x9e3779b97f4a7c15;
+    for ( size_t i = 0; i < LARGE_LEN; ++i ) {
+        x ^= x << 13;
+        x ^= x >> 7;
+        x ^= x << 17;
+        a[i] = (unsigned char)x;
+    }
+    memcpy( b, a, LARGE_LEN );
+
+    digest_t expected[2];
+    kernel_set_t best = current_kernels( );
+    printf( "%-10s %16s %16s %16s %16s\n", "kernels", "compare cached",
+            "compare large", "digest cached", "digest large" );
+    for ( int set = PORTABLE_KERNELS; set < N_KERNELS; ++set ) {
+        if ( ! use_kernels( (kernel_set_t)set ) ) {
+            printf( "%-10s %16s\n", kernels_name( (kernel_set_t)set ),
+                    "not supported" );
+            continue;
+        }
+        check_compare( a, b );
+        digest_t digests[2];
+        double compare_cached = bench_compare( a, b, CACHED_LEN );
+        double compare_large = bench_compare( a, b, LARGE_LEN );
+        double digest_cached = bench_digest( a, CACHED_LEN, &digests[0] );
+        double digest_large = bench_digest( a, LARGE_LEN, &digests[1] );
+        if ( PORTABLE_KERNELS == set ) {
+            memcpy( expected, digests, sizeof(expected) );
+        } else if ( ! same_digest( &digests[0], &expected[0] ) ||
+                    ! same_digest( &digests[1], &expected[1] ) ) {
+            printf( "Error: %s digest kernel gives another digest - exiting\n",
+                    kernels_name( (kernel_set_t)set ) );
+            exit( INTERNAL_ERROR );
+        }
+        printf( "%-10s %11.2f GB/s %11.2f GB/s %11.2f GB/s %11.2f GB/s%s\n",
+                kernels_name( (kernel_set_t)set ), compare_cached,
+                compare_large, digest_cached, digest_large,
+                ( best == (kernel_set_t)set ) ? "  (used)" : "" );
+    }
+    free( a );
+    free( b );
+    return 0;
+}
@@ -0,0 +1,197 @@
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <setjmp.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/mman.h>
+
+#include "comp.h"
+#include "mapped.h"
+#include "simd.h"
+#include "stats.h"
+
+#define MAP_WINDOW          ( 64 * 1024 * 1024 )    // mapped at once per file
+#define MAP_SLICE           ( 1024 * 1024 )         // processed at once
+#define MAP_READAHEAD       ( 8 * MAP_SLICE )       // requested ahead of cursor
+
+#define MIN_MAPPED_CHUNK    ( 4 * 1024 )            // first compare chunk
+
+// jump buffer set while the calling thread accesses mappings, else NULL
+static _Thread_local sigjmp_buf *fault_jump;
+static pthread_once_t handler_once = PTHREAD_ONCE_INIT;
+static uint64_t page_mask;
+
+static void sigbus_handler( int sig )
+{
+    if ( NULL != fault_jump ) {
+        siglongjmp( *fault_jump, 1 );
+    }
+    signal( sig, SIG_DFL );     // not caused by a mapping: default action
+    raise( sig );
+}
+
+static void install_handler( void )
+{
+    page_mask = ~(uint64_t)( sysconf( _SC_PAGESIZE ) - 1 );
+    struct sigaction action;
+    memset( &action, 0, sizeof(action) );
+    action.sa_handler = sigbus_handler;
+    sigemptyset( &action.sa_mask );
+    sigaction( SIGBUS, &action, NULL );
+}
+
+typedef struct {
+    int             fd;
+    uint64_t        start;      // file offset of the mapping, page aligned
+    size_t          len;
+    unsigned char   *base;      // NULL if nothing is mapped
+    uint64_t        released;   // file offset up to which pages are released
+} window_t;
+
+static void unmap_window( window_t *w )
+{
+    if ( NULL != w->base ) {
+        munmap( w->base, w->len );
+        w->base = NULL;
+    }
+}
+
+// return a pointer to n bytes at offset, mapping a new window if needed
+static const unsigned char *window_data( window_t *w, uint64_t offset,
+                                         size_t n, uint64_t end )
+{
+    if ( NULL == w->base || offset + n > w->start + w->len ) {
+        unmap_window( w );
+        w->start = offset & page_mask;
+        w->len = ( end - w->start > MAP_WINDOW ) ? MAP_WINDOW : end - w->start;
+        void *base = mmap( NULL, w->len, PROT_READ, MAP_SHARED,
+                           w->fd, (off_t)w->start );
+        if ( MAP_FAILED == base ) {
+            return NULL;
+        }
+        w->base = base;
+        w->released = w->start;
+        madvise( w->base, w->len, MADV_SEQUENTIAL );
+    }
+    // ask for the pages following this slice
+    uint64_t ahead = ( offset + n ) & page_mask;
+    uint64_t stop = w->start + w->len;
+    if ( ahead < stop ) {
+        size_t len = ( stop - ahead > MAP_READAHEAD ) ? MAP_READAHEAD : stop - ahead;
+        madvise( w->base + ( ahead - w->start ), len, MADV_WILLNEED );
+    }
+    return w->base + ( offset - w->start );
+}
+
+// release the pages that are entirely before offset
+static void window_release( window_t *w, uint64_t offset )
+{
+    uint64_t behind = offset & page_mask;
+    if ( behind > w->released ) {
+        madvise( w->base + ( w->released - w->start ),
+                 behind - w->released, MADV_DONTNEED );
+        w->released = behind;
+    }
+}
+
+static window_t *new_windows( int n, const int *fds )
+{
+    pthread_once( &handler_once, install_handler );
+    window_t *windows = malloc( sizeof(window_t) * n );
+    if ( NULL == windows ) {
+        exit( NO_MEMORY_ERROR );
+    }
+    for ( int i = 0; i < n; ++i ) {
+        windows[i].fd = fds[i];
+        windows[i].base = NULL;
+    }
+    return windows;
+}
+
+static void free_windows( int n, window_t *windows )
+{
+    for ( int i = 0; i < n; ++i ) {
+        unmap_window( &windows[i] );
+    }
+    free( windows );
+}
+
+// windows are allocated, since they are changed between sigsetjmp and a
+// possible siglongjmp
+extern bool mapped_compare( int fd1, int fd2, size_t size,
+                            size_t *nread, bool *same )
+{
+    int fds[2] = { fd1, fd2 };
+    window_t *w = new_windows( 2, fds );
+    sigjmp_buf jump;
+    if ( 0 != sigsetjmp( jump, 1 ) ) {      // file truncated
+        fault_jump = NULL;
+        free_windows( 2, w );
+        return false;
+    }
+    fault_jump = &jump;
+
+    bool done = true;
+    *same = true;
+    size_t chunk = MIN_MAPPED_CHUNK;
+    for ( uint64_t offset = 0; offset < size; ) {
+        size_t n = ( size - offset < chunk ) ? size - offset : chunk;
+        const unsigned char *d1 = window_data( &w[0], offset, n, size );
+        const unsigned char *d2 = window_data( &w[1], offset, n, size );
+        if ( NULL == d1 || NULL == d2 ) {
+            done = false;
+            break;
+        }
+        if ( NULL != nread ) {
+            *nread += 2 * n;
+        }
+        if ( ! same_bytes( d1, d2, n ) ) {
+            *same = false;
+            add_count( SHORT_CUT_COUNT, offset + n < size );
+            break;
+        }
+        offset += n;
+        window_release( &w[0], offset );
+        window_release( &w[1], offset );
+        chunk = ( 2 * chunk > MAP_SLICE ) ? MAP_SLICE : 2 * chunk;
+    }
+    fault_jump = NULL;
+    free_windows( 2, w );
+    return done;
+}
+
+extern mapped_result_t mapped_read( int fd, uint64_t start, uint64_t length,
+                                    read_block_t process, void *context,
+                                    size_t *nread )
+{
+    window_t *w = new_windows( 1, &fd );
+    sigjmp_buf jump;
+    if ( 0 != sigsetjmp( jump, 1 ) ) {      // file truncated
+        fault_jump = NULL;
+        free_windows( 1, w );
+        return MAPPED_TRUNCATED;
+    }
+    fault_jump = &jump;
+
+    mapped_result_t result = MAPPED_DONE;
+    uint64_t offset = start, end = start + length;
+    while ( offset < end ) {
+        size_t n = ( end - offset < MAP_SLICE ) ? end - offset : MAP_SLICE;
+        const unsigned char *data = window_data( w, offset, n, end );
+        if ( NULL == data ) {
+            result = MAPPED_FAILED;
+            break;
+        }
+        process( context, data, n );
+        *nread += n;
+        offset += n;
+        window_release( w, offset );
+    }
+    fault_jump = NULL;
+    free_windows( 1, w );
+    return result;
+}
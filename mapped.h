@@ -0,0 +1,43 @@
+#ifndef __MAPPED_H__
+#define __MAPPED_H__
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#include "reader.h"
+
+/*
+    Access to file contents through memory mappings, used for large files
+    to compare or hash them straight from the page cache, without copying
+    them into user buffers. Files are mapped by windows, with readahead
+    requested ahead of the cursor and pages released behind it.
+
+    A file truncated while it is mapped raises SIGBUS when a page beyond
+    its new end is accessed. The signal is caught and the functions return,
+    so that the caller can fall back to regular reads. A mapping may also
+    fail (e.g. ENOMEM, or a file system without mmap), which is not a
+    truncation: the caller then goes on with regular reads.
+*/
+
+#define MAPPED_MIN_SIZE     ( 1024 * 1024 )     // smaller files are just read
+
+// compare 2 files of size bytes. Return false if the comparison could not
+// be done, otherwise return true with the result in same.
+extern bool mapped_compare( int fd1, int fd2, size_t size,
+                            size_t *nread, bool *same );
+
+typedef enum {
+    MAPPED_DONE,        // all bytes delivered
+    MAPPED_TRUNCATED,   // blocks already delivered must be discarded
+    MAPPED_FAILED       // mmap failed, blocks delivered so far are valid
+} mapped_result_t;
+
+// deliver length bytes from start in fd to process, by blocks, and add the
+// number of bytes delivered to *nread. If mmap fails, the rest of the range
+// from start + the bytes delivered is left to regular reads.
+extern mapped_result_t mapped_read( int fd, uint64_t start, uint64_t length,
+                                    read_block_t process, void *context,
+                                    size_t *nread );
+
+#endif /* __MAPPED_H__ */
@@ -0,0 +1,233 @@
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "output.h"
+
+#define OUTPUT_BUFFER_SIZE  ( 1024 * 1024 )
+
+static output_format_t format = TEXT_OUTPUT;
+static char out_buffer[OUTPUT_BUFFER_SIZE];
+
+extern bool set_output_format( const char *name )
+{
+    if ( 0 == strcmp( name, "text" ) ) {
+        set_output( TEXT_OUTPUT );
+    } else if ( 0 == strcmp( name, "json" ) ) {
+        set_output( JSON_OUTPUT );
+    } else if ( 0 == strcmp( name, "nul" ) ) {
+        set_output( NUL_OUTPUT );
+    } else {
+        return false;
+    }
+    return true;
+}
+
+extern void set_output( output_format_t f )
+{
+    if ( TEXT_OUTPUT != f && TEXT_OUTPUT == format ) {
+        setvbuf( stdout, out_buffer, _IOFBF, OUTPUT_BUFFER_SIZE );
+    }
+    format = f;
+}
+
+extern output_format_t output_format( void )
+{
+    return format;
+}
+
+extern FILE *info_output( void )
+{
+    return ( TEXT_OUTPUT == format ) ? stdout : stderr;
+}
+
+static void text_group( FILE *out, const char *type, uint64_t size,
+                        const output_file_t *files, size_t n )
+{
+    if ( 0 == strcmp( type, "found" ) ) {
+        for ( size_t i = 1; i < n; ++i ) {
+            fprintf( out, " %s content is found as %s\n",
+                     files[0].path, files[i].path );
+        }
+        return;
+    }
+    if ( 0 == strcmp( type, "missing" ) ) {
+        fprintf( out, " %s content is not found in any path\n", files[0].path );
+        return;
+    }
+    if ( 0 == strcmp( type, "empty" ) ) {
+        fprintf( out, ( NULL == files[0].role ) ? "Empty file %s\n" :
+                                                  "Empty target file %s\n",
+                 files[0].path );
+        return;
+    }
+    if ( 0 == strcmp( type, "links" ) ) {
+        fprintf( out, "hard links size %lu\n", size );
+    } else if ( 0 == strcmp( type, "directories" ) ) {
+        fprintf( out, "identical directories size %lu\n", size );
+    } else {
+        fprintf( out, "size %lu\n", size );
+    }
+    for ( size_t i = 0; i < n; ++i ) {
+        if ( NULL == files[i].role ) {
+            fprintf( out, "  %s\n", files[i].path );
+        } else {
+            fprintf( out, "  <%s> %s\n", files[i].role, files[i].path );
+        }
+    }
+}
+
+static void json_digest( FILE *out, const digest_t *digest )
+{
+    static const char hex[] = "0123456789abcdef";
+    char buffer[2 * DIGEST_SIZE];
+    for ( int i = 0; i < DIGEST_SIZE; ++i ) {
+        buffer[2 * i] = hex[digest->bytes[i] >> 4];
+        buffer[2 * i + 1] = hex[digest->bytes[i] & 0xf];
+    }
+    fputs( ",\"digest\":\"", out );
+    fwrite( buffer, 1, sizeof(buffer), out );
+    fputc( '"', out );
+}
+
+// length of the valid UTF-8 sequence at s, or 0 if the byte at s does not
+// start one (overlong forms, surrogates and code points over U+10FFFF are
+// invalid)
+static int utf8_length( const unsigned char *s )
+{
+    int n;
+    uint32_t min, code;
+    if ( s[0] < 0x80 ) {
+        return 1;
+    } else if ( 0xc0 == ( s[0] & 0xe0 ) ) {
+        n = 2, min = 0x80, code = s[0] & 0x1f;
+    } else if ( 0xe0 == ( s[0] & 0xf0 ) ) {
+        n = 3, min = 0x800, code = s[0] & 0x0f;
+    } else if ( 0xf0 == ( s[0] & 0xf8 ) ) {
+        n = 4, min = 0x10000, code = s[0] & 0x07;
+    } else {
+        return 0;
+    }
+    for ( int i = 1; i < n; ++i ) {     // stops at '\0', not a continuation
+        if ( 0x80 != ( s[i] & 0xc0 ) ) {
+            return 0;
+        }
+        code = ( code << 6 ) | ( s[i] & 0x3f );
+    }
+    if ( code < min || code > 0x10ffff || ( code >= 0xd800 && code <= 0xdfff ) ) {
+        return 0;
+    }
+    return n;
+}
+
+static bool valid_utf8( const char *s )
+{
+    for ( int n; '\0' != *s; s += n ) {
+        n = utf8_length( (const unsigned char *)s );
+        if ( 0 == n ) {
+            return false;
+        }
+    }
+    return true;
+}
+
+extern void json_string( FILE *out, const char *s )
+{
+    fputc( '"', out );
+    const char *run = s;
+    for ( int n; '\0' != *s; s += n ) {
+        unsigned char c = (unsigned char)*s;
+        n = utf8_length( (const unsigned char *)s );
+        if ( 0 != n && c >= 0x20 && '"' != c && '\\' != c ) {
+            continue;
+        }
+        fwrite( run, 1, s - run, out );
+        if ( 0 == n ) {
+            fputs( "\\ufffd", out );    // replacement character
+            n = 1;
+        } else if ( '"' == c || '\\' == c ) {
+            fputc( '\\', out );
+            fputc( c, out );
+        } else {
+            fprintf( out, "\\u%04x", c );
+        }
+        run = s + n;
+    }
+    fwrite( run, 1, s - run, out );
+    fputc( '"', out );
+}
+
+// the exact bytes of a path that is not valid UTF-8
+static void json_path_hex( FILE *out, const char *path )
+{
+    static const char hex[] = "0123456789abcdef";
+    fputs( ",\"path_hex\":\"", out );
+    for ( const unsigned char *s = (const unsigned char *)path; '\0' != *s; ++s ) {
+        fputc( hex[*s >> 4], out );
+        fputc( hex[*s & 0xf], out );
+    }
+    fputc( '"', out );
+}
+
+static void json_group( FILE *out, const char *type, uint64_t size,
+                        const digest_t *digest,
+                        const output_file_t *files, size_t n )
+{
+    fprintf( out, "{\"type\":\"%s\",\"size\":%lu", type, size );
+    if ( NULL != digest ) {
+        json_digest( out, digest );
+    }
+    fputs( ",\"files\":[", out );
+    for ( size_t i = 0; i < n; ++i ) {
+        fputs( ( 0 == i ) ? "{\"path\":" : ",{\"path\":", out );
+        json_string( out, files[i].path );
+        if ( ! valid_utf8( files[i].path ) ) {
+            json_path_hex( out, files[i].path );
+        }
+        fprintf( out, ",\"dev\":%lu,\"ino\":%lu", files[i].dev, files[i].ino );
+        if ( NULL != files[i].role ) {
+            fprintf( out, ",\"role\":\"%s\"", files[i].role );
+        }
+        fputc( '}', out );
+    }
+    fputs( "]}\n", out );
+}
+
+static void nul_group( FILE *out, const char *type, uint64_t size,
+                       const digest_t *digest,
+                       const output_file_t *files, size_t n )
+{
+    fprintf( out, "%s%c%lu%c", type, '\0', size, '\0' );
+    if ( NULL != digest ) {
+        for ( int i = 0; i < DIGEST_SIZE; ++i ) {
+            fprintf( out, "%02x", digest->bytes[i] );
+        }
+    }
+    fputc( '\0', out );
+    for ( size_t i = 0; i < n; ++i ) {
+        fprintf( out, "%lu:%lu%c", files[i].dev, files[i].ino, '\0' );
+        fputs( files[i].path, out );
+        fputc( '\0', out );
+    }
+    fputc( '\0', out );
+}
+
+extern void output_group( FILE *out, const char *type, uint64_t size,
+                          const digest_t *digest,
+                          const output_file_t *files, size_t n )
+{
+    flockfile( out );       // groups may be written by several threads
+    switch ( format ) {
+    case TEXT_OUTPUT:
+        text_group( out, type, size, files, n );
+        break;
+    case JSON_OUTPUT:
+        json_group( out, type, size, digest, files, n );
+        break;
+    case NUL_OUTPUT:
+        nul_group( out, type, size, digest, files, n );
+        break;
+    }
+    funlockfile( out );
+}
@@ -0,0 +1,69 @@
+#ifndef __OUTPUT_H__
+#define __OUTPUT_H__
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "hash.h"
+
+/*
+    Results are written as groups of files, in one of three formats:
+
+    - text, for people: a header line with the size, followed by one line
+      per path, indented.
+    - JSON Lines: one JSON object per group, with its type, size, digest if
+      known (hexadecimal) and files, each with path, dev, ino and role if
+      any ("target" or "link"), e.g.
+        {"type":"duplicates","size":5,"digest":"af13...","files":[
+         {"path":"/a/x","dev":2049,"ino":12},{"path":"/b/y",...}]}
+      A path that is not valid UTF-8 cannot be carried by a JSON string:
+      its invalid bytes are replaced by U+FFFD in "path", and its exact
+      bytes are also given in hexadecimal, as "path_hex".
+    - NUL separated fields: type, size, digest (empty if unknown), then dev:ino
+      and path of each file, and an empty field at the end of the group.
+
+    Group types are "duplicates" (same content), "links" (names of the same
+    inode), "same size" (contents not compared), "target" (files with the
+    same content as a target file, or the same size if contents are not
+    compared), "found" and "missing" (target content found or not),
+    "empty" (empty files) and "directories" (directories with identical
+    contents, whose size is the total of their files, and whose dev and ino
+    are 0).
+
+    With JSON or NUL separated output, stdout gets a large buffer and other
+    messages (progress, summary and warnings) go to stderr instead, so that
+    stdout carries only results.
+*/
+
+typedef enum {
+    TEXT_OUTPUT, JSON_OUTPUT, NUL_OUTPUT
+} output_format_t;
+
+typedef struct {
+    const char      *path;
+    uint64_t        dev, ino;
+    const char      *role;      // NULL, "target" or "link"
+} output_file_t;
+
+// set the format once, before anything is written. Return false if the
+// format name (text, json or nul) is unknown.
+extern bool set_output_format( const char *name );
+extern void set_output( output_format_t format );
+extern output_format_t output_format( void );
+
+// where messages other than results go: stdout or stderr
+extern FILE *info_output( void );
+
+// write a group of n files to out (stdout or a memory stream). Digest is
+// NULL if unknown.
+extern void output_group( FILE *out, const char *type, uint64_t size,
+                          const digest_t *digest,
+                          const output_file_t *files, size_t n );
+
+// write s as a JSON string: paths are written as they are, except for
+// quotes, backslashes and control characters, which are escaped, and bytes
+// that are not valid UTF-8, which are replaced by U+FFFD
+extern void json_string( FILE *out, const char *s );
+
+#endif /* __OUTPUT_H__ */
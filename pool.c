@@ -0,0 +1,216 @@
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "comp.h"
+#include "pool.h"
+
+#define CHUNK_SIZE          ( 1024 * 1024 )
+#define MAX_CHUNKS          ( 64 * 1024 )       // up to 64 GB of names
+#define DIR_BLOCK_SIZE      ( 64 * 1024 )       // directories per block
+#define MAX_DIR_BLOCKS      ( 64 * 1024 )
+
+#define NAME_REF( chunk, offset )   ( ((name_ref_t)(chunk) << 32) | (offset) )
+#define NAME_CHUNK( ref )           ( (uint32_t)((ref) >> 32) )
+#define NAME_OFFSET( ref )          ( (uint32_t)(ref) )
+
+typedef struct {
+    dir_id_t        parent;
+    name_ref_t      name;
+} dir_entry_t;
+
+struct _pool {
+    pthread_mutex_t lock;
+    char            **chunks;       // MAX_CHUNKS pointers, allocated on use
+    uint32_t        n_chunks;
+    uint32_t        chunk_used;     // bytes used in last chunk
+    bool            *external;      // MAX_CHUNKS flags, set if not allocated
+    dir_entry_t     **dirs;         // MAX_DIR_BLOCKS pointers
+    uint32_t        n_dirs;
+};
+
+static void *malloc_or_exit( size_t size )
+{
+    void *d = malloc( size );
+    if ( NULL == d ) {
+        exit( NO_MEMORY_ERROR );
+    }
+    return d;
+}
+
+extern pool_t *new_pool( void )
+{
+    pool_t *pool = malloc_or_exit( sizeof(pool_t) );
+    pthread_mutex_init( &pool->lock, NULL );
+    pool->chunks = calloc( MAX_CHUNKS, sizeof(char *) );
+    pool->external = calloc( MAX_CHUNKS, sizeof(bool) );
+    pool->dirs = calloc( MAX_DIR_BLOCKS, sizeof(dir_entry_t *) );
+    if ( NULL == pool->chunks || NULL == pool->external || NULL == pool->dirs ) {
+        exit( NO_MEMORY_ERROR );
+    }
+    pool->n_chunks = 0;
+    pool->chunk_used = 0;
+    pool->n_dirs = 0;
+    return pool;
+}
+
+extern void free_pool( pool_t *pool )
+{
+    for ( uint32_t i = 0; i < pool->n_chunks; ++i ) {
+        if ( ! pool->external[i] ) {
+            free( pool->chunks[i] );
+        }
+    }
+    for ( uint32_t i = 0; i < MAX_DIR_BLOCKS && NULL != pool->dirs[i]; ++i ) {
+        free( pool->dirs[i] );
+    }
+    free( pool->chunks );
+    free( pool->external );
+    free( pool->dirs );
+    pthread_mutex_destroy( &pool->lock );
+    free( pool );
+}
+
+// must be called with the pool locked
+static name_ref_t reserve( pool_t *pool, size_t len )
+{
+    if ( 0 == pool->n_chunks || pool->chunk_used + len > CHUNK_SIZE ) {
+        if ( MAX_CHUNKS == pool->n_chunks ) {
+            error( "too many file names" );
+        }
+        pool->chunks[pool->n_chunks++] = malloc_or_exit( CHUNK_SIZE );
+        pool->chunk_used = 0;
+    }
+    uint32_t offset = pool->chunk_used;
+    pool->chunk_used += len;
+    return NAME_REF( pool->n_chunks - 1, offset );
+}
+
+static name_ref_t add_name( pool_t *pool, const char *name )
+{
+    size_t len = strlen( name ) + 1;
+    name_ref_t ref = reserve( pool, len );
+    memcpy( pool->chunks[NAME_CHUNK(ref)] + NAME_OFFSET(ref), name, len );
+    return ref;
+}
+
+extern void *pool_alloc( pool_t *pool, size_t size )
+{
+    pthread_mutex_lock( &pool->lock );
+    pool->chunk_used = ( pool->chunk_used + 7 ) & ~7u;     // align records
+    name_ref_t ref = reserve( pool, size );
+    pthread_mutex_unlock( &pool->lock );
+    return pool->chunks[NAME_CHUNK(ref)] + NAME_OFFSET(ref);
+}
+
+extern name_ref_t pool_add_name( pool_t *pool, const char *name )
+{
+    pthread_mutex_lock( &pool->lock );
+    name_ref_t ref = add_name( pool, name );
+    pthread_mutex_unlock( &pool->lock );
+    return ref;
+}
+
+extern name_ref_t pool_add_names( pool_t *pool, const char *names, size_t len )
+{
+    if ( len > UINT32_MAX ) {
+        error( "too many file names" );
+    }
+    pthread_mutex_lock( &pool->lock );
+    if ( MAX_CHUNKS == pool->n_chunks ) {
+        error( "too many file names" );
+    }
+    uint32_t chunk = pool->n_chunks++;
+    pool->chunks[chunk] = (char *)names;
+    pool->external[chunk] = true;
+    pool->chunk_used = CHUNK_SIZE;      // next names go to a new chunk
+    pthread_mutex_unlock( &pool->lock );
+    return NAME_REF( chunk, 0 );
+}
+
+extern dir_id_t pool_add_dir( pool_t *pool, dir_id_t parent, const char *name )
+{
+    pthread_mutex_lock( &pool->lock );
+    dir_id_t id = pool->n_dirs;
+    uint32_t block = id / DIR_BLOCK_SIZE;
+    if ( block == MAX_DIR_BLOCKS ) {
+        error( "too many directories" );
+    }
+    if ( NULL == pool->dirs[block] ) {
+        pool->dirs[block] = malloc_or_exit( sizeof(dir_entry_t) * DIR_BLOCK_SIZE );
+    }
+    dir_entry_t *entry = &pool->dirs[block][id % DIR_BLOCK_SIZE];
+    entry->parent = parent;
+    entry->name = add_name( pool, name );
+    ++pool->n_dirs;
+    pthread_mutex_unlock( &pool->lock );
+    return id;
+}
+
+extern const char *pool_name( const pool_t *pool, name_ref_t name )
+{
+    return pool->chunks[NAME_CHUNK(name)] + NAME_OFFSET(name);
+}
+
+static const dir_entry_t *get_dir( const pool_t *pool, dir_id_t dir )
+{
+    return &pool->dirs[dir / DIR_BLOCK_SIZE][dir % DIR_BLOCK_SIZE];
+}
+
+extern dir_id_t pool_n_dirs( pool_t *pool )
+{
+    pthread_mutex_lock( &pool->lock );
+    dir_id_t n = pool->n_dirs;
+    pthread_mutex_unlock( &pool->lock );
+    return n;
+}
+
+extern dir_id_t pool_dir_parent( const pool_t *pool, dir_id_t dir )
+{
+    return get_dir( pool, dir )->parent;
+}
+
+extern const char *pool_dir_name( const pool_t *pool, dir_id_t dir )
+{
+    return pool_name( pool, get_dir( pool, dir )->name );
+}
+
+extern char *pool_path( const pool_t *pool, file_ref_t ref )
+{
+    // first find the path length, from the file name up to the root
+    size_t len = strlen( pool_name( pool, ref.name ) ) + 1;
+    for ( dir_id_t dir = ref.dir; NO_DIR != dir; dir = pool_dir_parent( pool, dir ) ) {
+        len += strlen( pool_dir_name( pool, dir ) ) + 1;
+    }
+    // then copy names backward, from the end of path
+    char *path = malloc_or_exit( len );
+    char *end = path + len - 1;
+    *end = '\0';
+    const char *name = pool_name( pool, ref.name );
+    for ( dir_id_t dir = ref.dir; NO_DIR != dir; dir = pool_dir_parent( pool, dir ) ) {
+        size_t name_len = strlen( name );
+        end -= name_len;
+        memcpy( end, name, name_len );
+        name = pool_dir_name( pool, dir );
+        if ( '/' != name[strlen(name) - 1] ) {  // root may end with '/'
+            *--end = '/';
+        }
+    }
+    size_t name_len = strlen( name );
+    end -= name_len;
+    memcpy( end, name, name_len );
+    if ( end != path ) {    // root ending with '/': shift path to the start
+        memmove( path, end, strlen( end ) + 1 );
+    }
+    return path;
+}
+
+extern char *pool_dir_path( const pool_t *pool, dir_id_t dir )
+{
+    file_ref_t ref;
+    ref.dir = get_dir( pool, dir )->parent;
+    ref.name = get_dir( pool, dir )->name;
+    return pool_path( pool, ref );
+}
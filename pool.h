@@ -0,0 +1,62 @@
+#ifndef __POOL_H__
+#define __POOL_H__
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+/*
+    Compact storage of file paths. Names are interned in an arena made of
+    large chunks, and directories are kept in a table where each directory
+    refers to its parent directory and to its own name in the arena. A file
+    is then just a (directory id, name reference) pair, and its full path is
+    rebuilt only when it has to be opened or shown. The names of files
+    loaded from an index are not copied: the paths of the index are used as
+    an arena chunk of their own.
+
+    Adding directories and names is thread safe. Looking them up is lock
+    free, since chunks and table blocks never move once allocated.
+*/
+
+typedef uint32_t    dir_id_t;
+typedef uint64_t    name_ref_t;     // chunk index and offset in chunk
+
+#define NO_DIR      ((dir_id_t)-1)
+
+typedef struct {
+    dir_id_t        dir;
+    name_ref_t      name;
+} file_ref_t;
+
+typedef struct _pool pool_t;
+
+extern pool_t *new_pool( void );
+extern void free_pool( pool_t *pool );
+
+// parent is NO_DIR for a root directory, in which case name is its path
+extern dir_id_t pool_add_dir( pool_t *pool, dir_id_t parent, const char *name );
+extern name_ref_t pool_add_name( pool_t *pool, const char *name );
+
+// use len bytes of names (less than 4 GB), owned by the caller and valid as
+// long as the pool, as names without copying them. Return the reference of
+// the name starting at names, the name at offset o then has reference +o.
+extern name_ref_t pool_add_names( pool_t *pool, const char *names, size_t len );
+
+// allocate a small record in the pool, freed only with the pool
+extern void *pool_alloc( pool_t *pool, size_t size );
+
+extern const char *pool_name( const pool_t *pool, name_ref_t name );
+extern dir_id_t pool_dir_parent( const pool_t *pool, dir_id_t dir );
+extern const char *pool_dir_name( const pool_t *pool, dir_id_t dir );
+
+// number of directories added: their ids are 0 to n-1, and a directory is
+// always added after its parent, so that its id is larger
+extern dir_id_t pool_n_dirs( pool_t *pool );
+
+// return the full path of a file (allocated, to free after use)
+extern char *pool_path( const pool_t *pool, file_ref_t ref );
+
+// return the full path of a directory (allocated, to free after use)
+extern char *pool_dir_path( const pool_t *pool, dir_id_t dir );
+
+#endif /* __POOL_H__ */
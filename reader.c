@@ -0,0 +1,906 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <linux/io_uring.h>
+
+#include "comp.h"
+#include "reader.h"
+#include "mapped.h"
+#include "device.h"
+#include "output.h"
+#include "stats.h"
+#include "trace.h"
+
+/*
+    With io_uring, all reads are submitted and completed by the calling
+    thread. Each read uses one of depth buffer slots. Free slots are given
+    to the oldest file in the batch that still has blocks to read, so that
+    big files get many reads in flight, while small files are read many at
+    once. Completed blocks are delivered in order for each file: a block
+    completed before the previous ones of the same file keeps its slot
+    until they are delivered.
+
+    Without io_uring (or if built with NO_IO_URING), depth threads (the
+    calling thread and depth-1 pool threads) read whole files with blocking
+    reads, each in its own buffer. With READ_MAPPED, the same threads map
+    large files instead of reading them.
+*/
+
+#define READ_BLOCK_SIZE     ( 128 * 1024 )
+
+/*
+    Before a batch is read, its jobs are put in queues: one queue for the
+    files whose ranges are already in the page cache, then one queue per
+    device. Each queue has its own maximum number of reads in flight, low
+    for rotational devices, whose files are ordered by physical offset to
+    limit seeks. A job is started from the first queue that has both jobs
+    left and room for another read, so that cached files go first and all
+    devices are kept busy at once.
+
+    As each comparing thread has its own reader, reads in flight on a
+    rotational device are also claimed from a count shared by all readers
+    (see device.h), so that the device never sees more than its limit.
+    Files are still ordered by physical offset only within each batch.
+*/
+#define ROTATIONAL_DEPTH    2                   // reads in flight on a disk
+#define RESIDENT_MIN_SIZE   ( 64 * 1024 )       // smaller jobs are not checked
+
+typedef struct {
+    int                 depth;      // maximum number of reads in flight
+    int                 in_flight;
+    size_t              next, end;  // jobs left to start in schedule order
+    uint64_t            dev;
+    bool                shared;     // reads also claimed on the device
+} job_queue_t;
+
+typedef struct {
+    size_t              *order;     // job indexes, by queue
+    size_t              *queue_of;  // queue of each job
+    job_queue_t         *queues;
+    size_t              n_queues;
+    size_t              pending;    // number of jobs not started yet
+} schedule_t;
+
+// Block of file to read. With O_DIRECT, the read is extended to aligned
+// offset and length, and the data wanted starts at skip in the buffer.
+typedef struct {
+    uint64_t            io_offset;
+    size_t              io_len;     // bytes to read
+    size_t              skip;
+    size_t              len;        // bytes wanted
+} block_t;
+
+typedef struct {
+    int                 fd;
+    unsigned            *sq_head, *sq_tail, *sq_mask, *sq_array;
+    struct io_uring_sqe *sqes;
+    unsigned            *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_cqe *cqes;
+    void                *sq_ring, *cq_ring;
+    size_t              sq_ring_size, cq_ring_size, sqes_size;
+    bool                fixed;      // buffers are registered
+} uring_t;
+
+typedef enum { SLOT_FREE, SLOT_BUSY, SLOT_DONE } slot_state_t;
+
+typedef struct {
+    slot_state_t        state;
+    size_t              job;        // index in batch
+    uint64_t            seq;        // block sequence number in file
+    block_t             block;
+    int                 result;     // bytes read or -errno
+    struct iovec        iov;        // used if buffers are not registered
+} slot_t;
+
+// progress of a file read with io_uring
+typedef struct {
+    int                 fd;
+    int                 range;      // range to submit next
+    uint64_t            offset;     // offset to submit next in range
+    uint64_t            submitted;  // number of blocks submitted
+    uint64_t            delivered;  // number of blocks delivered
+    bool                eof;        // short read or error: ignore the rest
+    uint64_t            span;       // trace start, from open to close
+    uint64_t            bytes;      // delivered
+} file_state_t;
+
+struct _reader {
+    int                 depth;
+    unsigned            flags;
+    unsigned char       *buffers;   // depth blocks
+    schedule_t          schedule;   // current batch
+    bool                use_uring;
+    uring_t             ring;
+    slot_t              *slots;
+
+    // fallback pool
+    pthread_t           *threads;
+    int                 n_threads;  // besides the calling thread
+    pthread_mutex_t     lock;
+    pthread_cond_t      work_cond, done_cond;
+    pthread_cond_t      queue_cond; // room made in a job queue
+    const read_job_t    *jobs;      // current batch
+    size_t              n_jobs;
+    atomic_size_t       bytes;
+    int                 n_busy;     // pool threads in current batch
+    uint64_t            batch;      // current batch number
+    bool                quit;
+};
+
+static void *malloc_or_exit( size_t size )
+{
+    void *d = malloc( size );
+    if ( NULL == d ) {
+        exit( NO_MEMORY_ERROR );
+    }
+    return d;
+}
+
+extern int open_read_file( const char *path, unsigned flags )
+{
+    int fd = -1;
+    if ( flags & READ_DIRECT ) {    // EINVAL if not supported
+        fd = open( path, O_RDONLY | O_DIRECT );
+    }
+    if ( -1 == fd ) {
+        fd = open( path, O_RDONLY );
+    }
+    if ( -1 == fd ) {
+        return -1;
+    }
+    add_count( OPEN_COUNT, 1 );
+    if ( flags & ( READ_NOCACHE | READ_DIRECT ) ) {
+        posix_fadvise( fd, 0, 0, POSIX_FADV_NOREUSE );
+    }
+    return fd;
+}
+
+// also used with READ_DIRECT, in case the file could not be opened with
+// O_DIRECT
+extern void release_read_pages( int fd, uint64_t offset, size_t len,
+                                unsigned flags )
+{
+    if ( flags & ( READ_NOCACHE | READ_DIRECT ) ) {
+        posix_fadvise( fd, (off_t)offset, (off_t)len, POSIX_FADV_DONTNEED );
+    }
+}
+
+static void set_block( block_t *block, uint64_t offset, uint64_t end,
+                       unsigned flags )
+{
+    bool direct = 0 != ( flags & READ_DIRECT );
+    block->skip = ( direct ) ? offset & ( DIRECT_ALIGN - 1 ) : 0;
+    block->io_offset = offset - block->skip;
+    block->len = ( end - offset > READ_BLOCK_SIZE - block->skip ) ?
+                                READ_BLOCK_SIZE - block->skip : end - offset;
+    block->io_len = block->skip + block->len;
+    if ( direct ) {
+        block->io_len = ( block->io_len + DIRECT_ALIGN - 1 ) & ~(size_t)( DIRECT_ALIGN - 1 );
+    }
+}
+
+// number of bytes wanted that are in buffer after reading n bytes
+static size_t block_data( const block_t *block, size_t n )
+{
+    if ( n <= block->skip ) {
+        return 0;
+    }
+    return ( n - block->skip < block->len ) ? n - block->skip : block->len;
+}
+
+static void read_error( const read_job_t *job, int err )
+{
+    fprintf( info_output(),
+             "Warning: error reading file %s (errno %d)\n", job->path, err );
+}
+
+// a file that cannot be opened is reported, and its callback told at once
+static void open_error( const read_job_t *job, int err )
+{
+    fprintf( info_output(),
+             "Warning: unable to open file %s (errno %d)\n", job->path, err );
+    job->process( job->context, NULL, 0 );
+}
+
+// read from offset to end with regular reads. Return false if the file
+// could not be read to end, once the callback was told.
+static bool read_range( const read_job_t *job, int fd, unsigned char *buffer,
+                        uint64_t offset, uint64_t end, unsigned flags,
+                        size_t *bytes )
+{
+    while ( offset < end ) {
+        block_t block;
+        set_block( &block, offset, end, flags );
+        ssize_t n = pread( fd, buffer, block.io_len, (off_t)block.io_offset );
+        if ( -1 == n ) {
+            if ( EINTR == errno ) {
+                continue;
+            }
+            read_error( job, errno );
+            job->process( job->context, NULL, 0 );
+            return false;
+        }
+        release_read_pages( fd, block.io_offset, block.io_len, flags );
+        size_t len = block_data( &block, (size_t)n );
+        if ( 0 == len ) {       // file truncated since it was found
+            job->process( job->context, NULL, 0 );
+            return false;
+        }
+        job->process( job->context, buffer + block.skip, len );
+        *bytes += len;
+        offset += len;
+    }
+    return true;
+}
+
+// With READ_MAPPED, large files are mapped, but if a mapping fails, the
+// rest of the file is read with regular reads.
+static size_t read_job( const read_job_t *job, unsigned char *buffer,
+                        unsigned flags )
+{
+    int fd = open_read_file( job->path, flags );
+    if ( -1 == fd ) {
+        open_error( job, errno );
+        return 0;
+    }
+    bool mapped = false;
+    if ( flags & READ_MAPPED ) {
+        uint64_t length = 0;
+        for ( int i = 0; i < job->n_ranges; ++i ) {
+            length += job->ranges[i].length;
+        }
+        mapped = length >= MAPPED_MIN_SIZE;
+    }
+    size_t bytes = 0;
+    for ( int i = 0; i < job->n_ranges; ++i ) {
+        uint64_t offset = job->ranges[i].offset;
+        uint64_t end = offset + job->ranges[i].length;
+        if ( mapped ) {
+            size_t before = bytes;
+            mapped_result_t result = mapped_read( fd, offset, end - offset,
+                                                  job->process, job->context,
+                                                  &bytes );
+            if ( MAPPED_TRUNCATED == result ) {
+                job->process( job->context, NULL, 0 );
+                break;
+            }
+            mapped = MAPPED_DONE == result;
+            offset += bytes - before;
+        }
+        if ( ! read_range( job, fd, buffer, offset, end, flags, &bytes ) ) {
+            break;
+        }
+    }
+    close( fd );
+    return bytes;
+}
+
+typedef struct {
+    size_t              job;
+    uint64_t            dev;
+    uint64_t            physical;   // offset on device, for rotational devices
+    bool                resident;   // all ranges in page cache
+} job_key_t;
+
+static int compare_job_keys( const void *k1, const void *k2 )
+{
+    const job_key_t *key1 = k1, *key2 = k2;
+    if ( key1->resident != key2->resident ) {
+        return ( key1->resident ) ? -1 : 1;
+    }
+    if ( ! key1->resident && key1->dev != key2->dev ) {
+        return ( key1->dev < key2->dev ) ? -1 : 1;
+    }
+    if ( key1->physical != key2->physical ) {
+        return ( key1->physical < key2->physical ) ? -1 : 1;
+    }
+    return ( key1->job < key2->job ) ? -1 : ( key1->job > key2->job );
+}
+
+// files are opened just to check where their ranges are, which is worth it
+// only for large ranges or on rotational devices
+static void set_job_key( const read_job_t *job, unsigned flags, job_key_t *key )
+{
+    key->dev = job->dev;
+    key->physical = 0;
+    key->resident = false;
+    uint64_t length = 0;
+    for ( int i = 0; i < job->n_ranges; ++i ) {
+        length += job->ranges[i].length;
+    }
+    bool rotational = device_rotational( job->dev );
+    bool check = 0 == ( flags & READ_DIRECT ) && length >= RESIDENT_MIN_SIZE;
+    if ( 0 == job->n_ranges || ! ( rotational || check ) ) {
+        return;
+    }
+    int fd = open( job->path, O_RDONLY );
+    if ( -1 == fd ) {
+        return;                 // reported when the file is read
+    }
+    if ( check ) {
+        key->resident = true;
+        for ( int i = 0; i < job->n_ranges && key->resident; ++i ) {
+            key->resident = file_resident( fd, job->ranges[i].offset,
+                                           job->ranges[i].length );
+        }
+    }
+    if ( rotational && ! key->resident ) {
+        key->physical = file_physical_offset( fd, job->ranges[0].offset );
+    }
+    close( fd );
+}
+
+static void build_schedule( reader_t *reader, const read_job_t *jobs, size_t n )
+{
+    schedule_t *s = &reader->schedule;
+    s->order = malloc_or_exit( sizeof(size_t) * ( n + 1 ) );
+    s->queue_of = malloc_or_exit( sizeof(size_t) * ( n + 1 ) );
+    s->queues = malloc_or_exit( sizeof(job_queue_t) * ( n + 1 ) );
+    s->n_queues = 0;
+    s->pending = n;
+
+    job_key_t *keys = malloc_or_exit( sizeof(job_key_t) * ( n + 1 ) );
+    for ( size_t i = 0; i < n; ++i ) {
+        keys[i].job = i;
+        if ( n > 1 ) {          // a single job does not need any order
+            set_job_key( &jobs[i], reader->flags, &keys[i] );
+        } else {
+            keys[i].dev = jobs[i].dev;
+            keys[i].physical = 0;
+            keys[i].resident = false;
+        }
+    }
+    qsort( keys, n, sizeof(job_key_t), compare_job_keys );
+
+    for ( size_t i = 0; i < n; ++i ) {
+        if ( 0 == i || keys[i].resident != keys[i-1].resident ||
+             ( ! keys[i].resident && keys[i].dev != keys[i-1].dev ) ) {
+            job_queue_t *q = &s->queues[s->n_queues++];
+            q->shared = ! keys[i].resident && device_rotational( keys[i].dev );
+            q->depth = ( q->shared ) ? ROTATIONAL_DEPTH : reader->depth;
+            q->dev = keys[i].dev;
+            q->in_flight = 0;
+            q->next = i;
+        }
+        s->queues[s->n_queues - 1].end = i + 1;
+        s->order[i] = keys[i].job;
+        s->queue_of[keys[i].job] = s->n_queues - 1;
+    }
+    free( keys );
+}
+
+static void free_schedule( schedule_t *s )
+{
+    free( s->queues );
+    free( s->queue_of );
+    free( s->order );
+}
+
+// claim a read on the device of a shared queue, waiting for one with wait
+static bool claim_queue_read( const job_queue_t *q, bool wait )
+{
+    return ! q->shared || claim_device_read( q->dev, q->depth, wait );
+}
+
+static void release_queue_read( const job_queue_t *q )
+{
+    if ( q->shared ) {
+        release_device_read( q->dev );
+    }
+}
+
+// Return the next job of the first queue with room for a read, or n if
+// there is none. With claim, the read is also claimed on the device of the
+// queue, waiting for the first queue with jobs left if wait. Queue
+// in_flight is updated by the caller.
+static size_t next_scheduled_job( schedule_t *s, size_t n, bool claim,
+                                  bool wait )
+{
+    for ( size_t i = 0; i < s->n_queues; ++i ) {
+        job_queue_t *q = &s->queues[i];
+        if ( q->next < q->end && q->in_flight < q->depth &&
+             ( ! claim || claim_queue_read( q, wait ) ) ) {
+            --s->pending;
+            return s->order[q->next++];
+        }
+    }
+    return n;
+}
+
+// pool threads and calling thread take jobs in schedule order, each queue
+// limiting the number of files read at once
+static void read_pending_jobs( reader_t *reader, unsigned char *buffer )
+{
+    schedule_t *s = &reader->schedule;
+    pthread_mutex_lock( &reader->lock );
+    while ( 0 != s->pending ) {
+        size_t index = next_scheduled_job( s, reader->n_jobs, false, false );
+        if ( index == reader->n_jobs ) {    // wait for room in a queue
+            pthread_cond_wait( &reader->queue_cond, &reader->lock );
+            continue;
+        }
+        job_queue_t *q = &s->queues[s->queue_of[index]];
+        ++q->in_flight;
+        pthread_mutex_unlock( &reader->lock );
+
+        claim_queue_read( q, true );    // whole file, once other readers allow
+        uint64_t span = trace_start( );
+        size_t n = read_job( &reader->jobs[index], buffer, reader->flags );
+        trace_span( span, "read", reader->jobs[index].path, "bytes", n );
+        atomic_fetch_add( &reader->bytes, n );
+        release_queue_read( q );
+
+        pthread_mutex_lock( &reader->lock );
+        --q->in_flight;
+        pthread_cond_broadcast( &reader->queue_cond );
+    }
+    pthread_mutex_unlock( &reader->lock );
+}
+
+typedef struct {
+    reader_t            *reader;
+    unsigned char       *buffer;
+} pool_thread_t;
+
+static void *pool_thread( void *arg )
+{
+    pool_thread_t *pt = arg;
+    reader_t *reader = pt->reader;
+    uint64_t batch = 0;
+
+    pthread_mutex_lock( &reader->lock );
+    while ( true ) {
+        while ( ! reader->quit && batch == reader->batch ) {
+            pthread_cond_wait( &reader->work_cond, &reader->lock );
+        }
+        if ( reader->quit ) {
+            break;
+        }
+        batch = reader->batch;
+        pthread_mutex_unlock( &reader->lock );
+
+        read_pending_jobs( reader, pt->buffer );
+
+        pthread_mutex_lock( &reader->lock );
+        if ( 0 == --reader->n_busy ) {
+            pthread_cond_signal( &reader->done_cond );
+        }
+    }
+    pthread_mutex_unlock( &reader->lock );
+    free( pt );
+    return NULL;
+}
+
+static size_t pool_read_files( reader_t *reader, const read_job_t *jobs, size_t n )
+{
+    pthread_mutex_lock( &reader->lock );
+    reader->jobs = jobs;
+    reader->n_jobs = n;
+    atomic_store( &reader->bytes, 0 );
+    if ( n > 1 && reader->n_threads > 0 ) {
+        reader->n_busy = reader->n_threads;
+        ++reader->batch;
+        pthread_cond_broadcast( &reader->work_cond );
+    }
+    pthread_mutex_unlock( &reader->lock );
+
+    read_pending_jobs( reader, reader->buffers );
+
+    pthread_mutex_lock( &reader->lock );
+    while ( 0 != reader->n_busy ) {     // jobs must stay valid until done
+        pthread_cond_wait( &reader->done_cond, &reader->lock );
+    }
+    pthread_mutex_unlock( &reader->lock );
+    return atomic_load( &reader->bytes );
+}
+
+static void start_pool( reader_t *reader )
+{
+    pthread_mutex_init( &reader->lock, NULL );
+    pthread_cond_init( &reader->work_cond, NULL );
+    pthread_cond_init( &reader->done_cond, NULL );
+    pthread_cond_init( &reader->queue_cond, NULL );
+    reader->n_busy = 0;
+    reader->batch = 0;
+    reader->quit = false;
+    reader->n_threads = reader->depth - 1;
+    reader->threads = malloc_or_exit( sizeof(pthread_t) * reader->depth );
+    for ( int i = 0; i < reader->n_threads; ++i ) {
+        pool_thread_t *pt = malloc_or_exit( sizeof(pool_thread_t) );
+        pt->reader = reader;
+        pt->buffer = reader->buffers + (size_t)(i + 1) * READ_BLOCK_SIZE;
+        if ( 0 != pthread_create( &reader->threads[i], NULL, pool_thread, pt ) ) {
+            fprintf( info_output(),
+                     "Unable to create reader thread - exiting\n" );
+            exit( INTERNAL_ERROR );
+        }
+    }
+}
+
+static void stop_pool( reader_t *reader )
+{
+    pthread_mutex_lock( &reader->lock );
+    reader->quit = true;
+    pthread_cond_broadcast( &reader->work_cond );
+    pthread_mutex_unlock( &reader->lock );
+    for ( int i = 0; i < reader->n_threads; ++i ) {
+        pthread_join( reader->threads[i], NULL );
+    }
+    free( reader->threads );
+    pthread_cond_destroy( &reader->queue_cond );
+    pthread_cond_destroy( &reader->done_cond );
+    pthread_cond_destroy( &reader->work_cond );
+    pthread_mutex_destroy( &reader->lock );
+}
+
+#ifndef NO_IO_URING
+static bool uring_init( uring_t *ring, unsigned entries )
+{
+    struct io_uring_params params;
+    memset( &params, 0, sizeof(params) );
+    ring->fd = (int)syscall( __NR_io_uring_setup, entries, &params );
+    if ( ring->fd < 0 ) {
+        return false;
+    }
+    ring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cq_ring_size = params.cq_off.cqes +
+                         params.cq_entries * sizeof(struct io_uring_cqe);
+    bool single = 0 != ( params.features & IORING_FEAT_SINGLE_MMAP );
+    if ( single && ring->cq_ring_size > ring->sq_ring_size ) {
+        ring->sq_ring_size = ring->cq_ring_size;
+    }
+    ring->sq_ring = mmap( NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE,
+                          MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING );
+    if ( MAP_FAILED == ring->sq_ring ) {
+        close( ring->fd );
+        return false;
+    }
+    if ( single ) {
+        ring->cq_ring = ring->sq_ring;
+        ring->cq_ring_size = 0;         // nothing more to unmap
+    } else {
+        ring->cq_ring = mmap( NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE,
+                              MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING );
+        if ( MAP_FAILED == ring->cq_ring ) {
+            munmap( ring->sq_ring, ring->sq_ring_size );
+            close( ring->fd );
+            return false;
+        }
+    }
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap( NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+                       MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES );
+    if ( MAP_FAILED == ring->sqes ) {
+        if ( 0 != ring->cq_ring_size ) {
+            munmap( ring->cq_ring, ring->cq_ring_size );
+        }
+        munmap( ring->sq_ring, ring->sq_ring_size );
+        close( ring->fd );
+        return false;
+    }
+    char *sq = ring->sq_ring, *cq = ring->cq_ring;
+    ring->sq_head = (unsigned *)( sq + params.sq_off.head );
+    ring->sq_tail = (unsigned *)( sq + params.sq_off.tail );
+    ring->sq_mask = (unsigned *)( sq + params.sq_off.ring_mask );
+    ring->sq_array = (unsigned *)( sq + params.sq_off.array );
+    ring->cq_head = (unsigned *)( cq + params.cq_off.head );
+    ring->cq_tail = (unsigned *)( cq + params.cq_off.tail );
+    ring->cq_mask = (unsigned *)( cq + params.cq_off.ring_mask );
+    ring->cqes = (struct io_uring_cqe *)( cq + params.cq_off.cqes );
+    ring->fixed = false;
+    return true;
+}
+
+static void uring_exit( uring_t *ring )
+{
+    munmap( ring->sqes, ring->sqes_size );
+    if ( 0 != ring->cq_ring_size ) {
+        munmap( ring->cq_ring, ring->cq_ring_size );
+    }
+    munmap( ring->sq_ring, ring->sq_ring_size );
+    close( ring->fd );
+}
+
+// registered buffers are pinned once, instead of at each read
+static void uring_register_buffers( reader_t *reader )
+{
+    struct iovec *iovs = malloc_or_exit( sizeof(struct iovec) * reader->depth );
+    for ( int i = 0; i < reader->depth; ++i ) {
+        iovs[i].iov_base = reader->buffers + (size_t)i * READ_BLOCK_SIZE;
+        iovs[i].iov_len = READ_BLOCK_SIZE;
+    }
+    // may fail if over RLIMIT_MEMLOCK, in which case plain reads are used
+    reader->ring.fixed = 0 == syscall( __NR_io_uring_register, reader->ring.fd,
+                                       IORING_REGISTER_BUFFERS, iovs,
+                                       reader->depth );
+    free( iovs );
+}
+
+static void uring_queue_read( reader_t *reader, int fd, size_t index )
+{
+    uring_t *ring = &reader->ring;
+    slot_t *slot = &reader->slots[index];
+    unsigned tail = *ring->sq_tail;     // only written by this thread
+    unsigned i = tail & *ring->sq_mask;
+    struct io_uring_sqe *sqe = &ring->sqes[i];
+
+    memset( sqe, 0, sizeof(*sqe) );
+    sqe->fd = fd;
+    sqe->off = slot->block.io_offset;
+    sqe->user_data = index;
+    if ( ring->fixed ) {
+        sqe->opcode = IORING_OP_READ_FIXED;
+        sqe->addr = (uintptr_t)( reader->buffers + index * READ_BLOCK_SIZE );
+        sqe->len = (uint32_t)slot->block.io_len;
+        sqe->buf_index = (uint16_t)index;
+    } else {
+        slot->iov.iov_base = reader->buffers + index * READ_BLOCK_SIZE;
+        slot->iov.iov_len = slot->block.io_len;
+        sqe->opcode = IORING_OP_READV;
+        sqe->addr = (uintptr_t)&slot->iov;
+        sqe->len = 1;
+    }
+    ring->sq_array[i] = i;
+    __atomic_store_n( ring->sq_tail, tail + 1, __ATOMIC_RELEASE );
+}
+
+// submit queued reads and wait for at least one completion
+static void uring_submit_and_wait( uring_t *ring, unsigned to_submit )
+{
+    while ( true ) {
+        int res = (int)syscall( __NR_io_uring_enter, ring->fd, to_submit, 1,
+                                IORING_ENTER_GETEVENTS, NULL, 0 );
+        if ( res >= 0 ) {
+            to_submit -= (unsigned)res;
+            if ( 0 == to_submit ) {
+                return;
+            }
+        } else if ( EINTR != errno && EAGAIN != errno ) {
+            fprintf( info_output(),
+                     "io_uring error (errno %d) - exiting\n", errno );
+            exit( INTERNAL_ERROR );
+        }
+    }
+}
+
+// skip empty ranges; return false when all ranges have been submitted
+static bool has_blocks( const read_job_t *job, file_state_t *file )
+{
+    while ( file->range < job->n_ranges &&
+            file->offset == job->ranges[file->range].offset +
+                            job->ranges[file->range].length ) {
+        if ( ++file->range < job->n_ranges ) {
+            file->offset = job->ranges[file->range].offset;
+        }
+    }
+    return ! file->eof && file->range < job->n_ranges;
+}
+
+static size_t find_slot( const reader_t *reader, slot_state_t state,
+                         size_t job, uint64_t seq )
+{
+    for ( size_t i = 0; i < (size_t)reader->depth; ++i ) {
+        const slot_t *slot = &reader->slots[i];
+        if ( state == slot->state &&
+             ( SLOT_FREE == state || ( job == slot->job && seq == slot->seq ) ) ) {
+            return i;
+        }
+    }
+    return (size_t)reader->depth;
+}
+
+static size_t uring_read_files( reader_t *reader, const read_job_t *jobs, size_t n )
+{
+    file_state_t *files = malloc_or_exit( sizeof(file_state_t) * ( n + 1 ) );
+    size_t *active = malloc_or_exit( sizeof(size_t) * reader->depth );
+    schedule_t *s = &reader->schedule;
+    size_t n_active = 0, bytes = 0;
+    int in_flight = 0;
+
+    while ( true ) {
+        unsigned queued = 0;
+        while ( in_flight < reader->depth ) {
+            // give the free slot to the oldest file with blocks to read
+            // whose queue has room for another read. Without any read in
+            // flight, wait for other readers to leave room on a device.
+            size_t job = n;
+            for ( int pass = 0; job == n && pass < 1 + ( 0 == in_flight );
+                  ++pass ) {
+                bool wait = 1 == pass;
+                for ( size_t i = 0; i < n_active; ++i ) {
+                    const job_queue_t *q = &s->queues[s->queue_of[active[i]]];
+                    if ( q->in_flight < q->depth &&
+                         has_blocks( &jobs[active[i]], &files[active[i]] ) &&
+                         claim_queue_read( q, wait ) ) {
+                        job = active[i];
+                        break;
+                    }
+                }
+                size_t next_job;
+                while ( job == n && n_active < (size_t)reader->depth &&
+                        n != ( next_job = next_scheduled_job( s, n, true,
+                                                              wait ) ) ) {
+                    file_state_t *file = &files[next_job];
+                    file->span = trace_start( );
+                    file->bytes = 0;
+                    file->fd = open_read_file( jobs[next_job].path,
+                                               reader->flags );
+                    file->range = 0;
+                    file->offset = jobs[next_job].ranges[0].offset;
+                    file->submitted = file->delivered = 0;
+                    file->eof = false;
+                    if ( -1 == file->fd ) {
+                        open_error( &jobs[next_job], errno );
+                        release_queue_read( &s->queues[s->queue_of[next_job]] );
+                    } else if ( 0 == jobs[next_job].n_ranges ||
+                                ! has_blocks( &jobs[next_job], file ) ) {
+                        close( file->fd );      // nothing to read
+                        release_queue_read( &s->queues[s->queue_of[next_job]] );
+                    } else {
+                        job = next_job;
+                        active[n_active++] = job;
+                    }
+                }
+            }
+            if ( job == n ) {
+                break;
+            }
+            file_state_t *file = &files[job];
+            uint64_t end = jobs[job].ranges[file->range].offset +
+                           jobs[job].ranges[file->range].length;
+            size_t index = find_slot( reader, SLOT_FREE, 0, 0 );
+            slot_t *slot = &reader->slots[index];
+            slot->state = SLOT_BUSY;
+            slot->job = job;
+            slot->seq = file->submitted++;
+            set_block( &slot->block, file->offset, end, reader->flags );
+            uring_queue_read( reader, file->fd, index );
+            file->offset += slot->block.len;
+            ++s->queues[s->queue_of[job]].in_flight;
+            ++in_flight;
+            ++queued;
+        }
+        if ( 0 == in_flight ) {
+            break;
+        }
+        uring_submit_and_wait( &reader->ring, queued );
+
+        uring_t *ring = &reader->ring;
+        unsigned head = *ring->cq_head;
+        while ( head != __atomic_load_n( ring->cq_tail, __ATOMIC_ACQUIRE ) ) {
+            const struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+            slot_t *slot = &reader->slots[cqe->user_data];
+            slot->result = cqe->res;
+            slot->state = SLOT_DONE;
+            ++head;
+
+            // deliver all blocks now in order for that file
+            size_t job = slot->job;
+            file_state_t *file = &files[job];
+            size_t index;
+            while ( (size_t)reader->depth !=
+                    ( index = find_slot( reader, SLOT_DONE, job, file->delivered ) ) ) {
+                slot_t *done = &reader->slots[index];
+                if ( ! file->eof ) {
+                    size_t len = 0;
+                    if ( done->result < 0 ) {
+                        read_error( &jobs[job], -done->result );
+                    } else {
+                        release_read_pages( file->fd, done->block.io_offset,
+                                            done->block.io_len, reader->flags );
+                        len = block_data( &done->block, (size_t)done->result );
+                    }
+                    if ( 0 != len ) {
+                        jobs[job].process( jobs[job].context, reader->buffers +
+                                           index * READ_BLOCK_SIZE + done->block.skip,
+                                           len );
+                        bytes += len;
+                        file->bytes += len;
+                    }
+                    if ( len < done->block.len ) {
+                        file->eof = true;   // truncated file or error
+                        jobs[job].process( jobs[job].context, NULL, 0 );
+                    }
+                }
+                done->state = SLOT_FREE;
+                --s->queues[s->queue_of[job]].in_flight;
+                release_queue_read( &s->queues[s->queue_of[job]] );
+                --in_flight;
+                ++file->delivered;
+            }
+            if ( file->delivered == file->submitted &&
+                 ! has_blocks( &jobs[job], file ) ) {
+                close( file->fd );
+                trace_overlapping_span( file->span, "read", jobs[job].path,
+                                        "bytes", file->bytes );
+                for ( size_t i = 0; i < n_active; ++i ) {
+                    if ( active[i] == job ) {   // keep oldest files first
+                        memmove( &active[i], &active[i+1],
+                                 sizeof(size_t) * ( n_active - i - 1 ) );
+                        --n_active;
+                        break;
+                    }
+                }
+            }
+        }
+        __atomic_store_n( ring->cq_head, head, __ATOMIC_RELEASE );
+    }
+    free( active );
+    free( files );
+    return bytes;
+}
+#endif
+
+extern reader_t *new_reader( int depth, unsigned flags )
+{
+    reader_t *reader = malloc_or_exit( sizeof(reader_t) );
+    reader->depth = depth;
+    reader->flags = flags;
+    // page aligned buffers, as required by O_DIRECT
+    if ( 0 != posix_memalign( (void **)&reader->buffers, DIRECT_ALIGN,
+                              (size_t)depth * READ_BLOCK_SIZE ) ) {
+        exit( NO_MEMORY_ERROR );
+    }
+    reader->slots = NULL;
+    reader->use_uring = false;
+#ifndef NO_IO_URING
+    // the completion queue is twice as large as the submission queue
+    if ( 0 == ( flags & READ_MAPPED ) ) {
+        reader->use_uring = uring_init( &reader->ring, (unsigned)depth );
+    }
+#endif
+    if ( reader->use_uring ) {
+#ifndef NO_IO_URING
+        uring_register_buffers( reader );
+#endif
+        reader->slots = malloc_or_exit( sizeof(slot_t) * depth );
+        for ( int i = 0; i < depth; ++i ) {
+            reader->slots[i].state = SLOT_FREE;
+        }
+    } else {
+        start_pool( reader );
+    }
+    return reader;
+}
+
+extern void free_reader( reader_t *reader )
+{
+    if ( reader->use_uring ) {
+#ifndef NO_IO_URING
+        uring_exit( &reader->ring );    // also unregisters buffers
+#endif
+        free( reader->slots );
+    } else {
+        stop_pool( reader );
+    }
+    free( reader->buffers );
+    free( reader );
+}
+
+extern size_t read_files( reader_t *reader, const read_job_t *jobs, size_t n )
+{
+    size_t bytes;
+    build_schedule( reader, jobs, n );
+#ifndef NO_IO_URING
+    if ( reader->use_uring ) {
+        bytes = uring_read_files( reader, jobs, n );
+    } else {
+        bytes = pool_read_files( reader, jobs, n );
+    }
+#else
+    bytes = pool_read_files( reader, jobs, n );
+#endif
+    free_schedule( &reader->schedule );
+    return bytes;
+}
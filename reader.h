@@ -0,0 +1,85 @@
+#ifndef __READER_H__
+#define __READER_H__
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+/*
+    Read engine used to sample and hash file contents. A batch of files is
+    read with up to depth reads in flight at once, spread over as many files
+    as needed to keep the queue full, using io_uring with buffers registered
+    once. If io_uring is not available, a local pool of depth threads reads
+    the files with blocking reads instead.
+
+    With READ_MAPPED, the pool of threads is always used, and large files
+    are mapped instead of read, so that blocks are delivered straight from
+    the page cache.
+
+    Each file is read by ranges, in blocks delivered in order to the file
+    callback. Callbacks for different files may be called concurrently from
+    different threads, but never concurrently for the same file. If a file
+    cannot be opened, or read to the end of its ranges because of a read
+    error or of a short read once truncated, or because it is truncated
+    while it is mapped, the error is reported and the callback is called a
+    last time with NULL data: the blocks already delivered must be
+    discarded.
+
+    READ_NOCACHE and READ_DIRECT keep a scan from evicting the page cache
+    working set of other programs: with READ_NOCACHE, pages are dropped
+    from the page cache after each block (which also drops pages that were
+    cached before the scan), while READ_DIRECT bypasses the page cache with
+    O_DIRECT and aligned reads, if the file system supports it.
+
+    Reads are scheduled per device, according to the dev of each job: each
+    device has its own limit of reads in flight, files on rotational devices
+    are read in the order of their physical offset, and files already in
+    the page cache are read first.
+*/
+
+#define READ_MAPPED         ( 1 << 0 )  // map large files
+#define READ_NOCACHE        ( 1 << 1 )  // drop pages from cache once read
+#define READ_DIRECT         ( 1 << 2 )  // read with O_DIRECT
+
+#define DIRECT_ALIGN        4096        // O_DIRECT offset, length and buffer
+
+#define MAX_READ_RANGES     2       // e.g. head and tail samples
+
+typedef struct {
+    uint64_t        offset;
+    uint64_t        length;
+} read_range_t;
+
+// called for each block read, in file order (data is NULL if the file is
+// truncated or cannot be read)
+typedef void (*read_block_t)( void *context,
+                              const unsigned char *data, size_t len );
+
+typedef struct {
+    const char      *path;
+    uint64_t        dev;        // device of the file (st_dev)
+    read_range_t    ranges[MAX_READ_RANGES];
+    int             n_ranges;
+    read_block_t    process;
+    void            *context;
+} read_job_t;
+
+typedef struct _reader reader_t;
+
+// depth is the maximum number of reads in flight, flags are READ_xxx
+extern reader_t *new_reader( int depth, unsigned flags );
+extern void free_reader( reader_t *reader );
+
+// read all files in jobs and return the total number of bytes read
+extern size_t read_files( reader_t *reader, const read_job_t *jobs, size_t n );
+
+// Open a file for reading according to READ_NOCACHE and READ_DIRECT, or
+// return -1 with errno set. Without O_DIRECT support, the file is opened
+// for regular reads.
+extern int open_read_file( const char *path, unsigned flags );
+
+// to call after reading len bytes at offset, with the same flags
+extern void release_read_pages( int fd, uint64_t offset, size_t len,
+                                unsigned flags );
+
+#endif /* __READER_H__ */
@@ -0,0 +1,203 @@
+
+#include <stdint.h>
+#include <string.h>
+
+#include "simd.h"
+
+#ifdef X86_KERNELS
+#include <immintrin.h>
+#endif
+
+static kernel_set_t kernels = PORTABLE_KERNELS;
+
+static const char *KERNEL_NAMES[N_KERNELS] = {
+    "portable", "sse2", "avx2", "avx512"
+};
+
+// compare words, then bytes in the first word that differs
+static size_t portable_difference( const void *a, const void *b, size_t n )
+{
+    const unsigned char *p = a, *q = b;
+    size_t i = 0;
+    for ( ; i + sizeof(uint64_t) <= n; i += sizeof(uint64_t) ) {
+        uint64_t x, y;
+        memcpy( &x, p + i, sizeof(x) );
+        memcpy( &y, q + i, sizeof(y) );
+        if ( x != y ) {
+            break;
+        }
+    }
+    for ( ; i < n && p[i] == q[i]; ++i ) ;
+    return i;
+}
+
+#ifdef X86_KERNELS
+
+// Each version compares 4 vectors per iteration, and looks for the first
+// byte that differs only once some vector differs.
+
+__attribute__(( target( "sse2" ) ))
+static size_t sse2_difference( const void *a, const void *b, size_t n )
+{
+    const unsigned char *p = a, *q = b;
+    size_t i = 0;
+    for ( ; i + 64 <= n; i += 64 ) {
+        __m128i e0 = _mm_cmpeq_epi8( _mm_loadu_si128( (const __m128i *)( p + i ) ),
+                                     _mm_loadu_si128( (const __m128i *)( q + i ) ) );
+        __m128i e1 = _mm_cmpeq_epi8( _mm_loadu_si128( (const __m128i *)( p + i + 16 ) ),
+                                     _mm_loadu_si128( (const __m128i *)( q + i + 16 ) ) );
+        __m128i e2 = _mm_cmpeq_epi8( _mm_loadu_si128( (const __m128i *)( p + i + 32 ) ),
+                                     _mm_loadu_si128( (const __m128i *)( q + i + 32 ) ) );
+        __m128i e3 = _mm_cmpeq_epi8( _mm_loadu_si128( (const __m128i *)( p + i + 48 ) ),
+                                     _mm_loadu_si128( (const __m128i *)( q + i + 48 ) ) );
+        __m128i e = _mm_and_si128( _mm_and_si128( e0, e1 ), _mm_and_si128( e2, e3 ) );
+        if ( 0xffff != _mm_movemask_epi8( e ) ) {
+            break;
+        }
+    }
+    for ( ; i + 16 <= n; i += 16 ) {
+        unsigned same = (unsigned)_mm_movemask_epi8(
+                    _mm_cmpeq_epi8( _mm_loadu_si128( (const __m128i *)( p + i ) ),
+                                    _mm_loadu_si128( (const __m128i *)( q + i ) ) ) );
+        if ( 0xffff != same ) {
+            return i + (size_t)__builtin_ctz( ~same );
+        }
+    }
+    return i + portable_difference( p + i, q + i, n - i );
+}
+
+__attribute__(( target( "avx2" ) ))
+static size_t avx2_difference( const void *a, const void *b, size_t n )
+{
+    const unsigned char *p = a, *q = b;
+    size_t i = 0;
+    for ( ; i + 128 <= n; i += 128 ) {
+        __m256i e0 = _mm256_cmpeq_epi8( _mm256_loadu_si256( (const __m256i *)( p + i ) ),
+                                        _mm256_loadu_si256( (const __m256i *)( q + i ) ) );
+        __m256i e1 = _mm256_cmpeq_epi8( _mm256_loadu_si256( (const __m256i *)( p + i + 32 ) ),
+                                        _mm256_loadu_si256( (const __m256i *)( q + i + 32 ) ) );
+        __m256i e2 = _mm256_cmpeq_epi8( _mm256_loadu_si256( (const __m256i *)( p + i + 64 ) ),
+                                        _mm256_loadu_si256( (const __m256i *)( q + i + 64 ) ) );
+        __m256i e3 = _mm256_cmpeq_epi8( _mm256_loadu_si256( (const __m256i *)( p + i + 96 ) ),
+                                        _mm256_loadu_si256( (const __m256i *)( q + i + 96 ) ) );
+        __m256i e = _mm256_and_si256( _mm256_and_si256( e0, e1 ),
+                                      _mm256_and_si256( e2, e3 ) );
+        if ( -1 != _mm256_movemask_epi8( e ) ) {
+            break;
+        }
+    }
+    for ( ; i + 32 <= n; i += 32 ) {
+        unsigned same = (unsigned)_mm256_movemask_epi8(
+                _mm256_cmpeq_epi8( _mm256_loadu_si256( (const __m256i *)( p + i ) ),
+                                   _mm256_loadu_si256( (const __m256i *)( q + i ) ) ) );
+        if ( UINT32_MAX != same ) {
+            return i + (size_t)__builtin_ctz( ~same );
+        }
+    }
+    return i + portable_difference( p + i, q + i, n - i );
+}
+
+// the tail is compared with masked loads, which do not fault past n
+__attribute__(( target( "avx512f,avx512bw" ) ))
+static size_t avx512_difference( const void *a, const void *b, size_t n )
+{
+    const unsigned char *p = a, *q = b;
+    size_t i = 0;
+    for ( ; i + 256 <= n; i += 256 ) {
+        __mmask64 d0 = _mm512_cmpneq_epi8_mask( _mm512_loadu_si512( p + i ),
+                                                _mm512_loadu_si512( q + i ) );
+        __mmask64 d1 = _mm512_cmpneq_epi8_mask( _mm512_loadu_si512( p + i + 64 ),
+                                                _mm512_loadu_si512( q + i + 64 ) );
+        __mmask64 d2 = _mm512_cmpneq_epi8_mask( _mm512_loadu_si512( p + i + 128 ),
+                                                _mm512_loadu_si512( q + i + 128 ) );
+        __mmask64 d3 = _mm512_cmpneq_epi8_mask( _mm512_loadu_si512( p + i + 192 ),
+                                                _mm512_loadu_si512( q + i + 192 ) );
+        if ( 0 != ( d0 | d1 | d2 | d3 ) ) {
+            break;
+        }
+    }
+    for ( ; i < n; i += 64 ) {
+        __mmask64 k = ( n - i >= 64 ) ? ~(__mmask64)0 :
+                                        ( (__mmask64)1 << ( n - i ) ) - 1;
+        __mmask64 d = _mm512_mask_cmpneq_epi8_mask( k,
+                                _mm512_maskz_loadu_epi8( k, p + i ),
+                                _mm512_maskz_loadu_epi8( k, q + i ) );
+        if ( 0 != d ) {
+            return i + (size_t)__builtin_ctzll( d );
+        }
+    }
+    return n;
+}
+
+static size_t (*const DIFFERENCE[N_KERNELS])( const void *, const void *,
+                                              size_t ) = {
+    portable_difference, sse2_difference, avx2_difference, avx512_difference
+};
+
+extern bool kernels_supported( kernel_set_t set )
+{
+    __builtin_cpu_init( );
+    switch ( set ) {
+    case PORTABLE_KERNELS:
+    case SSE2_KERNELS:      // always there on x86-64
+        return true;
+    case AVX2_KERNELS:
+        return __builtin_cpu_supports( "avx2" );
+    case AVX512_KERNELS:
+        return __builtin_cpu_supports( "avx512f" ) &&
+               __builtin_cpu_supports( "avx512bw" );
+    default:
+        return false;
+    }
+}
+
+#else
+
+static size_t (*const DIFFERENCE[N_KERNELS])( const void *, const void *,
+                                              size_t ) = {
+    portable_difference, portable_difference,
+    portable_difference, portable_difference
+};
+
+extern bool kernels_supported( kernel_set_t set )
+{
+    return PORTABLE_KERNELS == set;
+}
+
+#endif
+
+// before main, so that the set never changes while threads run
+__attribute__(( constructor ))
+static void select_kernels( void )
+{
+    for ( int set = N_KERNELS - 1; set > PORTABLE_KERNELS; --set ) {
+        if ( kernels_supported( (kernel_set_t)set ) ) {
+            kernels = (kernel_set_t)set;
+            return;
+        }
+    }
+}
+
+extern const char *kernels_name( kernel_set_t set )
+{
+    return ( set < N_KERNELS ) ? KERNEL_NAMES[set] : "unknown";
+}
+
+extern kernel_set_t current_kernels( void )
+{
+    return kernels;
+}
+
+extern bool use_kernels( kernel_set_t set )
+{
+    if ( set >= N_KERNELS || ! kernels_supported( set ) ) {
+        return false;
+    }
+    kernels = set;
+    return true;
+}
+
+extern size_t first_difference( const void *a, const void *b, size_t n )
+{
+    return DIFFERENCE[kernels]( a, b, n );
+}
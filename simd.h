@@ -0,0 +1,45 @@
+#ifndef __SIMD_H__
+#define __SIMD_H__
+
+#include <stddef.h>
+#include <stdbool.h>
+
+/*
+    Kernels used on file contents, in several versions: portable C, and
+    SSE2, AVX2 and AVX-512 on x86-64. The best set supported by the
+    processor is chosen once at startup from CPUID (__builtin_cpu_supports)
+    and all kernels are called through it: byte comparison here, and the
+    BLAKE3 compression of many chunks at once in hash.c.
+
+    Another set can be selected before any thread starts, to measure each
+    version (see kbench.c).
+*/
+
+#if defined( __GNUC__ ) && defined( __x86_64__ )
+#define X86_KERNELS
+#endif
+
+typedef enum {
+    PORTABLE_KERNELS, SSE2_KERNELS, AVX2_KERNELS, AVX512_KERNELS,
+    N_KERNELS
+} kernel_set_t;
+
+extern bool kernels_supported( kernel_set_t set );
+extern const char *kernels_name( kernel_set_t set );
+
+// the set in use: the best one supported, unless another one was selected
+extern kernel_set_t current_kernels( void );
+
+// select a set. Return false if it is not supported.
+extern bool use_kernels( kernel_set_t set );
+
+// return the offset of the first byte that differs in a and b, or n if
+// their n bytes are the same
+extern size_t first_difference( const void *a, const void *b, size_t n );
+
+static inline bool same_bytes( const void *a, const void *b, size_t n )
+{
+    return first_difference( a, b, n ) == n;
+}
+
+#endif /* __SIMD_H__ */
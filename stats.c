@@ -0,0 +1,266 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <sys/resource.h>
+#include <stdatomic.h>
+
+#include "stats.h"
+
+#define MAX_PHASES      16
+#define MAX_STAGES      8
+#define N_CLASSES       32      // bucket classes, by powers of 2 files
+
+typedef struct {
+    const char      *name;
+    double          wall, cpu;  // seconds
+} phase_t;
+
+typedef struct {
+    const char      *name;
+    uint64_t        dropped, bytes, cached;
+} stage_t;
+
+static stats_format_t format = NO_STATS;
+static atomic_uint_fast64_t counts[N_COUNTS];
+static atomic_uint_fast64_t class_buckets[N_CLASSES], class_files[N_CLASSES];
+
+static phase_t phases[MAX_PHASES];
+static size_t n_phases;
+static phase_t *current;            // phase in progress, or NULL
+static double phase_wall, phase_cpu;    // at the start of current
+static double start_wall;           // when stats were enabled
+
+static stage_t stages[MAX_STAGES];
+static size_t n_stages;
+
+// text label and JSON key of each count
+static const char *COUNT_NAMES[N_COUNTS][2] = {
+    { "directories opened", "directories" },
+    { "directory entries read", "entries" },
+    { "stat calls", "stat_calls" },
+    { "files opened", "files_opened" },
+    { "files found different before their end", "short_cuts" }
+};
+
+static double clock_seconds( clockid_t clock )
+{
+    struct timespec ts;
+    clock_gettime( clock, &ts );
+    return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+}
+
+extern bool set_stats_format( const char *name )
+{
+    if ( 0 == strcmp( name, "text" ) ) {
+        format = TEXT_STATS;
+    } else if ( 0 == strcmp( name, "json" ) ) {
+        format = JSON_STATS;
+    } else {
+        return false;
+    }
+    start_wall = clock_seconds( CLOCK_MONOTONIC );
+    return true;
+}
+
+extern bool stats_enabled( void )
+{
+    return NO_STATS != format;
+}
+
+extern void add_count( count_t count, uint64_t n )
+{
+    if ( NO_STATS != format ) {
+        atomic_fetch_add_explicit( &counts[count], n, memory_order_relaxed );
+    }
+}
+
+extern void end_phase( void )
+{
+    if ( NULL == current ) {
+        return;
+    }
+    current->wall += clock_seconds( CLOCK_MONOTONIC ) - phase_wall;
+    current->cpu += clock_seconds( CLOCK_PROCESS_CPUTIME_ID ) - phase_cpu;
+    current = NULL;
+}
+
+// phases started again, e.g. for each target, add up
+extern void start_phase( const char *name )
+{
+    if ( NO_STATS == format ) {
+        return;
+    }
+    end_phase( );
+    for ( size_t i = 0; i < n_phases; ++i ) {
+        if ( 0 == strcmp( phases[i].name, name ) ) {
+            current = &phases[i];
+        }
+    }
+    if ( NULL == current ) {
+        if ( MAX_PHASES == n_phases ) {
+            return;
+        }
+        current = &phases[n_phases++];
+        current->name = name;
+    }
+    phase_wall = clock_seconds( CLOCK_MONOTONIC );
+    phase_cpu = clock_seconds( CLOCK_PROCESS_CPUTIME_ID );
+}
+
+// class k holds buckets of 2^k + 1 to 2^(k+1) files, and class 0 pairs
+extern void add_bucket( size_t n )
+{
+    if ( NO_STATS == format ) {
+        return;
+    }
+    int k = 0;
+    while ( k < N_CLASSES - 1 && ( (size_t)2 << k ) < n ) {
+        ++k;
+    }
+    atomic_fetch_add_explicit( &class_buckets[k], 1, memory_order_relaxed );
+    atomic_fetch_add_explicit( &class_files[k], n, memory_order_relaxed );
+}
+
+extern void add_stage( const char *name, uint64_t dropped, uint64_t bytes,
+                       uint64_t cached )
+{
+    if ( NO_STATS == format ) {
+        return;
+    }
+    stage_t *stage = NULL;
+    for ( size_t i = 0; i < n_stages; ++i ) {
+        if ( 0 == strcmp( stages[i].name, name ) ) {
+            stage = &stages[i];
+        }
+    }
+    if ( NULL == stage ) {
+        if ( MAX_STAGES == n_stages ) {
+            return;
+        }
+        stage = &stages[n_stages++];
+        memset( stage, 0, sizeof(stage_t) );
+        stage->name = name;
+    }
+    stage->dropped += dropped;
+    stage->bytes += bytes;
+    stage->cached += cached;
+}
+
+static uint64_t class_min( int k )
+{
+    return ( (uint64_t)1 << k ) + 1;
+}
+
+static uint64_t class_max( int k )
+{
+    return (uint64_t)2 << k;
+}
+
+static void write_text( FILE *out, double wall, double cpu, long peak_kb )
+{
+    fprintf( out, "Run statistics:\n" );
+    fprintf( out, "  %-12s %12s %12s\n", "phase", "wall (s)", "cpu (s)" );
+    for ( size_t i = 0; i < n_phases; ++i ) {
+        fprintf( out, "  %-12s %12.3f %12.3f\n",
+                 phases[i].name, phases[i].wall, phases[i].cpu );
+    }
+    fprintf( out, "  %-12s %12.3f %12.3f\n", "total", wall, cpu );
+    for ( int i = 0; i < N_COUNTS; ++i ) {
+        fprintf( out, "  %s: %lu\n", COUNT_NAMES[i][0],
+                 (unsigned long)atomic_load( &counts[i] ) );
+    }
+    if ( 0 != n_stages ) {
+        fprintf( out, "  %-12s %14s %16s %14s\n", "stage",
+                 "files dropped", "bytes read", "files cached" );
+        for ( size_t i = 0; i < n_stages; ++i ) {
+            fprintf( out, "  %-12s %14lu %16lu %14lu\n", stages[i].name,
+                     (unsigned long)stages[i].dropped,
+                     (unsigned long)stages[i].bytes,
+                     (unsigned long)stages[i].cached );
+        }
+    }
+    bool header = false;
+    for ( int k = 0; k < N_CLASSES; ++k ) {
+        uint64_t n = atomic_load( &class_buckets[k] );
+        if ( 0 == n ) {
+            continue;
+        }
+        if ( ! header ) {
+            fprintf( out, "  %-24s %12s %12s\n", "files per size bucket",
+                     "buckets", "files" );
+            header = true;
+        }
+        char range[48];
+        if ( class_min( k ) == class_max( k ) ) {
+            snprintf( range, sizeof(range), "%lu",
+                      (unsigned long)class_max( k ) );
+        } else {
+            snprintf( range, sizeof(range), "%lu-%lu",
+                      (unsigned long)class_min( k ),
+                      (unsigned long)class_max( k ) );
+        }
+        fprintf( out, "  %-24s %12lu %12lu\n", range, (unsigned long)n,
+                 (unsigned long)atomic_load( &class_files[k] ) );
+    }
+    fprintf( out, "  peak resident memory: %ld KB\n", peak_kb );
+}
+
+// phase and stage names are plain words, which need no escape
+static void write_json( FILE *out, double wall, double cpu, long peak_kb )
+{
+    fprintf( out, "{\"type\":\"stats\",\"phases\":[" );
+    for ( size_t i = 0; i < n_phases; ++i ) {
+        fprintf( out, "%s{\"name\":\"%s\",\"wall\":%.6f,\"cpu\":%.6f}",
+                 ( 0 == i ) ? "" : ",", phases[i].name,
+                 phases[i].wall, phases[i].cpu );
+    }
+    fprintf( out, "],\"wall\":%.6f,\"cpu\":%.6f,\"counts\":{", wall, cpu );
+    for ( int i = 0; i < N_COUNTS; ++i ) {
+        fprintf( out, "%s\"%s\":%lu", ( 0 == i ) ? "" : ",",
+                 COUNT_NAMES[i][1], (unsigned long)atomic_load( &counts[i] ) );
+    }
+    fprintf( out, "},\"stages\":[" );
+    for ( size_t i = 0; i < n_stages; ++i ) {
+        fprintf( out, "%s{\"name\":\"%s\",\"dropped\":%lu,\"bytes\":%lu,"
+                 "\"cached\":%lu}", ( 0 == i ) ? "" : ",", stages[i].name,
+                 (unsigned long)stages[i].dropped,
+                 (unsigned long)stages[i].bytes,
+                 (unsigned long)stages[i].cached );
+    }
+    fprintf( out, "],\"buckets\":[" );
+    bool first = true;
+    for ( int k = 0; k < N_CLASSES; ++k ) {
+        uint64_t n = atomic_load( &class_buckets[k] );
+        if ( 0 == n ) {
+            continue;
+        }
+        fprintf( out, "%s{\"min_files\":%lu,\"max_files\":%lu,"
+                 "\"buckets\":%lu,\"files\":%lu}", ( first ) ? "" : ",",
+                 (unsigned long)class_min( k ), (unsigned long)class_max( k ),
+                 (unsigned long)n,
+                 (unsigned long)atomic_load( &class_files[k] ) );
+        first = false;
+    }
+    fprintf( out, "],\"peak_rss_kb\":%ld}\n", peak_kb );
+}
+
+extern void write_stats( FILE *out )
+{
+    if ( NO_STATS == format ) {
+        return;
+    }
+    end_phase( );
+    double wall = clock_seconds( CLOCK_MONOTONIC ) - start_wall;
+    double cpu = clock_seconds( CLOCK_PROCESS_CPUTIME_ID );
+    struct rusage usage;
+    long peak_kb = ( 0 == getrusage( RUSAGE_SELF, &usage ) ) ?
+                                                    usage.ru_maxrss : 0;
+    if ( JSON_STATS == format ) {
+        write_json( out, wall, cpu, peak_kb );
+    } else {
+        write_text( out, wall, cpu, peak_kb );
+    }
+    fflush( out );
+}
@@ -0,0 +1,57 @@
+#ifndef __STATS_H__
+#define __STATS_H__
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+/*
+    Run statistics, written at the end of a run with option -s: wall and
+    CPU time of each phase, counts of the work done while walking, reading
+    and comparing, files dropped and bytes read at each elimination stage,
+    a histogram of size buckets by number of files, and the peak resident
+    memory. They are written as text, or as a single JSON object, to the
+    output of other messages (see output.h).
+
+    Counting is always compiled in, and costs only a test until stats are
+    enabled. Counts may be added by any thread, preferably once per batch
+    of work, while phases are started only by the main thread.
+*/
+
+typedef enum {
+    DIR_COUNT,          // directories opened by the walk
+    ENTRY_COUNT,        // directory entries read, other than . and ..
+    STAT_COUNT,         // stat calls
+    OPEN_COUNT,         // files opened to read their contents
+    SHORT_CUT_COUNT,    // files found different before the end was read
+    N_COUNTS
+} count_t;
+
+typedef enum {
+    NO_STATS, TEXT_STATS, JSON_STATS
+} stats_format_t;
+
+// enable stats once, before anything is counted. Return false if the
+// format name (text or json) is unknown.
+extern bool set_stats_format( const char *name );
+extern bool stats_enabled( void );
+
+extern void add_count( count_t count, uint64_t n );
+
+// start a phase, which ends the phase in progress if any
+extern void start_phase( const char *name );
+extern void end_phase( void );
+
+// a bucket of n files with the same size, about to be compared
+extern void add_bucket( size_t n );
+
+// files dropped, bytes read and files not read thanks to the cache at the
+// elimination stage name, added to the values already given for that stage
+extern void add_stage( const char *name, uint64_t dropped, uint64_t bytes,
+                       uint64_t cached );
+
+// end the phase in progress and write all stats to out, if enabled
+extern void write_stats( FILE *out );
+
+#endif /* __STATS_H__ */
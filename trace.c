@@ -0,0 +1,196 @@
+#define _GNU_SOURCE     // for SYS_gettid
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include "comp.h"
+#include "output.h"
+#include "trace.h"
+
+#define INITIAL_SPANS   1024
+#define MAX_SPANS       ( 1 << 22 )     // per thread, later spans are dropped
+
+typedef struct {
+    uint64_t        start, end;     // nanoseconds
+    const char      *name, *arg;
+    char            *path;          // allocated, or NULL
+    uint64_t        value;
+    bool            overlaps;
+} span_t;
+
+// spans of a thread, kept until the trace is written
+typedef struct _trace_buffer {
+    struct _trace_buffer *next;
+    long            tid;
+    span_t          *spans;
+    size_t          n_spans, max_spans;
+} trace_buffer_t;
+
+bool trace_on = false;
+
+static FILE *trace_file;
+static uint64_t origin;
+static pthread_mutex_t buffers_lock = PTHREAD_MUTEX_INITIALIZER;
+static trace_buffer_t *buffers;
+static atomic_size_t dropped;
+static _Thread_local trace_buffer_t *local;
+
+static void *malloc_or_exit( size_t size )
+{
+    void *d = malloc( size );
+    if ( NULL == d ) {
+        exit( NO_MEMORY_ERROR );
+    }
+    return d;
+}
+
+static uint64_t clock_ns( void )
+{
+    struct timespec ts;
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+    return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+extern bool set_trace_file( const char *path )
+{
+    trace_file = fopen( path, "w" );
+    if ( NULL == trace_file ) {
+        return false;
+    }
+    origin = clock_ns( );
+    trace_on = true;
+    return true;
+}
+
+extern uint64_t trace_clock( void )
+{
+    return clock_ns( ) - origin + 1;
+}
+
+static trace_buffer_t *local_buffer( void )
+{
+    if ( NULL == local ) {
+        local = malloc_or_exit( sizeof(trace_buffer_t) );
+        local->tid = syscall( SYS_gettid );
+        local->max_spans = INITIAL_SPANS;
+        local->spans = malloc_or_exit( sizeof(span_t) * local->max_spans );
+        local->n_spans = 0;
+        pthread_mutex_lock( &buffers_lock );
+        local->next = buffers;
+        buffers = local;
+        pthread_mutex_unlock( &buffers_lock );
+    }
+    return local;
+}
+
+extern void add_span( uint64_t start, const char *name, const char *path,
+                      const char *arg, uint64_t value, bool overlaps )
+{
+    uint64_t end = trace_clock( );
+    trace_buffer_t *b = local_buffer( );
+    if ( b->n_spans == b->max_spans ) {
+        if ( MAX_SPANS == b->max_spans ) {
+            atomic_fetch_add( &dropped, 1 );
+            return;
+        }
+        b->max_spans *= 2;
+        b->spans = realloc( b->spans, sizeof(span_t) * b->max_spans );
+        if ( NULL == b->spans ) {
+            exit( NO_MEMORY_ERROR );
+        }
+    }
+    span_t *span = &b->spans[b->n_spans++];
+    span->start = start;
+    span->end = end;
+    span->name = name;
+    span->arg = arg;
+    span->value = value;
+    span->overlaps = overlaps;
+    span->path = NULL;
+    if ( NULL != path ) {
+        span->path = malloc_or_exit( strlen( path ) + 1 );
+        strcpy( span->path, path );
+    }
+}
+
+static void write_args( FILE *out, const span_t *span )
+{
+    fprintf( out, ",\"args\":{" );
+    if ( NULL != span->path ) {
+        fprintf( out, "\"path\":" );
+        json_string( out, span->path );
+    }
+    if ( NULL != span->arg ) {
+        fprintf( out, "%s\"%s\":%lu", ( NULL != span->path ) ? "," : "",
+                 span->arg, (unsigned long)span->value );
+    }
+    fprintf( out, "}}" );
+}
+
+// Times are in microseconds. Nested spans are complete events ("X"), while
+// overlapping spans are pairs of async events ("b" and "e"), shown on their
+// own line.
+static void write_span( FILE *out, long pid, long tid, const span_t *span,
+                        uint64_t id )
+{
+    if ( ! span->overlaps ) {
+        fprintf( out, ",\n{\"name\":\"%s\",\"cat\":\"scan\",\"ph\":\"X\","
+                 "\"pid\":%ld,\"tid\":%ld,\"ts\":%.3f,\"dur\":%.3f",
+                 span->name, pid, tid, (double)span->start * 1e-3,
+                 (double)( span->end - span->start ) * 1e-3 );
+        write_args( out, span );
+        return;
+    }
+    fprintf( out, ",\n{\"name\":\"%s\",\"cat\":\"scan\",\"ph\":\"b\","
+             "\"id\":%lu,\"pid\":%ld,\"tid\":%ld,\"ts\":%.3f",
+             span->name, (unsigned long)id, pid, tid,
+             (double)span->start * 1e-3 );
+    write_args( out, span );
+    fprintf( out, ",\n{\"name\":\"%s\",\"cat\":\"scan\",\"ph\":\"e\","
+             "\"id\":%lu,\"pid\":%ld,\"tid\":%ld,\"ts\":%.3f}",
+             span->name, (unsigned long)id, pid, tid,
+             (double)span->end * 1e-3 );
+}
+
+extern void write_trace( void )
+{
+    if ( ! trace_on ) {
+        return;
+    }
+    long pid = (long)getpid( );
+    uint64_t id = 0;
+    fprintf( trace_file, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n" );
+    fprintf( trace_file, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%ld,"
+             "\"args\":{\"name\":\"scan\"}}", pid );
+    for ( trace_buffer_t *b = buffers; NULL != b; ) {
+        fprintf( trace_file, ",\n{\"name\":\"thread_name\",\"ph\":\"M\","
+                 "\"pid\":%ld,\"tid\":%ld,\"args\":{\"name\":\"%s %ld\"}}",
+                 pid, b->tid, ( pid == b->tid ) ? "main" : "thread", b->tid );
+        for ( size_t i = 0; i < b->n_spans; ++i ) {
+            write_span( trace_file, pid, b->tid, &b->spans[i], ++id );
+            free( b->spans[i].path );
+        }
+        trace_buffer_t *next = b->next;
+        free( b->spans );
+        free( b );
+        b = next;
+    }
+    fprintf( trace_file, "\n]}\n" );
+    if ( 0 != fclose( trace_file ) ) {
+        fprintf( info_output(), "Warning: failed to write the trace file\n" );
+    }
+    if ( 0 != atomic_load( &dropped ) ) {
+        fprintf( info_output(), "Warning: %lu spans dropped from the trace\n",
+                 (unsigned long)atomic_load( &dropped ) );
+    }
+    buffers = NULL;
+    local = NULL;
+    trace_on = false;
+}
@@ -0,0 +1,61 @@
+#ifndef __TRACE_H__
+#define __TRACE_H__
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+/*
+    Event tracing, with option -T: spans of work (directory opened or read,
+    batch of stat calls, file read, bucket compared...) are recorded by each
+    thread in its own buffer, and written at the end of the run in the
+    Chrome trace event format, to be loaded in chrome://tracing or Perfetto.
+    Each span is shown on the line of the thread that did it, which tells
+    whether a run waits on metadata, on reads or on the processor.
+
+    When tracing is disabled, trace_start returns 0 without reading the
+    clock, and trace_span does nothing with it.
+*/
+
+extern bool trace_on;       // set once, before any thread starts
+
+// enable tracing to path, or return false if it cannot be written
+extern bool set_trace_file( const char *path );
+
+// nanoseconds since the trace started, never 0
+extern uint64_t trace_clock( void );
+
+// Record a span named name from start until now, on the path of the file
+// or directory concerned, or NULL, with value named arg, or NULL. Spans of
+// a thread are nested or disjoint, unless they overlap other spans of the
+// thread, such as reads in flight at once.
+extern void add_span( uint64_t start, const char *name, const char *path,
+                      const char *arg, uint64_t value, bool overlaps );
+
+static inline uint64_t trace_start( void )
+{
+    return ( trace_on ) ? trace_clock( ) : 0;
+}
+
+static inline void trace_span( uint64_t start, const char *name,
+                               const char *path, const char *arg,
+                               uint64_t value )
+{
+    if ( 0 != start ) {
+        add_span( start, name, path, arg, value, false );
+    }
+}
+
+static inline void trace_overlapping_span( uint64_t start, const char *name,
+                                           const char *path, const char *arg,
+                                           uint64_t value )
+{
+    if ( 0 != start ) {
+        add_span( start, name, path, arg, value, true );
+    }
+}
+
+// write all spans recorded and close the trace file, if enabled
+extern void write_trace( void );
+
+#endif /* __TRACE_H__ */
@@ -0,0 +1,292 @@
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "comp.h"
+#include "tree.h"
+#include "output.h"
+
+#define DIR_DIGEST_TAG      "fdup directory"
+
+#define DIR_KEPT            1   // first directory of a group, not in a copy
+#define DIR_COPY            2   // next ones
+
+struct _tree {
+    pool_t          *pool;
+    dir_id_t        n_dirs;
+    digest_t        *digests;   // per directory
+    uint64_t        *sizes;     // of all files under each directory
+    uint8_t         *states;    // per directory, DIR_KEPT, DIR_COPY or 0
+    bool            *in_copy;   // per directory, if it is inside a copy
+    dir_id_t        *members;   // directories of all groups, group by group
+    size_t          *group_ends;    // end of each group in members
+    uint32_t        n_groups;
+};
+
+static void *malloc_or_exit( size_t size )
+{
+    void *d = malloc( size );
+    if ( NULL == d ) {
+        exit( NO_MEMORY_ERROR );
+    }
+    return d;
+}
+
+static int compare_items( const void *d1, const void *d2 )
+{
+    return digest_compare( d1, d2 );
+}
+
+static const tree_t *sorted_tree;   // only while sorting directories
+
+static int compare_dirs( const void *d1, const void *d2 )
+{
+    dir_id_t dir1 = *(const dir_id_t *)d1, dir2 = *(const dir_id_t *)d2;
+    int res = digest_compare( &sorted_tree->digests[dir1],
+                              &sorted_tree->digests[dir2] );
+    if ( 0 != res ) {
+        return res;
+    }
+    return ( dir1 < dir2 ) ? -1 : ( dir1 > dir2 );
+}
+
+// digest each directory from the sorted digests of its entries: files
+// first, then sub-directories once they are digested
+static void digest_dirs( tree_t *tree, const tree_file_t *files, size_t n )
+{
+    dir_id_t n_dirs = tree->n_dirs;
+    size_t *starts = malloc_or_exit( sizeof(size_t) * ( n_dirs + 1 ) );
+    size_t *ends = malloc_or_exit( sizeof(size_t) * ( n_dirs + 1 ) );
+    memset( starts, 0, sizeof(size_t) * ( n_dirs + 1 ) );
+    for ( size_t i = 0; i < n; ++i ) {
+        ++starts[files[i].dir];
+    }
+    for ( dir_id_t d = 0; d < n_dirs; ++d ) {
+        dir_id_t parent = pool_dir_parent( tree->pool, d );
+        if ( NO_DIR != parent ) {
+            ++starts[parent];
+        }
+    }
+    size_t offset = 0;
+    for ( dir_id_t d = 0; d < n_dirs; ++d ) {   // counts become first indexes
+        size_t count = starts[d];
+        starts[d] = ends[d] = offset;
+        offset += count;
+    }
+    digest_t *items = malloc_or_exit( sizeof(digest_t) * ( offset + 1 ) );
+    for ( size_t i = 0; i < n; ++i ) {
+        items[ends[files[i].dir]++] = files[i].digest;
+        tree->sizes[files[i].dir] += files[i].size;
+    }
+    for ( dir_id_t d = n_dirs; d-- > 0; ) {
+        size_t n_items = ends[d] - starts[d];
+        qsort( &items[starts[d]], n_items, sizeof(digest_t), compare_items );
+        hash_state_t state;
+        hash_init( &state );
+        hash_update( &state, DIR_DIGEST_TAG, sizeof(DIR_DIGEST_TAG) );
+        hash_update( &state, &items[starts[d]], sizeof(digest_t) * n_items );
+        hash_final( &state, &tree->digests[d] );
+
+        dir_id_t parent = pool_dir_parent( tree->pool, d );
+        if ( NO_DIR != parent && 0 != tree->sizes[d] ) {    // not empty
+            items[ends[parent]++] = tree->digests[d];
+            tree->sizes[parent] += tree->sizes[d];
+        }
+    }
+    free( items );
+    free( ends );
+    free( starts );
+}
+
+typedef struct {
+    char            *path;
+    dir_id_t        dir;
+} dir_path_t;
+
+static int compare_dir_paths( const void *d1, const void *d2 )
+{
+    return strcmp( ((const dir_path_t *)d1)->path,
+                   ((const dir_path_t *)d2)->path );
+}
+
+// return true if some ancestor of dir is a copy
+static bool inside_copy( const tree_t *tree, dir_id_t dir )
+{
+    for ( dir_id_t d = pool_dir_parent( tree->pool, dir ); NO_DIR != d;
+          d = pool_dir_parent( tree->pool, d ) ) {
+        if ( DIR_COPY == tree->states[d] ) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Group the directories that are not empty by digest. Then, in path order,
+// so that a directory comes after its ancestors, the first directory of a
+// group not inside a copy is kept, and the next ones are its copies.
+static void group_dirs( tree_t *tree )
+{
+    dir_id_t n_dirs = tree->n_dirs;
+    dir_id_t *dirs = malloc_or_exit( sizeof(dir_id_t) * ( n_dirs + 1 ) );
+    size_t n = 0;
+    for ( dir_id_t d = 0; d < n_dirs; ++d ) {
+        if ( 0 != tree->sizes[d] ) {
+            dirs[n++] = d;
+        }
+    }
+    sorted_tree = tree;
+    qsort( dirs, n, sizeof(dir_id_t), compare_dirs );
+
+    uint32_t *groups = malloc_or_exit( sizeof(uint32_t) * ( n_dirs + 1 ) );
+    tree->members = malloc_or_exit( sizeof(dir_id_t) * ( n + 1 ) );
+    tree->group_ends = malloc_or_exit( sizeof(size_t) * ( n / 2 + 1 ) );
+    size_t n_members = 0;
+    for ( size_t first = 0, last; first < n; first = last ) {
+        for ( last = first + 1;
+              last < n && same_digest( &tree->digests[dirs[last]],
+                                       &tree->digests[dirs[first]] );
+              ++last ) ;
+        if ( last - first == 1 ) {
+            continue;
+        }
+        for ( size_t i = first; i < last; ++i ) {
+            groups[dirs[i]] = tree->n_groups;
+            tree->members[n_members++] = dirs[i];
+        }
+        tree->group_ends[tree->n_groups++] = n_members;
+    }
+    free( dirs );
+
+    dir_path_t *order = malloc_or_exit( sizeof(dir_path_t) * ( n_members + 1 ) );
+    for ( size_t i = 0; i < n_members; ++i ) {
+        order[i].dir = tree->members[i];
+        order[i].path = pool_dir_path( tree->pool, tree->members[i] );
+    }
+    qsort( order, n_members, sizeof(dir_path_t), compare_dir_paths );
+    bool *kept = malloc_or_exit( sizeof(bool) * ( tree->n_groups + 1 ) );
+    memset( kept, 0, sizeof(bool) * ( tree->n_groups + 1 ) );
+    for ( size_t i = 0; i < n_members; ++i ) {
+        dir_id_t d = order[i].dir;
+        free( order[i].path );
+        if ( inside_copy( tree, d ) ) {
+            continue;
+        }
+        if ( kept[groups[d]] ) {
+            tree->states[d] = DIR_COPY;
+        } else {
+            kept[groups[d]] = true;
+            tree->states[d] = DIR_KEPT;
+        }
+    }
+    free( kept );
+    free( order );
+    free( groups );
+
+    for ( dir_id_t d = 0; d < n_dirs; ++d ) {   // parents first
+        dir_id_t parent = pool_dir_parent( tree->pool, d );
+        tree->in_copy[d] = DIR_COPY == tree->states[d] ||
+                           ( NO_DIR != parent && tree->in_copy[parent] );
+    }
+}
+
+extern tree_t *new_tree( pool_t *pool, const tree_file_t *files, size_t n )
+{
+    tree_t *tree = malloc_or_exit( sizeof(tree_t) );
+    tree->pool = pool;
+    tree->n_dirs = pool_n_dirs( pool );
+    tree->digests = malloc_or_exit( sizeof(digest_t) * ( tree->n_dirs + 1 ) );
+    tree->sizes = malloc_or_exit( sizeof(uint64_t) * ( tree->n_dirs + 1 ) );
+    memset( tree->sizes, 0, sizeof(uint64_t) * ( tree->n_dirs + 1 ) );
+    tree->states = malloc_or_exit( tree->n_dirs + 1 );
+    memset( tree->states, 0, tree->n_dirs + 1 );
+    tree->in_copy = malloc_or_exit( sizeof(bool) * ( tree->n_dirs + 1 ) );
+    tree->n_groups = 0;
+    digest_dirs( tree, files, n );
+    group_dirs( tree );
+    return tree;
+}
+
+extern void free_tree( tree_t *tree )
+{
+    free( tree->group_ends );
+    free( tree->members );
+    free( tree->in_copy );
+    free( tree->states );
+    free( tree->sizes );
+    free( tree->digests );
+    free( tree );
+}
+
+extern bool tree_in_copy( const tree_t *tree, dir_id_t dir )
+{
+    return NO_DIR != dir && tree->in_copy[dir];
+}
+
+typedef struct {
+    uint64_t        size;
+    const digest_t  *digest;
+    output_file_t   *dirs;
+    size_t          n;
+} dir_group_t;
+
+static int compare_paths( const void *f1, const void *f2 )
+{
+    return strcmp( ((const output_file_t *)f1)->path,
+                   ((const output_file_t *)f2)->path );
+}
+
+static int compare_groups( const void *g1, const void *g2 )
+{
+    const dir_group_t *dg1 = g1, *dg2 = g2;
+    if ( dg1->size != dg2->size ) {
+        return ( dg1->size < dg2->size ) ? -1 : 1;
+    }
+    return strcmp( dg1->dirs[0].path, dg2->dirs[0].path );
+}
+
+// a group is reported with the directory kept and its copies, if any
+extern size_t report_tree( const tree_t *tree, FILE *out )
+{
+    dir_group_t *groups = malloc_or_exit( sizeof(dir_group_t) *
+                                          ( tree->n_groups + 1 ) );
+    size_t n_groups = 0, copies = 0;
+    for ( uint32_t g = 0, start = 0; g < tree->n_groups;
+          start = tree->group_ends[g++] ) {
+        size_t end = tree->group_ends[g], n = 0;
+        for ( size_t i = start; i < end; ++i ) {
+            n += 0 != tree->states[tree->members[i]];
+        }
+        if ( n < 2 ) {      // all in copies, or no copy
+            continue;
+        }
+        dir_group_t *group = &groups[n_groups++];
+        group->size = tree->sizes[tree->members[start]];
+        group->digest = &tree->digests[tree->members[start]];
+        group->n = 0;
+        group->dirs = malloc_or_exit( sizeof(output_file_t) * n );
+        for ( size_t i = start; i < end; ++i ) {
+            dir_id_t d = tree->members[i];
+            if ( 0 == tree->states[d] ) {
+                continue;
+            }
+            output_file_t *dir = &group->dirs[group->n++];
+            dir->path = pool_dir_path( tree->pool, d );
+            dir->dev = dir->ino = 0;    // not kept for directories
+            dir->role = NULL;
+        }
+        qsort( group->dirs, group->n, sizeof(output_file_t), compare_paths );
+        copies += group->n - 1;
+    }
+    qsort( groups, n_groups, sizeof(dir_group_t), compare_groups );
+    for ( size_t g = 0; g < n_groups; ++g ) {
+        output_group( out, "directories", groups[g].size, groups[g].digest,
+                      groups[g].dirs, groups[g].n );
+        for ( size_t i = 0; i < groups[g].n; ++i ) {
+            free( (char *)groups[g].dirs[i].path );
+        }
+        free( groups[g].dirs );
+    }
+    free( groups );
+    return copies;
+}
@@ -0,0 +1,51 @@
+#ifndef __TREE_H__
+#define __TREE_H__
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "hash.h"
+#include "pool.h"
+
+/*
+    Identical directories. The digest of a directory is made from the
+    content digests of its files and of its sub-directories, sorted, so that
+    it depends neither on names nor on the order in which entries were
+    found: two directories with the same digest hold the same contents, in
+    the same tree shape. Empty files and directories holding only empty
+    files are ignored, as in all comparisons.
+
+    Directories are digested in decreasing id order, since a directory is
+    always added to the pool after its parent: all sub-directories of a
+    directory are done when its turn comes.
+
+    Directories are then taken in path order, so that a directory comes
+    after its ancestors: in each group, the first directory that is not
+    inside a copy is kept, and the next ones are its copies. Only the kept
+    directories with their copies are reported, and files inside copies can
+    be left out of the groups of identical files, since each of them is
+    identical to a file in a kept directory.
+*/
+
+typedef struct {
+    dir_id_t        dir;
+    uint64_t        size;
+    digest_t        digest;     // content digest, or unique to the inode
+} tree_file_t;
+
+typedef struct _tree tree_t;
+
+// digest all directories in pool from their n files, and group identical
+// directories
+extern tree_t *new_tree( pool_t *pool, const tree_file_t *files, size_t n );
+extern void free_tree( tree_t *tree );
+
+// return true if dir is a copy or is inside a copy
+extern bool tree_in_copy( const tree_t *tree, dir_id_t dir );
+
+// report the groups of identical directories, by size and path, and return
+// the number of copies reported
+extern size_t report_tree( const tree_t *tree, FILE *out );
+
+#endif /* __TREE_H__ */
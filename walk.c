@@ -0,0 +1,460 @@
+
+#define _GNU_SOURCE     // for statx
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <sys/syscall.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include "walk.h"
+#include "output.h"
+#include "stats.h"
+#include "trace.h"
+
+/*
+    Directory walk: each directory to scan is a task. Each walker thread has
+    its own deque of tasks. A thread pushes the sub-directories it finds at
+    the bottom of its own deque and pops from the bottom (depth first, which
+    keeps its working set small), while idle threads steal from the top of
+    other deques (the oldest, and likely largest, subtrees).
+
+    Directories are opened relative to their parent directory, and files are
+    queried with statx relative to their directory, so that the kernel never
+    resolves full paths. A directory stays open as long as some of its sub-
+    directories are waiting in a deque. Entries are read with getdents64 in
+    large batches.
+*/
+
+// directory being walked, shared by its sub-directory tasks
+typedef struct {
+    int             fd;
+    atomic_int      refs;       // self + sub-directory tasks not started
+} walk_dir_t;
+
+typedef struct {
+    walk_dir_t      *parent;    // NULL for root directories
+    char            *path;      // full path, built once per directory
+    const char      *name;      // name relative to parent, within path
+    const search_t  *search;    // root search path and its options
+    dir_id_t        dir_id;     // directory in pool
+} walk_task_t;
+
+#define INITIAL_DEQUE_SIZE  64
+
+typedef struct {
+    pthread_mutex_t lock;
+    walk_task_t     *tasks;
+    size_t          top, bottom;    // tasks[top] to tasks[bottom-1]
+    size_t          size;
+} task_deque_t;
+
+typedef struct {
+    task_deque_t    *deques;
+    int             n_workers;
+    pool_t          *pool;          // may be NULL
+    process_file_t  process;
+    void            *context;
+
+    atomic_size_t   pending;        // tasks queued or in progress
+    atomic_size_t   queued;         // tasks waiting in deques
+    atomic_int      n_idle;
+    pthread_mutex_t idle_lock;
+    pthread_cond_t  idle_cond;
+} walker_t;
+
+#define DIRENT_BUFFER_SIZE  ( 256 * 1024 )
+
+typedef struct {
+    walker_t        *walker;
+    int             id;
+    char            *dirents;       // getdents64 buffer
+} worker_t;
+
+// as returned by getdents64
+struct linux_dirent64 {
+    uint64_t        d_ino;
+    int64_t         d_off;
+    unsigned short  d_reclen;
+    unsigned char   d_type;
+    char            d_name[];
+};
+
+#define STATX_MASK  ( STATX_TYPE | STATX_SIZE | STATX_INO | \
+                      STATX_MTIME | STATX_CTIME )
+
+static void *malloc_or_exit( size_t size )
+{
+    void *d = malloc( size );
+    if ( NULL == d ) {
+        exit( NO_MEMORY_ERROR );
+    }
+    return d;
+}
+
+extern char *walk_path( const char *dir, const char *name )
+{
+    size_t cur_path_size = strlen( dir );
+    char *new_path = malloc_or_exit( cur_path_size + strlen( name ) + 2 );
+    strcpy( new_path, dir );
+    if ( 0 == cur_path_size || '/' != dir[cur_path_size-1] ) {
+        new_path[cur_path_size] = '/';
+        ++cur_path_size;
+    }
+    strcpy( new_path + cur_path_size, name );
+    return new_path;
+}
+
+extern void walk_stat_info( const struct stat *stat_data, file_info_t *info )
+{
+    info->size = stat_data->st_size;
+    info->dev = stat_data->st_dev;
+    info->ino = stat_data->st_ino;
+    info->mtime_ns = (int64_t)stat_data->st_mtim.tv_sec * 1000000000
+                                                + stat_data->st_mtim.tv_nsec;
+    info->ctime_ns = (int64_t)stat_data->st_ctim.tv_sec * 1000000000
+                                                + stat_data->st_ctim.tv_nsec;
+}
+
+static void statx_info( const struct statx *stx, file_info_t *info )
+{
+    info->size = stx->stx_size;
+    info->dev = makedev( stx->stx_dev_major, stx->stx_dev_minor );
+    info->ino = stx->stx_ino;
+    info->mtime_ns = (int64_t)stx->stx_mtime.tv_sec * 1000000000
+                                                + stx->stx_mtime.tv_nsec;
+    info->ctime_ns = (int64_t)stx->stx_ctime.tv_sec * 1000000000
+                                                + stx->stx_ctime.tv_nsec;
+}
+
+static void release_dir( walk_dir_t *dir )
+{
+    if ( 1 == atomic_fetch_sub( &dir->refs, 1 ) ) {
+        close( dir->fd );
+        free( dir );
+    }
+}
+
+static void init_deque( task_deque_t *deque )
+{
+    pthread_mutex_init( &deque->lock, NULL );
+    deque->tasks = malloc_or_exit( sizeof(walk_task_t) * INITIAL_DEQUE_SIZE );
+    deque->size = INITIAL_DEQUE_SIZE;
+    deque->top = deque->bottom = 0;
+}
+
+static void free_deque( task_deque_t *deque )
+{
+    free( deque->tasks );
+    pthread_mutex_destroy( &deque->lock );
+}
+
+static void push_bottom( task_deque_t *deque, walk_task_t *task )
+{
+    pthread_mutex_lock( &deque->lock );
+    if ( deque->bottom == deque->size ) {
+        if ( deque->top > 0 ) {         // reclaim space freed by thieves
+            memmove( deque->tasks, &deque->tasks[deque->top],
+                     sizeof(walk_task_t) * (deque->bottom - deque->top) );
+            deque->bottom -= deque->top;
+            deque->top = 0;
+        }
+        if ( deque->bottom == deque->size ) {
+            deque->size *= 2;
+            deque->tasks = realloc( deque->tasks,
+                                    sizeof(walk_task_t) * deque->size );
+            if ( NULL == deque->tasks ) {
+                exit( NO_MEMORY_ERROR );
+            }
+        }
+    }
+    deque->tasks[deque->bottom++] = *task;
+    pthread_mutex_unlock( &deque->lock );
+}
+
+static bool pop_bottom( task_deque_t *deque, walk_task_t *task )
+{
+    bool found = false;
+    pthread_mutex_lock( &deque->lock );
+    if ( deque->bottom > deque->top ) {
+        *task = deque->tasks[--deque->bottom];
+        found = true;
+    }
+    if ( deque->bottom == deque->top ) {
+        deque->bottom = deque->top = 0;
+    }
+    pthread_mutex_unlock( &deque->lock );
+    return found;
+}
+
+static bool steal_top( task_deque_t *deque, walk_task_t *task )
+{
+    bool found = false;
+    pthread_mutex_lock( &deque->lock );
+    if ( deque->bottom > deque->top ) {
+        *task = deque->tasks[deque->top++];
+        found = true;
+    }
+    if ( deque->bottom == deque->top ) {
+        deque->bottom = deque->top = 0;
+    }
+    pthread_mutex_unlock( &deque->lock );
+    return found;
+}
+
+static void add_task( walker_t *walker, int id, walk_task_t *task )
+{
+    atomic_fetch_add( &walker->pending, 1 );
+    atomic_fetch_add( &walker->queued, 1 );
+    push_bottom( &walker->deques[id], task );
+    if ( atomic_load( &walker->n_idle ) > 0 ) {
+        pthread_mutex_lock( &walker->idle_lock );
+        pthread_cond_signal( &walker->idle_cond );
+        pthread_mutex_unlock( &walker->idle_lock );
+    }
+}
+
+static bool get_task( walker_t *walker, int id, walk_task_t *task )
+{
+    bool found = pop_bottom( &walker->deques[id], task );
+    for ( int i = 1; ! found && i < walker->n_workers; ++i ) {
+        found = steal_top( &walker->deques[(id + i) % walker->n_workers], task );
+    }
+    if ( found ) {
+        atomic_fetch_sub( &walker->queued, 1 );
+    }
+    return found;
+}
+
+static void task_done( walker_t *walker )
+{
+    if ( 1 == atomic_fetch_sub( &walker->pending, 1 ) ) {
+        pthread_mutex_lock( &walker->idle_lock );   // last task: wake all up
+        pthread_cond_broadcast( &walker->idle_cond );
+        pthread_mutex_unlock( &walker->idle_lock );
+    }
+}
+
+static void add_sub_directory( worker_t *worker, walk_dir_t *dir,
+                               const walk_task_t *task, const char *name )
+{
+    walk_task_t sub;
+    sub.path = walk_path( task->path, name );
+    sub.name = sub.path + strlen( sub.path ) - strlen( name );
+    sub.search = task->search;
+    sub.dir_id = ( NULL == worker->walker->pool ) ? NO_DIR :
+                    pool_add_dir( worker->walker->pool, task->dir_id, name );
+    sub.parent = dir;
+    atomic_fetch_add( &dir->refs, 1 );      // released when sub is opened
+    add_task( worker->walker, worker->id, &sub );
+}
+
+static void process_directory( worker_t *worker, walk_task_t *task )
+{
+    walker_t *walker = worker->walker;
+
+//    printf( "Entering directory %s\n", task->path );
+    uint64_t span = trace_start( );
+    int dirfd = ( NULL == task->parent ) ?
+        open( task->path, O_RDONLY | O_DIRECTORY | O_CLOEXEC ) :
+        openat( task->parent->fd, task->name,
+                O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC );
+    if ( -1 == dirfd ) {
+        fprintf( info_output(),
+                 "Unable to open directory %s (errno %d) - exiting\n",
+                 task->path, errno );
+        exit(FILE_IO_ERROR);
+    }
+    trace_span( span, "open directory", task->path, NULL, 0 );
+    if ( NULL != task->parent ) {
+        release_dir( task->parent );
+    }
+    walk_dir_t *dir = malloc_or_exit( sizeof(walk_dir_t) );
+    dir->fd = dirfd;
+    atomic_init( &dir->refs, 1 );
+
+    walk_file_t file;
+    file.dir = task->path;
+    file.dir_id = task->dir_id;
+    uint64_t n_entries = 0, n_stats = 0;    // counted once per directory
+
+    while ( true ) {
+        span = trace_start( );
+        long nread = syscall( SYS_getdents64, dirfd,
+                              worker->dirents, DIRENT_BUFFER_SIZE );
+        if ( -1 == nread ) {
+            fprintf( info_output(),
+                     "Unable to read directory %s (errno %d) - exiting\n",
+                     task->path, errno );
+            exit(FILE_IO_ERROR);
+        }
+        if ( 0 == nread ) {
+            break;
+        }
+        trace_span( span, "read directory", task->path, "bytes", (uint64_t)nread );
+
+        // files of the batch of entries are queried one after the other
+        span = trace_start( );
+        uint64_t batch_stats = n_stats;
+        for ( long pos = 0; pos < nread; ) {
+            struct linux_dirent64 *de = (void *)(worker->dirents + pos);
+            pos += de->d_reclen;
+
+            unsigned char detype = de->d_type;
+            const char *dename = de->d_name;
+            if ( dename[0] == '.' ) {
+                if ( dename[1] == 0 || ( dename[1] == '.' && dename[2] == 0 ) )
+                    continue;       // skip parent and current directory
+            }
+            ++n_entries;
+
+            struct statx stx;
+            bool have_stx = false;
+            if ( DT_UNKNOWN == detype ) {   // some file systems never tell
+                ++n_stats;
+                if ( 0 == statx( dirfd, dename, AT_SYMLINK_NOFOLLOW,
+                                 STATX_MASK, &stx ) ) {
+                    have_stx = true;
+                    if ( S_ISREG( stx.stx_mode ) ) {
+                        detype = DT_REG;
+                    } else if ( S_ISDIR( stx.stx_mode ) ) {
+                        detype = DT_DIR;
+                    }
+                }
+            }
+
+            switch ( detype ) {
+            case DT_REG:
+                n_stats += ! have_stx;
+                if ( ! have_stx &&
+                     0 != statx( dirfd, dename, AT_SYMLINK_NOFOLLOW,
+                                 STATX_MASK, &stx ) ) {
+                    fprintf( info_output(),
+                             "unable to stat regular file %s/%s\n",
+                             task->path, dename );
+                    exit(FILE_IO_ERROR);
+                }
+                file.name = dename;
+                statx_info( &stx, &file.info );
+                walker->process( &file, task->search, walker->context );
+                break;
+            case DT_DIR:
+                if ( ! task->search->nosub ) {
+                    add_sub_directory( worker, dir, task, dename );
+                }
+                break;
+            default:
+                fprintf( info_output(),
+                         "Skipping special file %s/%s\n", task->path, dename );
+                break;
+            }
+        }
+        trace_span( span, "stat batch", task->path, "stats",
+                    n_stats - batch_stats );
+    }
+    add_count( DIR_COUNT, 1 );
+    add_count( ENTRY_COUNT, n_entries );
+    add_count( STAT_COUNT, n_stats );
+    release_dir( dir );
+    free( task->path );
+}
+
+static void *walk_worker( void *arg )
+{
+    worker_t *worker = arg;
+    walker_t *walker = worker->walker;
+    walk_task_t task;
+
+    while ( true ) {
+        if ( get_task( walker, worker->id, &task ) ) {
+            process_directory( worker, &task );
+            task_done( walker );
+            continue;
+        }
+        pthread_mutex_lock( &walker->idle_lock );
+        atomic_fetch_add( &walker->n_idle, 1 );
+        while ( 0 != atomic_load( &walker->pending ) &&
+                0 == atomic_load( &walker->queued ) ) {
+            pthread_cond_wait( &walker->idle_cond, &walker->idle_lock );
+        }
+        atomic_fetch_sub( &walker->n_idle, 1 );
+        pthread_mutex_unlock( &walker->idle_lock );
+        if ( 0 == atomic_load( &walker->pending ) ) {
+            break;
+        }
+    }
+    return NULL;
+}
+
+extern void walk_directories( const search_t *roots, size_t n_roots,
+                              int n_threads, pool_t *pool,
+                              process_file_t process, void *context )
+{
+    walker_t walker;
+    walker.n_workers = ( n_threads < 1 ) ? 1 : n_threads;
+    walker.pool = pool;
+    walker.process = process;
+    walker.context = context;
+
+    walker.deques = malloc_or_exit( sizeof(task_deque_t) * walker.n_workers );
+    for ( int i = 0; i < walker.n_workers; ++i ) {
+        init_deque( &walker.deques[i] );
+    }
+    atomic_init( &walker.pending, 0 );
+    atomic_init( &walker.queued, 0 );
+    atomic_init( &walker.n_idle, 0 );
+    pthread_mutex_init( &walker.idle_lock, NULL );
+    pthread_cond_init( &walker.idle_cond, NULL );
+
+    for ( size_t i = 0; i < n_roots; ++i ) {    // spread roots over workers
+        walk_task_t root;
+        root.path = malloc_or_exit( strlen( roots[i].path ) + 1 );
+        strcpy( root.path, roots[i].path );
+        root.name = root.path;
+        root.search = &roots[i];
+        root.dir_id = ( NULL == pool ) ? NO_DIR :
+                            pool_add_dir( pool, NO_DIR, roots[i].path );
+        root.parent = NULL;
+        add_task( &walker, i % walker.n_workers, &root );
+    }
+
+    pthread_t *threads = malloc_or_exit( sizeof(pthread_t) * walker.n_workers );
+    worker_t *workers = malloc_or_exit( sizeof(worker_t) * walker.n_workers );
+    for ( int i = 0; i < walker.n_workers; ++i ) {
+        workers[i].walker = &walker;
+        workers[i].id = i;
+        workers[i].dirents = malloc_or_exit( DIRENT_BUFFER_SIZE );
+    }
+    // the calling thread is the first worker
+    for ( int i = 1; i < walker.n_workers; ++i ) {
+        if ( 0 != pthread_create( &threads[i], NULL, walk_worker, &workers[i] ) ) {
+            fprintf( info_output(),
+                     "Unable to create walker thread - exiting\n" );
+            exit( INTERNAL_ERROR );
+        }
+    }
+    walk_worker( &workers[0] );
+    for ( int i = 1; i < walker.n_workers; ++i ) {
+        pthread_join( threads[i], NULL );
+    }
+    for ( int i = 0; i < walker.n_workers; ++i ) {
+        free( workers[i].dirents );
+    }
+    free( workers );
+    free( threads );
+
+    pthread_cond_destroy( &walker.idle_cond );
+    pthread_mutex_destroy( &walker.idle_lock );
+    for ( int i = 0; i < walker.n_workers; ++i ) {
+        free_deque( &walker.deques[i] );
+    }
+    free( walker.deques );
+}
@@ -0,0 +1,47 @@
+#ifndef __WALK_H__
+#define __WALK_H__
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <sys/stat.h>
+
+#include "comp.h"
+#include "pool.h"
+
+// file metadata collected during the walk
+typedef struct {
+    uint64_t        size;
+    uint64_t        dev, ino;
+    int64_t         mtime_ns, ctime_ns;
+} file_info_t;
+
+// A regular file found in directory dir. Its full path is not built during
+// the walk: callbacks build it with walk_path only if they need it.
+typedef struct {
+    const char      *dir;       // path of the directory containing the file
+    const char      *name;      // name of the file in that directory
+    dir_id_t        dir_id;     // directory in pool, if walking with a pool
+    file_info_t     info;
+} walk_file_t;
+
+// Called for each regular file found under the root directory given by
+// search. With more than one thread, it may be called concurrently.
+typedef void (*process_file_t)( const walk_file_t *file,
+                                const search_t *search, void *context );
+
+// Walk n_roots directory trees, with n_threads walking in parallel. Each
+// sub-directory is a separate task that any idle thread can steal. With a
+// single thread, the walk is done in the calling thread. If pool is not
+// NULL, all directories walked are added to pool.
+extern void walk_directories( const search_t *roots, size_t n_roots,
+                              int n_threads, pool_t *pool,
+                              process_file_t process, void *context );
+
+// return the full path (allocated) of name in directory dir
+extern char *walk_path( const char *dir, const char *name );
+
+// fill info with the result of stat, for files not found by walking
+extern void walk_stat_info( const struct stat *stat_data, file_info_t *info );
+
+#endif /* __WALK_H__ */